@@ -1,8 +1,11 @@
 #include "app.h"
+#include "syscall_dispatch.h"
+#include <array>
 #include <assert.h>
 #include <csignal>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <sys/ptrace.h>
 #include <sys/socket.h>
@@ -10,20 +13,23 @@
 
 using namespace std;
 
+static_assert(MESSAGE_TYPES <= AppMetrics::kMessageTypes, "we count our messages by type");
+
 App::App(const char* socket)
 {
   reserved_area = std::make_unique<MemoryArea_t>();
   init(socket);
 }
 
-void App::release_parent_memory_region(vector<string> memlayout) const
+// Unmaps what the app inherited from mc, but for what lies in
+// [keepStart, keepEnd): the app's own window
+void App::release_parent_memory_region(vector<string> memlayout, uintptr_t keepStart, uintptr_t keepEnd) const
 {
   // look for /usr/lib64/
   const char* token_lib = "/usr/lib64/";
   // const char* token_mc = "/build/mc";
   const char* token_stack = "[stack]";
-  const char* token_vvar = "[vvar]";
-  const char* token_vdso = "[vdso]";
+  // [vvar] and [vdso] are the process' own, not mc's: our libc reads the clock through them
   // const char* token_vsys = "[vsyscall]";
   const char* token_simgld = "/build/simgld";
   const char* token_space  = " ";
@@ -34,12 +40,10 @@ void App::release_parent_memory_region(vector<string> memlayout) const
     auto ret_lib = strstr(line, token_lib);
     // auto ret_mc = strstr(line, token_mc);
     auto ret_stack = strstr(line, token_stack);
-    auto ret_vvar = strstr(line, token_vvar);
-    auto ret_vdso = strstr(line, token_vdso);
     // auto ret_vsys = strstr(line, token_vsys);
     auto ret_simgld = strstr(line, token_simgld);
     if((ret_lib == nullptr) && (ret_simgld == nullptr)
-            && (ret_stack == nullptr) && (ret_vvar == nullptr) && (ret_vdso == nullptr) 
+            && (ret_stack == nullptr)
             /* && (ret_mc == nullptr) && (ret_vsys == nullptr) */)
       continue;
     auto token      = strtok(line, token_space);
@@ -47,39 +51,126 @@ void App::release_parent_memory_region(vector<string> memlayout) const
     auto begin_addr = strtoul(str_begin, nullptr, 16);
     auto str_end    = &token[strlen(str_begin) + 1];
     auto end_addr   = strtoul(str_end, nullptr, 16);
+    if (begin_addr < keepEnd && end_addr > keepStart)
+      continue;
     auto ret_munmap = munmap((void*)begin_addr, end_addr - begin_addr);
     if (ret_munmap != 0)
       DLOG(ERROR, "app %d: munmap %s-%s was NOT successful. err: %s\n", getpid(), str_begin, str_end, strerror(errno));
   }
 }
 
+// The window mc planned for the app, from the layout its loader left
 void App::get_reserved_memory_region(std::pair<void*, void*>& range)
 {
-  Area area;
-  bool found = false;
-  int mapsfd = open("/proc/self/maps", O_RDONLY);
-  if (mapsfd < 0) {
-    DLOG(ERROR, "Failed to open proc maps\n");
+  auto layout = WindowLayout::current();
+  if (layout == nullptr)
     return;
-  }
-  while (readMapsLine(mapsfd, &area)) {
-    if (strstr(area.name, "[stack]")) {
-      found = true;
-      break;
-    }
-  }
-  close(mapsfd);
+  reserved_area->start = (VA)layout->start;
+  reserved_area->end   = (VA)layout->end;
+  range.first          = reserved_area->start;
+  range.second         = reserved_area->end;
+}
 
-  if (found) {
-    reserved_area->start = (VA)area.addr - GB3;
-    reserved_area->end   = (VA)area.addr - GB1;
-    range.first          = reserved_area->start;
-    range.second         = reserved_area->end;
-  }
+// The slot mc's loader took for this process in the launch trace, if mc mapped one
+void App::find_launch_slot()
+{
+  auto layout = WindowLayout::current();
+  if (layout == nullptr || layout->trace == 0)
+    return;
+  // Only look at the trace if the loader left a registry behind it
+  auto registry = (const MappingRegistry*)layout->registry;
+  auto trace    = (LaunchTrace*)layout->trace;
+  if (registry->magic != MappingRegistry::kMagic || trace->magic != LaunchTrace::kMagic)
+    return;
+  launchSlot_ = trace->find(getpid());
+}
+
+// What the loader's heap did to serve our sbrk and brk calls; in mc's
+// process nothing is interposed and there is no registry to look at
+void App::log_heap() const
+{
+  auto layout = WindowLayout::current();
+  if (layout == nullptr || inProcess_)
+    return;
+  auto registry = (const MappingRegistry*)layout->registry;
+  if (registry->magic != MappingRegistry::kMagic || registry->heap == nullptr)
+    return;
+  const auto& stats = *registry->heap;
+  DLOG(INFO, "app %d: heap: %lu sbrk/brk calls, %lu commits, %lu decommits, %lu KB committed, peak %lu KB\n",
+       getpid(), (unsigned long)stats.calls, (unsigned long)stats.commits, (unsigned long)stats.decommits,
+       (unsigned long)(stats.committed / 1024), (unsigned long)(stats.peakCommitted / 1024));
+}
+
+// Our slot in the metrics page mc maps for its apps; a replica takes its own
+void App::claim_metrics_slot()
+{
+  auto layout  = WindowLayout::current();
+  auto metrics = layout != nullptr ? (AppMetrics*)layout->metrics : nullptr;
+  metrics_     = metrics != nullptr && metrics->magic == AppMetrics::kMagic ? metrics->claim(getpid()) : nullptr;
+}
+
+// Counted by type in our slot
+int App::send(const s_message_t& message)
+{
+  if (metrics_ != nullptr && (unsigned)message.type < AppMetrics::kMessageTypes)
+    AppMetrics::Slot::add(metrics_->sent[(int)message.type]);
+  return channel_->send(message);
+}
+
+void App::stamp_launch(LaunchPhase phase)
+{
+  if (launchSlot_ != nullptr)
+    launchSlot_->stamp(phase);
+}
+
+// The channel the SIGSYS handler forwards the watched syscalls on; none
+// while it changes
+static const Channel* dispatchChannel    = nullptr;
+static AppMetrics::Slot* dispatchMetrics = nullptr; // the slot the forwarded syscalls are counted in
+
+static void forward_syscall(long number, long result)
+{
+  static s_message_t event; // off the stack of the code we stopped
+  if (dispatchChannel == nullptr)
+    return;
+  auto savedErrno   = errno;
+  event.type        = MessageType::SYSCALL;
+  event.pid         = getpid();
+  event.syscall_nr  = number;
+  event.syscall_ret = result;
+  dispatchChannel->send(&event, offsetof(s_message_t, steps));
+  if (dispatchMetrics != nullptr)
+    AppMetrics::Slot::add(dispatchMetrics->sent[(int)MessageType::SYSCALL]);
+  errno = savedErrno;
+}
+
+// mc --syscall-dispatch: we trap our own syscalls and tell mc about the ones
+// it watches, and mc no longer traces us
+void App::install_dispatch()
+{
+  dispatchChannel = channel_.get();
+  dispatchMetrics = metrics_;
+  dispatch_       = SyscallDispatch::install(forward_syscall);
+  if (!dispatch_)
+    DLOG(ERROR, "app %d: no Syscall User Dispatch (%s), mc traces us instead\n", getpid(), strerror(errno));
 }
 
 void App::init(const char* socket)
 {
+  // Loaded in mc's own process: mc is a function call away, and not tracing us
+  auto layout = WindowLayout::current();
+  inProcess_  = layout != nullptr && layout->link != 0;
+  replay_     = layout != nullptr && layout->replay != 0;
+  graph_      = layout != nullptr && layout->graph != 0;
+  claim_metrics_slot();
+  if (inProcess_) {
+    channel_ = make_unique<Channel>((DirectLink*)layout->link, false);
+    s_message_t message{MessageType::LOADED, getpid()};
+    assert(send(message) == 0 && "Could not send the LOADED message.");
+    handle_message();
+    return;
+  }
+
   int fd   = str_parse_int(socket, "Socket id is not in a numeric format");
   channel_ = make_unique<Channel>(fd);
 
@@ -92,52 +183,146 @@ void App::init(const char* socket)
   auto str = ss.str().c_str();
   assert((type == SOCK_SEQPACKET) && str);
 
-  // Wait for the parent:
-  errno = 0;
+  if (layout != nullptr && layout->dispatch != 0)
+    install_dispatch();
+  SyscallDispatch::Allowed loading; // the app's own code runs in run_steps()
+
+  uint64_t tracemeTsc = 0, resumedTsc = 0;
+  if (!dispatch_) {
+    // Wait for the parent:
+    errno = 0;
 #if defined __linux__
-  ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
 #elif defined BSD
-  ptrace(PT_TRACE_ME, 0, nullptr, 0);
+    ptrace(PT_TRACE_ME, 0, nullptr, 0);
 #else
 #error "no ptrace equivalent coded for this platform"
 #endif
 
-  ss << "Could not wait for the parent (errno = %d: %s)" << errno << strerror(errno);
-  str = ss.str().c_str();
+    tracemeTsc = __rdtsc();
+
+    ss << "Could not wait for the parent (errno = %d: %s)" << errno << strerror(errno);
+    str = ss.str().c_str();
 
-  DLOG(NOISE, "app %d: before SIGSTOP\n", getpid());
-  assert((errno == 0 && raise(SIGSTOP) == 0) && str); // Wait for the parent to awake me
-  DLOG(NOISE, "app %d: PTRACE_CONT received\n", getpid());
+    DLOG(NOISE, "app %d: before SIGSTOP\n", getpid());
+    assert((errno == 0 && raise(SIGSTOP) == 0) && str); // Wait for the parent to awake me
+    DLOG(NOISE, "app %d: PTRACE_CONT received\n", getpid());
+    resumedTsc = __rdtsc();
+  }
 
   write_mmapped_ranges("app-completely_loaded-init()", getpid());
 
+  find_launch_slot();
+  if (launchSlot_ != nullptr && !dispatch_) {
+    launchSlot_->stamp(TRACEME_PHASE, tracemeTsc);
+    launchSlot_->stamp(RESUMED_PHASE, resumedTsc);
+  }
+  stamp_launch(LOADED_PHASE);
   s_message_t message{MessageType::LOADED, getpid()};
-  assert(channel_->send(message) == 0 && "Could not send the LOADED message.");
+  assert(send(message) == 0 && "Could not send the LOADED message.");
   handle_message();
   DLOG(ERROR, "never reach this line ...\n");
 }
 
-void App::handle_message() const
+// Runs in the zygote: forks a replica of the loaded app that talks to mc
+// over `socket` from now on.
+void App::spawn_replica(int socket)
+{
+  // Replicas are reaped by the kernel; mc follows them through ptrace
+  signal(SIGCHLD, SIG_IGN);
+  pid_t pid = fork();
+  if (pid < 0) {
+    DLOG(ERROR, "app %d: could not fork a replica: %s\n", getpid(), strerror(errno));
+    close(socket);
+    return;
+  }
+  if (pid > 0) {
+    close(socket);
+    return;
+  }
+
+  dispatchChannel = nullptr; // the zygote's, until we have our own
+  dispatchMetrics = nullptr;
+  signal(SIGCHLD, SIG_DFL);
+  channel_ = make_unique<Channel>(socket); // drops the zygote's channel
+  claim_metrics_slot();
+  if (snapshot_)
+    snapshot_->rebind();
+  if (metrics_ != nullptr && snapshot_)
+    AppMetrics::Slot::add(metrics_->snapshotBytes, snapshot_->size()); // our copy of the zygote's
+  if (dispatch_)
+    install_dispatch();
+  s_message_t message{MessageType::READY, getpid()};
+  tell_state(message);
+  assert(send(message) == 0 && "Could not send the READY message.");
+}
+
+// Runs `steps` transitions of the app, with its syscalls trapped under
+// --syscall-dispatch, and tells in `reply` what each left enabled and
+// where the app ends up. The app has no transitions of its own yet: none
+// is left enabled.
+void App::run_steps(uint32_t steps, s_message_t& reply)
+{
+  {
+    SyscallDispatch::Blocked stepping;
+    if (metrics_ != nullptr)
+      AppMetrics::Slot::add(metrics_->steps, steps);
+    for (uint32_t i = 0; i < steps; i++)
+      reply.choices[i] = 0;
+  }
+  tell_state(reply);
+}
+
+// The state we are in, for mc's state graph (graph_). The app does not hash
+// its state yet, nor has accepting states: with no fingerprint, mc tells the
+// states apart by its own ids rather than folding them into one node.
+void App::tell_state(s_message_t& message) const
+{
+  message.fingerprint = 0;
+  message.accepting   = 0;
+}
+
+void App::handle_message()
 {
   bool loop = true;  
   while (loop) {
+    // Waiting for mc, launching, resetting are none of the app's business:
+    // only its steps are trapped (run_steps())
+    SyscallDispatch::Allowed harness;
     std::array<char, sizeof(s_message_t)> message_buffer;
-    ssize_t received_size = channel_->receive(message_buffer.data(), message_buffer.size());
+    int fd                = -1;
+    ssize_t received_size = channel_->receive(message_buffer.data(), message_buffer.size(), true, &fd);
     assert(received_size >= 0 && "Could not receive commands from the parent");
 
     const s_message_t* message = (s_message_t*)message_buffer.data();
+    if (metrics_ != nullptr && (unsigned)message->type < AppMetrics::kMessageTypes)
+      AppMetrics::Slot::add(metrics_->received[(int)message->type]);
     switch (message->type) {
       case MessageType::CONTINUE:
         DLOG(INFO, "app %d: mc sent a %s message\n", getpid(), "CONTINUE");
         s_message_t base_message;
         base_message.type = MessageType::FINISH;
         base_message.pid  = getpid();
-        channel_->send(base_message);
+        run_steps(1, base_message);
+        send(base_message);
         break;
 
+      case MessageType::STEPS: {
+        // A step is what CONTINUE does, k times over, answered at once
+        auto steps = min(message->steps, MAX_CREDITS);
+        DLOG(INFO, "app %d: mc sent a %s message (%u steps)\n", getpid(), "STEPS", steps);
+        s_message_t base_message;
+        base_message.type  = MessageType::STEPPED;
+        base_message.pid   = getpid();
+        base_message.steps = steps;
+        run_steps(steps, base_message);
+        send(base_message);
+      } break;
+
       case MessageType::LAYOUT: {
         auto memlayout      = message->memlayout;
         auto memlayout_size = message->memlayout_size;
+        stamp_launch(LAYOUT_PHASE);
         DLOG(INFO, "app %d: mc sent a %s message\n", getpid(), "LAYOUT");
         vector<string> vec_memlayout;
         // cout << "memory layout of mc:" << endl;
@@ -147,16 +332,70 @@ void App::handle_message() const
           // cout << memlayout[i] << endl;
         }
         
-        release_parent_memory_region(vec_memlayout);
-        write_mmapped_ranges("app-after_release_mc_mem-handleMessage()", getpid());
+        // In mc's process, what mc has mapped is mc's, and a snapshot of the
+        // writable memory would take mc and the other apps along
+        if (!inProcess_) {
+          release_parent_memory_region(vec_memlayout, message->start_addr, message->end_addr);
+          write_mmapped_ranges("app-after_release_mc_mem-handleMessage()", getpid());
+
+          // The app is fully loaded: keep its writable memory for later resets
+          if (!replay_) {
+            snapshot_ = make_unique<UpperHalfSnapshot>();
+            if (!snapshot_->take())
+              snapshot_.reset();
+            else if (metrics_ != nullptr)
+              AppMetrics::Slot::add(metrics_->snapshotBytes, snapshot_->size());
+          }
+        }
+        stamp_launch(READY_PHASE);
+        launchSlot_ = nullptr; // mc frees the slot once it has the READY
         s_message_t base_message;
         base_message.type = MessageType::READY;
         base_message.pid  = getpid();
-        channel_->send(base_message);
+        tell_state(base_message);
+        send(base_message);
       } break;
 
+      case MessageType::RESET: {
+        DLOG(INFO, "app %d: mc sent a %s message\n", getpid(), "RESET");
+        if (!snapshot_) {
+          // mc would wait for a READY forever: DONE tells it we cannot go back
+          DLOG(ERROR, "app %d: no snapshot to reset to\n", getpid());
+          s_message_t base_message;
+          base_message.type = MessageType::DONE;
+          base_message.pid  = getpid();
+          send(base_message);
+          break;
+        }
+        auto start = LaunchTrace::now_ns();
+        snapshot_->restore();
+        if (metrics_ != nullptr) {
+          AppMetrics::Slot::add(metrics_->restores);
+          AppMetrics::Slot::add(metrics_->restoreNs, LaunchTrace::now_ns() - start);
+        }
+        s_message_t base_message;
+        base_message.type = MessageType::READY;
+        base_message.pid  = getpid();
+        tell_state(base_message);
+        send(base_message);
+      } break;
+
+      case MessageType::SPAWN:
+        DLOG(INFO, "app %d: mc sent a %s message\n", getpid(), "SPAWN");
+        if (fd < 0) {
+          DLOG(ERROR, "app %d: SPAWN came without a socket\n", getpid());
+          break;
+        }
+        spawn_replica(fd);
+        break;
+
       case MessageType::DONE:
         DLOG(INFO, "app %d: mc sent a %s message\n", getpid(), "DONE");
+        if (dispatch_)
+          DLOG(INFO, "app %d: %lu syscalls trapped, %lu forwarded to mc, %lu reissued\n", getpid(),
+               (unsigned long)SyscallDispatch::trapped(), (unsigned long)SyscallDispatch::forwarded(),
+               (unsigned long)SyscallDispatch::reissued());
+        log_heap();
         // loop = false;
         break;
 
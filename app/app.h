@@ -2,16 +2,37 @@
 #define APP_H
 
 #include <memory>
+#include "app_metrics.hpp"
 #include "channel.hpp"
 #include "global.hpp"
+#include "launch_trace.hpp"
+#include "mapping_registry.hpp"
+#include "upper_half_snapshot.h"
+#include "window_layout.hpp"
 
 class App {
 private:
-  void handle_message() const;
+  void handle_message();
+  void run_steps(uint32_t steps, s_message_t& reply);
+  void tell_state(s_message_t& message) const;
+  void spawn_replica(int socket);
   std::unique_ptr<MemoryArea_t> reserved_area;
   void init(const char* socket);
   unique_ptr<Channel> channel_;
-  void release_parent_memory_region(vector<string> memlayout) const;
+  unique_ptr<UpperHalfSnapshot> snapshot_; // state right after loading, for RESET
+  LaunchTrace::Slot* launchSlot_ = nullptr; // until READY
+  AppMetrics::Slot* metrics_     = nullptr; // ours in the page mc scrapes, if mc mapped one
+  bool inProcess_                = false;   // loaded in mc's process, see DirectLink
+  bool dispatch_                 = false;   // our syscalls are trapped by SyscallDispatch, not traced by mc
+  bool replay_                   = false;   // mc replays a recorded path: no RESET comes
+  bool graph_                    = false;   // mc records the state graph: tell it our state
+  void install_dispatch();
+  void find_launch_slot();
+  void claim_metrics_slot();
+  void log_heap() const;
+  int send(const s_message_t& message);
+  void stamp_launch(LaunchPhase phase);
+  void release_parent_memory_region(vector<string> memlayout, uintptr_t keepStart, uintptr_t keepEnd) const;
 
 public:
   explicit App(const char* socket);
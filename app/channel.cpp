@@ -10,9 +10,36 @@ Channel::~Channel()
     close(socket_);
 }
 
-int Channel::send(const void* message, size_t size) const
+int Channel::send(const void* message, size_t size, int fd) const
 {
-  while (::send(socket_, message, size, 0) == -1) {
+  if (link_ != nullptr) {
+    if (fd >= 0)
+      return EINVAL; // no file descriptors within a process
+    // The app waits for mc to take its previous message
+    while (!host_ && link_->toHost.size != 0)
+      link_->yield();
+    return DirectLink::post(host_ ? link_->toApp : link_->toHost, message, size) ? 0 : EMSGSIZE;
+  }
+
+  struct iovec iov = {const_cast<void*>(message), size};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov    = &iov;
+  msg.msg_iovlen = 1;
+
+  char control[CMSG_SPACE(sizeof(int))];
+  if (fd >= 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    auto* cmsg         = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level   = SOL_SOCKET;
+    cmsg->cmsg_type    = SCM_RIGHTS;
+    cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  while (::sendmsg(socket_, &msg, 0) == -1) {
     if (errno != EINTR) {
       cout << "Channel::send failure: " << strerror(errno) << endl;
       return errno;
@@ -21,10 +48,46 @@ int Channel::send(const void* message, size_t size) const
   return 0;
 }
 
-size_t Channel::receive(void* message, size_t size, bool block) const
+size_t Channel::receive(void* message, size_t size, bool block, int* fd) const
 {
-  ssize_t res = recv(socket_, message, size, block ? 0 : MSG_DONTWAIT);
-  if (res == -1)
+  if (link_ != nullptr) {
+    if (fd != nullptr)
+      *fd = -1;
+    // The app runs mc until it gets a message; mc never waits for one
+    while (!host_ && link_->toApp.size == 0)
+      link_->yield();
+    auto& box = host_ ? link_->toHost : link_->toApp;
+    if (box.size == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    return DirectLink::take(box, message, size);
+  }
+
+  if (fd == nullptr) {
+    ssize_t res = recv(socket_, message, size, block ? 0 : MSG_DONTWAIT);
+    if (res == -1 && !(errno == EAGAIN && !block)) // an empty channel is no failure when we do not wait
+      cout << "Channel::receive failure: " << strerror(errno) << endl;
+    return res;
+  }
+
+  struct iovec iov = {message, size};
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  *fd         = -1;
+  ssize_t res = recvmsg(socket_, &msg, (block ? 0 : MSG_DONTWAIT) | MSG_CMSG_CLOEXEC);
+  if (res == -1) {
     cout << "Channel::receive failure: " << strerror(errno) << endl;
+    return res;
+  }
+  for (auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
   return res;
 }
\ No newline at end of file
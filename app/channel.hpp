@@ -1,12 +1,16 @@
 #ifndef CHANNEL_HPP
 #define CHANNEL_HPP
 
+#include "direct_link.hpp"
 #include "global.hpp"
 #include <string>
 
 using namespace std;
 
-enum class MessageType { NONE, LOADED, READY, CONTINUE, FINISH, DONE, LAYOUT};
+enum class MessageType { NONE, LOADED, READY, CONTINUE, FINISH, DONE, LAYOUT, SPAWN, RESET, SYSCALL, STEPS, STEPPED};
+static const char* messageTypeNames[] = {"NONE",   "LOADED", "READY", "CONTINUE", "FINISH", "DONE",
+                                         "LAYOUT", "SPAWN",  "RESET", "SYSCALL",  "STEPS",  "STEPPED"};
+constexpr unsigned MESSAGE_TYPES = sizeof(messageTypeNames) / sizeof(messageTypeNames[0]);
 
 /* Child->Parent */
 struct s_message_t {
@@ -14,6 +18,17 @@ struct s_message_t {
   pid_t pid;
   std::uint64_t start_addr;
   std::uint64_t end_addr;  
+  std::int64_t syscall_nr; // SYSCALL: what the app ran, see SyscallDispatch
+  std::int64_t syscall_ret;
+  // STEPS: mc grants the app `steps` steps at once, with the transition of
+  // each; STEPPED: the app ran `steps` steps, and tells what each left enabled
+  std::uint32_t steps;
+  std::int32_t choices[MAX_CREDITS];
+  // READY, FINISH, STEPPED: the state the app is in, when mc records its
+  // state graph (WindowLayout::graph): a hash of it, 0 if none, and whether
+  // it is accepting
+  std::uint64_t fingerprint;
+  std::uint32_t accepting;
   int memlayout_size;
   char memlayout[256][512];  
 };
@@ -21,6 +36,8 @@ struct s_message_t {
 class Channel {
 private:
   int socket_{-1};
+  DirectLink* link_ = nullptr; // instead of the socket, for an app in mc's process
+  bool host_        = false;   // our side of the link: mc's or the app's
   template <class M> static constexpr bool messageType()
   {
     return std::is_trivial<M>::value && std::is_class<M>::value;
@@ -28,27 +45,29 @@ private:
 
 public:
   explicit Channel(int socket) : socket_(socket) {}
+  explicit Channel(DirectLink* link, bool host) : link_(link), host_(host) {}
   ~Channel();
 
   // no copy
   Channel(const Channel&) = delete;
   Channel& operator=(const Channel&) = delete;
 
-  // send
-  int send(const void* message, size_t size) const;
+  // send, possibly passing a file descriptor along (SCM_RIGHTS)
+  int send(const void* message, size_t size, int fd = -1) const;
   template <class M> typename std::enable_if_t<messageType<M>(), int> send(M const& m) const
   {
     return this->send(&m, sizeof(M));
   }
 
-  // receive
-  size_t receive(void* message, size_t size, bool block = true) const;
+  // receive; a file descriptor passed along the message is returned in `fd`
+  size_t receive(void* message, size_t size, bool block = true, int* fd = nullptr) const;
   template <class M> typename std::enable_if_t<messageType<M>(), ssize_t> receive(M& m) const
   {
     return this->receive(&m, sizeof(M));
   }
 
   inline int get_socket() const { return socket_; }
+  inline DirectLink* get_link() const { return link_; }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "syscall_dispatch.h"
+#include "watched_syscalls.hpp"
+#include <linux/sched.h>
+#include <sys/syscall.h>
+
+#ifndef SA_RESTORER
+#define SA_RESTORER 0x04000000
+#endif
+#ifndef SYS_USER_DISPATCH
+#define SYS_USER_DISPATCH 2 // si_code of the SIGSYS raised by the dispatch
+#endif
+
+volatile uint8_t SyscallDispatch::selector_        = SYSCALL_DISPATCH_FILTER_ALLOW;
+bool SyscallDispatch::paused_                      = false;
+SyscallDispatch::Forward SyscallDispatch::forward_ = nullptr;
+bool SyscallDispatch::installed_                   = false;
+uint64_t SyscallDispatch::trapped_                 = 0;
+uint64_t SyscallDispatch::forwarded_               = 0;
+uint64_t SyscallDispatch::reissued_                = 0;
+
+// The handler's way back: rt_sigreturn, from the one range of code the
+// dispatch lets through whatever the selector says
+extern "C" char sgld_dispatch_restorer[], sgld_dispatch_restorer_end[];
+asm(".pushsection .text.sgld_dispatch, \"ax\", @progbits\n"
+    ".globl sgld_dispatch_restorer, sgld_dispatch_restorer_end\n"
+    ".hidden sgld_dispatch_restorer, sgld_dispatch_restorer_end\n"
+    "sgld_dispatch_restorer:\n"
+    "  mov $15, %eax\n" // SYS_rt_sigreturn
+    "  syscall\n"
+    "  ud2\n" // the kernel checks where the syscall returns to: keep that in the range
+    "sgld_dispatch_restorer_end:\n"
+    ".popsection");
+
+// The kernel's struct sigaction: sigaction() of glibc puts its own restorer in
+struct KernelSigaction {
+  void (*handler)(int, siginfo_t*, void*);
+  unsigned long flags;
+  void (*restorer)();
+  uint64_t mask;
+};
+
+// A syscall made without libc, which would set the errno of the code we stopped
+static inline long raw_syscall(long number, long a1, long a2, long a3, long a4, long a5, long a6)
+{
+  long result;
+  register long r10 asm("r10") = a4;
+  register long r8 asm("r8")   = a5;
+  register long r9 asm("r9")   = a6;
+  asm volatile("syscall"
+               : "=a"(result)
+               : "a"(number), "D"(a1), "S"(a2), "d"(a3), "r"(r10), "r"(r8), "r"(r9)
+               : "rcx", "r11", "memory");
+  return result;
+}
+
+bool SyscallDispatch::install(Forward forward)
+{
+  forward_ = forward;
+  KernelSigaction action;
+  action.handler  = handle;
+  action.flags    = SA_SIGINFO | SA_RESTORER;
+  action.restorer = (void (*)())sgld_dispatch_restorer;
+  action.mask     = ~0ULL; // no other handler runs within ours, their syscalls would be trapped
+  if (raw_syscall(SYS_rt_sigaction, SIGSYS, (long)&action, 0, sizeof(action.mask), 0, 0) != 0)
+    return false;
+
+  // Installed again (in a forked process): the scopes are as they were
+  uint8_t selector = installed_ ? selector_ : SYSCALL_DISPATCH_FILTER_BLOCK;
+  selector_        = SYSCALL_DISPATCH_FILTER_ALLOW;
+  if (prctl(PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_ON, (unsigned long)sgld_dispatch_restorer,
+            (unsigned long)(sgld_dispatch_restorer_end - sgld_dispatch_restorer), &selector_) != 0)
+    return false;
+  installed_ = true;
+  paused_    = false;
+  selector_  = selector;
+  return true;
+}
+
+void SyscallDispatch::resume()
+{
+  paused_ = false;
+  if (prctl(PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_ON, (unsigned long)sgld_dispatch_restorer,
+            (unsigned long)(sgld_dispatch_restorer_end - sgld_dispatch_restorer), &selector_) != 0)
+    installed_ = false;
+}
+
+// Whether a clone leaves the child where the parent is, on a copy of its
+// stack: then it runs in the handler, and the child returns from it too.
+// vfork is run as the fork it may be, as the child would return on the
+// stack frame of the parent's handler otherwise.
+bool SyscallDispatch::forks(long number, const greg_t* regs)
+{
+  if (number == SYS_vfork)
+    return true;
+  if (number == SYS_clone)
+    return (regs[REG_RDI] & CLONE_VM) == 0 && regs[REG_RSI] == 0;
+  if (number == SYS_clone3) {
+    auto args = (const clone_args*)regs[REG_RDI];
+    return (args->flags & CLONE_VM) == 0 && args->stack == 0;
+  }
+  return false;
+}
+
+// rt_sigprocmask, on the mask of the code we stopped: the handler runs with
+// all signals blocked, and its return puts that mask back. SIGSYS is never
+// blocked, as a syscall trapped then would kill the app.
+static long mask_signals(ucontext_t* context, long how, const uint64_t* set, uint64_t* oldset, size_t size)
+{
+  auto mask = (uint64_t*)&context->uc_sigmask; // the kernel's sigset, 64 bits
+  if (size != sizeof(*mask))
+    return -EINVAL;
+  auto old = *mask;
+  if (set != nullptr) {
+    if (how == SIG_BLOCK)
+      *mask |= *set;
+    else if (how == SIG_UNBLOCK)
+      *mask &= ~*set;
+    else if (how == SIG_SETMASK)
+      *mask = *set;
+    else
+      return -EINVAL;
+    *mask &= ~((1ULL << (SIGKILL - 1)) | (1ULL << (SIGSTOP - 1)) | (1ULL << (SIGSYS - 1)));
+  }
+  if (oldset != nullptr)
+    *oldset = old;
+  return 0;
+}
+
+void SyscallDispatch::handle(int, siginfo_t* info, void* context)
+{
+  if (info->si_code != SYS_USER_DISPATCH)
+    return; // not ours (seccomp), and our syscalls stay as they were
+  selector_ = SYSCALL_DISPATCH_FILTER_ALLOW;
+  trapped_++;
+  auto regs     = ((ucontext_t*)context)->uc_mcontext.gregs;
+  long number   = info->si_syscall;
+  bool watched  = forward_ != nullptr && watched_syscall(number) != nullptr;
+  bool noReturn = number == SYS_exit || number == SYS_exit_group || number == SYS_execve || number == SYS_execveat;
+  bool forking  = forks(number, regs);
+  // A clone that starts a thread: the thread begins on a stack of its own,
+  // not in the handler. It is made again where it was made, with the
+  // dispatch off until a scope turns it back on.
+  bool reissue = (number == SYS_clone || number == SYS_clone3) && !forking;
+  if (watched && (noReturn || reissue)) {
+    forwarded_++;
+    forward_(number, 0);
+  }
+
+  if (number == SYS_rt_sigreturn) {
+    // The return of a handler of the app's: made again from our restorer,
+    // which is let through, on the frame the app's restorer had
+    regs[REG_RIP] = (greg_t)sgld_dispatch_restorer;
+    selector_     = SYSCALL_DISPATCH_FILTER_BLOCK;
+    return;
+  }
+  if (reissue) {
+    reissued_++;
+    paused_ = raw_syscall(SYS_prctl, PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_OFF, 0, 0, 0, 0) == 0;
+    regs[REG_RIP] -= 2; // the size of the syscall instruction
+    regs[REG_RAX] = number;
+    selector_     = SYSCALL_DISPATCH_FILTER_BLOCK;
+    return;
+  }
+  if (number == SYS_vfork)
+    number = SYS_fork;
+  if (number == SYS_rt_sigprocmask)
+    regs[REG_RAX] = mask_signals((ucontext_t*)context, regs[REG_RDI], (const uint64_t*)regs[REG_RSI],
+                                 (uint64_t*)regs[REG_RDX], regs[REG_R10]);
+  else
+    regs[REG_RAX] = raw_syscall(number, regs[REG_RDI], regs[REG_RSI], regs[REG_RDX], regs[REG_R10], regs[REG_R8],
+                                regs[REG_R9]);
+  // The child of a fork returns from here as well: mc hears of the fork from the parent
+  if (watched && !noReturn && !(forking && regs[REG_RAX] == 0)) {
+    forwarded_++;
+    forward_(info->si_syscall, regs[REG_RAX]);
+  }
+  selector_ = SYSCALL_DISPATCH_FILTER_BLOCK;
+}
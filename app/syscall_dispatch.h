@@ -0,0 +1,79 @@
+#ifndef SYSCALL_DISPATCH_H
+#define SYSCALL_DISPATCH_H
+
+#include "global.hpp"
+#include <cstdint>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <ucontext.h>
+
+// Syscall User Dispatch (PR_SET_SYSCALL_USER_DISPATCH, Linux 5.11): while
+// the selector byte says BLOCK, each syscall of the thread raises a SIGSYS
+// instead. The handler runs the syscall on the thread's behalf, with the
+// selector at ALLOW, and tells `forward` about the ones mc watches (see
+// watched_syscalls.hpp). The app learns this way what ptrace stops would
+// have told mc, without a round trip through mc for each of them.
+//
+// The handler returns through a restorer stub of its own, the only code the
+// dispatch always lets through, so that its rt_sigreturn is not trapped.
+// The app's own signal handlers return through it too, and a fork (clone
+// without CLONE_VM, vfork) runs in the handler like any other syscall. A
+// clone that starts a thread cannot: it is made again with the dispatch
+// off, as the thread would inherit it with no handler to take it through
+// its start, and the next scope to begin or end turns it back on for us
+// (reissued()). The app's threads are not trapped.
+class SyscallDispatch {
+public:
+  // Called from the SIGSYS handler, with the selector at ALLOW. The syscalls
+  // that may not return (exit, execve, a thread's clone) are forwarded before
+  // they run, with a result of 0; the others once they ran, in the parent
+  // only for a fork.
+  typedef void (*Forward)(long number, long result);
+
+  // Turns the dispatch on for the calling thread, with the selector at
+  // BLOCK, or as it was if already installed; false if the kernel does not
+  // have it
+  static bool install(Forward forward);
+  static inline bool installed() { return installed_; }
+
+  static inline uint64_t trapped() { return trapped_; }
+  static inline uint64_t forwarded() { return forwarded_; }
+  static inline uint64_t reissued() { return reissued_; }
+
+  // The syscalls of a scope go through (Allowed) or are trapped (Blocked)
+  template <uint8_t selector> class Scope {
+    uint8_t previous_;
+
+  public:
+    Scope() : previous_(selector_)
+    {
+      selector_ = selector;
+      if (paused_)
+        resume();
+    }
+    ~Scope()
+    {
+      selector_ = previous_;
+      if (paused_)
+        resume();
+    }
+    Scope(const Scope&)            = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+  typedef Scope<SYSCALL_DISPATCH_FILTER_ALLOW> Allowed;
+  typedef Scope<SYSCALL_DISPATCH_FILTER_BLOCK> Blocked;
+
+private:
+  static volatile uint8_t selector_;
+  static bool paused_; // the dispatch is off since a reissue
+  static Forward forward_;
+  static bool installed_;
+  static uint64_t trapped_;
+  static uint64_t forwarded_;
+  static uint64_t reissued_;
+  static void resume();
+  static bool forks(long number, const greg_t* regs);
+  static void handle(int signal, siginfo_t* info, void* context);
+};
+
+#endif
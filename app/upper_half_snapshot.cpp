@@ -0,0 +1,249 @@
+#include "upper_half_snapshot.h"
+#include "window_layout.hpp"
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#define PM_SOFT_DIRTY (1ULL << 55)
+
+UpperHalfSnapshot::~UpperHalfSnapshot()
+{
+  if (regions_ != nullptr)
+    munmap(regions_, 2 * kMaxRegions * sizeof(Region));
+  if (data_ != nullptr)
+    munmap(data_, dataSize_);
+  if (pagemapFd_ >= 0)
+    close(pagemapFd_);
+  if (clearRefsFd_ >= 0)
+    close(clearRefsFd_);
+}
+
+// Calls f on the parts of [start, end) that are not our own bookkeeping;
+// anonymous mappings get merged by the kernel, so a maps line may hold both.
+template <class F> void UpperHalfSnapshot::for_each_foreign_range(uintptr_t start, uintptr_t end, F f) const
+{
+  uintptr_t own[2][2] = {{(uintptr_t)regions_, (uintptr_t)regions_ + 2 * kMaxRegions * sizeof(Region)},
+                         {(uintptr_t)data_, (uintptr_t)data_ + dataSize_}};
+  if (own[0][0] > own[1][0])
+    swap(own[0], own[1]);
+
+  auto cursor = start;
+  for (auto& range : own) {
+    if (range[0] == range[1] || range[1] <= cursor || range[0] >= end)
+      continue;
+    if (range[0] > cursor)
+      f(cursor, range[0]);
+    cursor = range[1];
+  }
+  if (cursor < end)
+    f(cursor, end);
+}
+
+// Maps `length` bytes of bookkeeping, in the snapshot room when there is some left
+void* UpperHalfSnapshot::map_bookkeeping(size_t length)
+{
+  auto layout = WindowLayout::current();
+  if (layout != nullptr && roomUsed_ + ROUND_UP(length) <= layout->snapshotSize) {
+    auto addr = mmap((void*)(layout->snapshot + roomUsed_), length, PROT_READ | PROT_WRITE,
+                     MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr != MAP_FAILED) {
+      roomUsed_ += ROUND_UP(length);
+      return addr;
+    }
+  }
+  return mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+bool UpperHalfSnapshot::clear_soft_dirty() const
+{
+  return clearRefsFd_ >= 0 && pwrite(clearRefsFd_, "4", 1, 0) == 1;
+}
+
+// Kernels without CONFIG_MEM_SOFT_DIRTY accept the clear_refs write but never
+// set the bit: write to a page we own after clearing and look at its bit.
+bool UpperHalfSnapshot::soft_dirty_works() const
+{
+  uint64_t entry = 0;
+  *(volatile int*)&regions_[kMaxRegions].prot = 0;
+  auto offset = ((uintptr_t)&regions_[kMaxRegions] / PAGE_SIZE) * sizeof(uint64_t);
+  return pread(pagemapFd_, &entry, sizeof(entry), offset) == sizeof(entry) && (entry & PM_SOFT_DIRTY);
+}
+
+bool UpperHalfSnapshot::take()
+{
+  uintptr_t sp = (uintptr_t)&sp;
+
+  // The second half of the block is scratch space for restore()
+  regions_ = (Region*)map_bookkeeping(2 * kMaxRegions * sizeof(Region));
+  if (regions_ == MAP_FAILED) {
+    regions_ = nullptr;
+    DLOG(ERROR, "app %d: could not map the snapshot metadata: %s\n", getpid(), strerror(errno));
+    return false;
+  }
+
+  Area area;
+  int mapsfd = open("/proc/self/maps", O_RDONLY);
+  if (mapsfd < 0) {
+    DLOG(ERROR, "Failed to open proc maps\n");
+    return false;
+  }
+  while (readMapsLine(mapsfd, &area)) {
+    for_each_foreign_range((uintptr_t)area.addr, (uintptr_t)area.endAddr, [&](uintptr_t start, uintptr_t end) {
+      if (regionCount_ == kMaxRegions)
+        return;
+      auto& region  = regions_[regionCount_++];
+      region.start  = start;
+      region.end    = end;
+      region.prot   = area.prot;
+      region.heap   = strcmp(area.name, "[heap]") == 0;
+      region.saved  = (area.prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE) &&
+                     (area.flags & MAP_PRIVATE) && !(start <= sp && sp < end);
+      region.offset = dataSize_;
+      if (region.saved)
+        dataSize_ += end - start;
+    });
+  }
+  close(mapsfd);
+  if (regionCount_ == kMaxRegions) {
+    DLOG(ERROR, "app %d: too many regions to snapshot\n", getpid());
+    return false;
+  }
+
+  data_ = (char*)map_bookkeeping(dataSize_);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    DLOG(ERROR, "app %d: could not map %zu bytes for the snapshot: %s\n", getpid(), dataSize_, strerror(errno));
+    return false;
+  }
+  for (auto i = 0; i < regionCount_; i++)
+    if (regions_[i].saved)
+      memcpy(data_ + regions_[i].offset, (void*)regions_[i].start, regions_[i].end - regions_[i].start);
+
+  pagemapFd_   = open("/proc/self/pagemap", O_RDONLY);
+  clearRefsFd_ = open("/proc/self/clear_refs", O_WRONLY);
+  softDirty_   = pagemapFd_ >= 0 && clear_soft_dirty() && soft_dirty_works();
+  DLOG(INFO, "app %d: snapshot of %d regions, %zu bytes saved, soft-dirty tracking %s\n", getpid(), regionCount_,
+       dataSize_, softDirty_ ? "on" : "off");
+  return true;
+}
+
+// What the parent wrote since its snapshot may or may not be soft-dirty
+// here: the first restore copies everything, then clears our own bits
+void UpperHalfSnapshot::rebind()
+{
+  if (pagemapFd_ >= 0)
+    close(pagemapFd_);
+  if (clearRefsFd_ >= 0)
+    close(clearRefsFd_);
+  pagemapFd_   = open("/proc/self/pagemap", O_RDONLY);
+  clearRefsFd_ = open("/proc/self/clear_refs", O_WRONLY);
+  softDirty_   = softDirty_ && pagemapFd_ >= 0 && clearRefsFd_ >= 0;
+  rebound_     = true;
+}
+
+// Unmaps the parts of [start, end) no snapshot region covers; returns how many
+int UpperHalfSnapshot::unmap_new_ranges(uintptr_t start, uintptr_t end, bool heap)
+{
+  int unmapped = 0;
+  auto cursor  = start;
+  auto unmap   = [&](uintptr_t from, uintptr_t to) {
+    // The brk area can only shrink from its end, and through brk() so that the kernel knows
+    if (heap && to == end)
+      syscall(SYS_brk, from);
+    else
+      munmap((void*)from, to - from);
+    unmapped++;
+  };
+
+  for (auto i = 0; i < regionCount_ && cursor < end; i++) {
+    const auto& region = regions_[i];
+    if (region.end <= cursor)
+      continue;
+    if (region.start >= end)
+      break;
+    if (region.start > cursor)
+      unmap(cursor, region.start);
+    cursor = max(cursor, region.end);
+  }
+  if (cursor < end)
+    unmap(cursor, end);
+  return unmapped;
+}
+
+// Copies back the pages of `region` written since the snapshot; returns how many
+size_t UpperHalfSnapshot::restore_region(const Region& region)
+{
+  auto length  = region.end - region.start;
+  size_t pages = length / PAGE_SIZE;
+  auto saved   = data_ + region.offset;
+
+  if (mprotect((void*)region.start, length, region.prot) != 0) {
+    // (Part of) the region is gone: map it back and copy all of it
+    mmap((void*)region.start, length, region.prot | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memcpy((void*)region.start, saved, length);
+    mprotect((void*)region.start, length, region.prot);
+    return pages;
+  }
+  if (!softDirty_ || rebound_) {
+    memcpy((void*)region.start, saved, length);
+    return pages;
+  }
+
+  size_t restored = 0;
+  uint64_t entries[512];
+  for (size_t page = 0; page < pages; page += 512) {
+    auto count  = min(pages - page, (size_t)512);
+    auto offset = (region.start / PAGE_SIZE + page) * sizeof(uint64_t);
+    if (pread(pagemapFd_, entries, count * sizeof(uint64_t), offset) != (ssize_t)(count * sizeof(uint64_t))) {
+      memcpy((void*)(region.start + page * PAGE_SIZE), saved + page * PAGE_SIZE, count * PAGE_SIZE);
+      restored += count;
+      continue;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (entries[i] & PM_SOFT_DIRTY) {
+        memcpy((void*)(region.start + (page + i) * PAGE_SIZE), saved + (page + i) * PAGE_SIZE, PAGE_SIZE);
+        restored++;
+      }
+    }
+  }
+  return restored;
+}
+
+void UpperHalfSnapshot::restore()
+{
+  uintptr_t sp = (uintptr_t)&sp;
+
+  // Collect the current regions first: reading the maps while unmapping would skip lines
+  auto current = regions_ + kMaxRegions;
+  int count    = 0;
+  Area area;
+  int mapsfd = open("/proc/self/maps", O_RDONLY);
+  if (mapsfd < 0) {
+    DLOG(ERROR, "Failed to open proc maps\n");
+    return;
+  }
+  while (readMapsLine(mapsfd, &area)) {
+    for_each_foreign_range((uintptr_t)area.addr, (uintptr_t)area.endAddr, [&](uintptr_t start, uintptr_t end) {
+      if (count == kMaxRegions || (start <= sp && sp < end))
+        return;
+      current[count].start  = start;
+      current[count].end    = end;
+      current[count++].heap = strcmp(area.name, "[heap]") == 0;
+    });
+  }
+  close(mapsfd);
+
+  int unmapped = 0;
+  for (auto i = 0; i < count; i++)
+    unmapped += unmap_new_ranges(current[i].start, current[i].end, current[i].heap);
+
+  size_t restored = 0;
+  for (auto i = 0; i < regionCount_; i++)
+    if (regions_[i].saved)
+      restored += restore_region(regions_[i]);
+
+  clear_soft_dirty();
+  rebound_ = false;
+  restores_++;
+  DLOG(INFO, "app %d: reset #%zu restored %zu pages and unmapped %d ranges\n", getpid(), restores_, restored,
+       unmapped);
+}
@@ -0,0 +1,63 @@
+#ifndef UPPER_HALF_SNAPSHOT_H
+#define UPPER_HALF_SNAPSHOT_H
+
+#include "global.hpp"
+
+// Copy of the writable memory of the app taken once it is loaded, used to
+// bring the app back to that state in place (no new process, exec or
+// relocation). Only the pages written since the snapshot are copied back,
+// as reported by the soft-dirty bits of /proc/self/pagemap; regions mapped
+// since the snapshot are unmapped.
+//
+// Nothing here allocates from the heap: the heap is part of what gets
+// restored, so the bookkeeping lives in its own mappings, in the snapshot
+// room of the app's window when it fits there.
+class UpperHalfSnapshot {
+private:
+  struct Region {
+    uintptr_t start;
+    uintptr_t end;
+    int prot;
+    bool saved;    // writable private region whose content is kept
+    bool heap;     // the brk area
+    size_t offset; // of the content in data_
+  };
+
+  static constexpr int kMaxRegions = 4096;
+
+  Region* regions_  = nullptr;
+  int regionCount_  = 0;
+  char* data_       = nullptr;
+  size_t dataSize_  = 0;
+  int pagemapFd_    = -1;
+  int clearRefsFd_  = -1;
+  bool softDirty_   = false;
+  bool rebound_     = false; // forked since the bits were last cleared: the next restore copies all
+  size_t restores_  = 0;
+  size_t roomUsed_  = 0; // of the snapshot room
+
+  template <class F> void for_each_foreign_range(uintptr_t start, uintptr_t end, F f) const;
+  void* map_bookkeeping(size_t length);
+  bool clear_soft_dirty() const;
+  bool soft_dirty_works() const;
+  size_t restore_region(const Region& region);
+  int unmap_new_ranges(uintptr_t start, uintptr_t end, bool heap);
+
+public:
+  explicit UpperHalfSnapshot() = default;
+  ~UpperHalfSnapshot();
+
+  // No copy
+  UpperHalfSnapshot(UpperHalfSnapshot const&) = delete;
+  UpperHalfSnapshot& operator=(UpperHalfSnapshot const&) = delete;
+
+  // The stack we run on is left out of both
+  bool take();
+  void restore();
+  // In a process forked from the one that took the snapshot: the /proc
+  // files opened by take() are still the parent's
+  void rebind();
+  inline size_t size() const { return dataSize_; }
+};
+
+#endif
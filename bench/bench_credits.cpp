@@ -0,0 +1,126 @@
+// Steps per second through the stepping protocol of mc and an app, over a
+// socketpair: lockstep CONTINUE/FINISH (1 credit) against STEPS messages
+// granting 8 and 64 steps at once. mc replays paths of DEPTH steps, as it
+// does after a reset; the app is a forked process answering as App does,
+// with messages of the same size. Each is run again with the messages
+// recorded into a MessageTrace, as mc --record does, in TRACE; the best of
+// five runs counts.
+//
+// Usage: ./bench_credits [STEPS] [DEPTH] [TRACE]
+
+#include "channel.hpp"
+#include "global.hpp"
+#include "message_trace.h"
+#include <array>
+#include <chrono>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using Clock = chrono::steady_clock;
+
+// The app side: one answer per message, until DONE. It leaves with _exit():
+// what stdout of the parent held before the fork is not ours to flush.
+[[noreturn]] static void serve(const Channel& channel)
+{
+  auto message = make_unique<s_message_t>();
+  auto answer  = make_unique<s_message_t>();
+  answer->pid  = getpid();
+  for (;;) {
+    if (channel.receive(*message) <= 0)
+      _exit(-1);
+    switch (message->type) {
+      case MessageType::CONTINUE:
+        answer->type = MessageType::FINISH;
+        break;
+      case MessageType::STEPS:
+        answer->type  = MessageType::STEPPED;
+        answer->steps = min(message->steps, MAX_CREDITS);
+        for (uint32_t i = 0; i < answer->steps; i++)
+          answer->choices[i] = 0;
+        break;
+      default:
+        _exit(0);
+    }
+    channel.send(*answer);
+  }
+}
+
+// Steps per second with `credits`, `total` steps in all, recorded into `trace` if any
+static double rate(long credits, long total, long depth, MessageTrace* trace)
+{
+  int sockets[2];
+  if (socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+    DLOG(ERROR, "Could not create the channel: %s\n", strerror(errno));
+    exit(-1);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(sockets[1]);
+    serve(Channel(sockets[0]));
+  }
+  close(sockets[0]);
+  Channel channel(sockets[1]);
+
+  auto message = make_unique<s_message_t>();
+  message->pid = getpid();
+  std::array<char, MESSAGE_LENGTH> reply;
+  long steps = 0;
+  auto start = Clock::now();
+  while (steps < total) {
+    for (long replayed = 0; replayed < depth;) {
+      auto granted = min(credits, depth - replayed);
+      if (credits == 1) {
+        message->type = MessageType::CONTINUE;
+      } else {
+        message->type  = MessageType::STEPS;
+        message->steps = granted;
+        for (long i = 0; i < granted; i++)
+          message->choices[i] = (int32_t)(replayed + i);
+      }
+      if (trace != nullptr)
+        trace->record(MessageTrace::TO_APP, sockets[1], *message);
+      channel.send(*message);
+      if (channel.receive(reply.data(), reply.size()) == (size_t)-1)
+        exit(-1);
+      auto answer = (s_message_t*)reply.data();
+      if (trace != nullptr)
+        trace->record(MessageTrace::FROM_APP, sockets[1], *answer);
+      replayed += answer->type == MessageType::FINISH ? 1 : answer->steps;
+    }
+    steps += depth;
+  }
+  auto seconds = chrono::duration<double>(Clock::now() - start).count();
+
+  message->type = MessageType::DONE;
+  channel.send(*message);
+  waitpid(pid, nullptr, 0);
+  return steps / seconds;
+}
+
+int main(int argc, char** argv)
+{
+  long total = argc > 1 ? atol(argv[1]) : 1 << 16;
+  long depth = argc > 2 ? atol(argv[2]) : 256;
+  string path = argc > 3 ? argv[3] : "bench_credits.trace";
+
+  auto trace = MessageTrace::create(path);
+  if (!trace) {
+    DLOG(ERROR, "Could not create %s: %s\n", path.c_str(), strerror(errno));
+    exit(-1);
+  }
+  printf("%ld steps over paths of %ld steps\n", total, depth);
+  printf("  %8s %14s %14s %9s\n", "credits", "steps/s", "recorded", "overhead");
+  for (long credits : {1L, 8L, 64L}) {
+    // The best of a few runs each: the overhead is smaller than the noise of one
+    double plain = 0, recorded = 0;
+    for (int run = 0; run < 5; run++) {
+      plain    = max(plain, rate(credits, total, depth, nullptr));
+      recorded = max(recorded, rate(credits, total, depth, trace.get()));
+    }
+    printf("  %8ld %14.0f %14.0f %8.1f%%\n", credits, plain, recorded, (plain / recorded - 1) * 100);
+  }
+  trace.reset();
+  unlink(path.c_str());
+  return 0;
+}
@@ -0,0 +1,106 @@
+// What mc pays to learn about a syscall of an app: a trap of Syscall User
+// Dispatch (a SIGSYS handled in the app, see SyscallDispatch) against the
+// ptrace stops of a traced app (a syscall-enter and a syscall-exit stop,
+// each a round trip through the tracer), for a syscall that does nothing.
+// Before that, the trapping is checked to survive what the app may do: a
+// fork, a signal handler's return, a thread.
+//
+// Usage: ./bench_dispatch [SYSCALLS]
+
+#include "global.hpp"
+#include "syscall_dispatch.h"
+#include <chrono>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+
+using Clock = chrono::steady_clock;
+
+static uint64_t forwarded = 0;
+
+static double direct_ns(long count)
+{
+  auto start = Clock::now();
+  for (long i = 0; i < count; i++)
+    syscall(SYS_getppid);
+  return chrono::duration<double, nano>(Clock::now() - start).count() / count;
+}
+
+static double dispatch_ns(long count)
+{
+  SyscallDispatch::Blocked trapped;
+  auto start = Clock::now();
+  for (long i = 0; i < count; i++)
+    syscall(SYS_getppid);
+  return chrono::duration<double, nano>(Clock::now() - start).count() / count;
+}
+
+// Whether a syscall made after `event` is still trapped
+template <class F> static bool trapped_after(F event)
+{
+  SyscallDispatch::Blocked trapped;
+  event();
+  auto before = SyscallDispatch::trapped();
+  syscall(SYS_getppid);
+  return SyscallDispatch::trapped() == before + 1;
+}
+
+static void check_trapping()
+{
+  auto fork_ok = trapped_after([] {
+    pid_t pid = fork();
+    if (pid == 0)
+      _exit(0);
+    waitpid(pid, nullptr, 0);
+  });
+  signal(SIGUSR1, [](int) {});
+  auto signal_ok = trapped_after([] { raise(SIGUSR1); });
+  // The thread's clone is let through: the trapping is back once the next scope begins
+  thread([] {}).join();
+  auto thread_ok = trapped_after([] {});
+  printf("  trapped after a fork: %s, a signal: %s, a thread: %s (%lu reissued)\n", fork_ok ? "yes" : "NO",
+         signal_ok ? "yes" : "NO", thread_ok ? "yes" : "NO", (unsigned long)SyscallDispatch::reissued());
+}
+
+// The child makes `count` syscalls under PTRACE_SYSCALL, resumed by us at each stop
+static double ptrace_ns(long count)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    raise(SIGSTOP);
+    for (long i = 0; i < count; i++)
+      syscall(SYS_getppid);
+    _exit(0);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status))
+    return -1;
+  ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+  auto start = Clock::now();
+  ptrace(PTRACE_SYSCALL, pid, 0, 0);
+  while (waitpid(pid, &status, 0) == pid && WIFSTOPPED(status))
+    ptrace(PTRACE_SYSCALL, pid, 0, WSTOPSIG(status) == (SIGTRAP | 0x80) ? 0 : WSTOPSIG(status));
+  return chrono::duration<double, nano>(Clock::now() - start).count() / count;
+}
+
+int main(int argc, char** argv)
+{
+  long count = argc > 1 ? atol(argv[1]) : 1000000;
+
+  printf("%ld getppid syscalls (ns each)\n", count);
+  printf("  %-22s %10.1f\n", "direct", direct_ns(count));
+  if (SyscallDispatch::install([](long, long) { forwarded++; })) {
+    check_trapping();
+    auto ns = dispatch_ns(count);
+    printf("  %-22s %10.1f (%lu trapped)\n", "syscall user dispatch", ns, (unsigned long)SyscallDispatch::trapped());
+  } else {
+    printf("  %-22s %10s (%s)\n", "syscall user dispatch", "-", strerror(errno));
+  }
+  // ptrace stops cost more than a hundred times as much: fewer of them
+  printf("  %-22s %10.1f\n", "ptrace syscall stops", ptrace_ns(count / 100));
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Size and speed of the state graph mc records with --graph-output and
+// --check-liveness: STATES states interned by fingerprint, EDGES random
+// edges appended from 4 worker buffers, then compacted into the CSR arrays,
+// searched for an accepting cycle, saved to FILE and loaded back.
+//
+// Usage: ./bench_graph [EDGES] [STATES] [FILE]
+
+#include "global.hpp"
+#include "state_graph.h"
+#include <chrono>
+#include <random>
+#include <sys/resource.h>
+#include <thread>
+
+using Clock = chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start)
+{
+  return chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+  long edges  = argc > 1 ? atol(argv[1]) : 10'000'000;
+  long states = argc > 2 ? atol(argv[2]) : max(1L, edges / 4);
+  string path = argc > 3 ? argv[3] : "/tmp/simgld-graph.bin";
+  if (edges <= 0 || states <= 0 || (uint64_t)states > StateGraph::kMaxStates) {
+    DLOG(ERROR, "Usage: ./bench_graph [EDGES] [STATES] [FILE]\n");
+    exit(-1);
+  }
+
+  StateGraph graph;
+  mt19937_64 rng(1);
+  vector<StateGraph::StateId> ids(states);
+  auto start = Clock::now();
+  for (auto& id : ids)
+    id = graph.intern(rng());
+  auto internSeconds = seconds_since(start);
+  for (long i = 0; i < states; i += 100)
+    graph.mark_accepting(ids[i]);
+
+  // As the shards would: each its own buffer, no lock
+  constexpr int kWorkers = 4;
+  vector<StateGraph::EdgeBuffer*> buffers;
+  for (int w = 0; w < kWorkers; w++)
+    buffers.push_back(&graph.worker_buffer());
+  start = Clock::now();
+  vector<thread> workers;
+  for (int w = 0; w < kWorkers; w++)
+    workers.emplace_back([&, w] {
+      mt19937_64 rng(w + 2);
+      for (long i = w; i < edges; i += kWorkers)
+        buffers[w]->add(ids[rng() % states], ids[rng() % states]);
+    });
+  for (auto& worker : workers)
+    worker.join();
+  auto addSeconds = seconds_since(start);
+
+  start = Clock::now();
+  graph.compact();
+  auto compactSeconds = seconds_since(start);
+  start               = Clock::now();
+  bool cycle          = graph.find_accepting_cycle();
+  auto cycleSeconds   = seconds_since(start);
+
+  start = Clock::now();
+  graph.save(path);
+  auto saveSeconds = seconds_since(start);
+  StateGraph loaded;
+  start = Clock::now();
+  loaded.load(path);
+  auto loadSeconds = seconds_since(start);
+  unlink(path.c_str());
+  if (loaded.node_count() != graph.node_count() || loaded.edge_count() != graph.edge_count() ||
+      loaded.find_accepting_cycle() != cycle) {
+    DLOG(ERROR, "the graph loaded back from %s is not the one saved\n", path.c_str());
+    exit(-1);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%u states, %lu distinct edges of %ld added\n", graph.node_count(), (unsigned long)graph.edge_count(),
+         edges);
+  printf("  %-22s %10.1f ns per state\n", "intern", internSeconds * 1e9 / states);
+  printf("  %-22s %10.1f ns per edge\n", "add", addSeconds * 1e9 / edges);
+  printf("  %-22s %10.3f s\n", "compact", compactSeconds);
+  printf("  %-22s %10.3f s (%s)\n", "accepting cycle", cycleSeconds, cycle ? "found" : "none");
+  printf("  %-22s %10.3f s\n", "save", saveSeconds);
+  printf("  %-22s %10.3f s\n", "load", loadSeconds);
+  printf("  %-22s %10.1f MB (%.1f bytes per edge)\n", "graph memory", graph.memory_bytes() / 1e6,
+         (double)graph.memory_bytes() / max<uint64_t>(1, graph.edge_count()));
+  printf("  %-22s %10.1f MB\n", "peak RSS", usage.ru_maxrss / 1e3);
+  return 0;
+}
@@ -0,0 +1,80 @@
+// sbrk as the loader's Heap serves it to an upper half, against the brk
+// syscall of the kernel: CALLS calls growing the break by INCREMENT bytes
+// then as many shrinking it back, and CALLS calls going up and down by
+// INCREMENT around the same break, as malloc does when it trims its top.
+// The Heap counters tell how many of the calls made a syscall.
+//
+// Usage: ./bench_heap [CALLS] [INCREMENT]
+
+#include "global.hpp"
+#include "heap.hpp"
+#include <chrono>
+#include <sys/syscall.h>
+
+using Clock = chrono::steady_clock;
+
+// The process' break, moved with the raw syscall as the Heap replaces it
+static void* kernel_sbrk(intptr_t increment)
+{
+  auto old = syscall(SYS_brk, 0);
+  if (syscall(SYS_brk, old + increment) != old + increment)
+    return (void*)-1;
+  return (void*)old;
+}
+
+// ns per call of `calls` calls to sbrk growing the break, then as many shrinking it
+template <class F> static double ns_grow_shrink(F sbrk, long calls, intptr_t increment)
+{
+  auto start = Clock::now();
+  for (long i = 0; i < calls; i++)
+    if (sbrk(increment) == (void*)-1) {
+      DLOG(ERROR, "sbrk(%ld) failed after %ld calls: %s\n", (long)increment, i, strerror(errno));
+      exit(-1);
+    }
+  for (long i = 0; i < calls; i++)
+    sbrk(-increment);
+  return chrono::duration<double, nano>(Clock::now() - start).count() / (2 * calls);
+}
+
+// ns per call of `calls` calls to sbrk going up and down by `increment`
+template <class F> static double ns_oscillate(F sbrk, long calls, intptr_t increment)
+{
+  auto start = Clock::now();
+  for (long i = 0; i < calls; i++)
+    sbrk(i % 2 == 0 ? increment : -increment);
+  return chrono::duration<double, nano>(Clock::now() - start).count() / calls;
+}
+
+static void print(const char* name, double ns, const Heap::Stats* stats, const Heap::Stats& before)
+{
+  printf("  %-22s %10.1f ns/call", name, ns);
+  if (stats != nullptr)
+    printf(" %8lu commits %8lu decommits, peak %lu KB", (unsigned long)(stats->commits - before.commits),
+           (unsigned long)(stats->decommits - before.decommits), (unsigned long)(stats->peakCommitted / 1024));
+  printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+  long calls         = argc > 1 ? atol(argv[1]) : 10'000;
+  intptr_t increment = argc > 2 ? atol(argv[2]) : 132 * 1024; // malloc's top pad and a bit
+  if (calls <= 0 || increment <= 0 || (uint64_t)calls * increment > (64ULL << 30)) {
+    DLOG(ERROR, "Usage: ./bench_heap [CALLS] [INCREMENT]\n");
+    exit(-1);
+  }
+
+  Heap heap;
+  uint64_t reserve = ROUND_UP((uint64_t)calls * increment) + 2 * PAGE_SIZE;
+  if (heap.createNewHeap(nullptr, reserve) == nullptr)
+    exit(-1);
+  auto heapSbrk = [&](intptr_t increment) { return heap.sbrk(increment); };
+
+  printf("%ld calls of %ld bytes\n", calls, (long)increment);
+  Heap::Stats before = heap.stats();
+  print("Heap grow and shrink", ns_grow_shrink(heapSbrk, calls, increment), &heap.stats(), before);
+  before = heap.stats();
+  print("Heap up and down", ns_oscillate(heapSbrk, calls, increment), &heap.stats(), before);
+  print("brk grow and shrink", ns_grow_shrink(kernel_sbrk, calls, increment), nullptr, before);
+  print("brk up and down", ns_oscillate(kernel_sbrk, calls, increment), nullptr, before);
+  return 0;
+}
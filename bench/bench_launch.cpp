@@ -0,0 +1,137 @@
+// Launches an app N times the way mc does (fork, AppLoader::runRtld, ptrace
+// handshake, LOADED, LAYOUT, READY) and prints where the time goes, phase by
+// phase, from the timestamps of the launch trace.
+//
+// Usage: ./bench_launch [/PATH/TO/APP] [LAUNCH_COUNT]
+
+#include "address_planner.h"
+#include "app_loader.h"
+#include "channel.hpp"
+#include "global.hpp"
+#include "launch_trace.hpp"
+#include "startup_context.h"
+#include <algorithm>
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static s_message_t message; // 128 KB: kept off the stack
+
+// Runs one launch up to READY; returns false if the app did not get there
+static bool launch(AppLoader& loader, LaunchTrace& trace, const WindowLayout& window, const string& app,
+                   double out[LAUNCH_PHASES])
+{
+  int sockets[2];
+  assert((socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != -1) && "Could not create socketpair");
+
+  auto spawnTsc = __rdtsc();
+  pid_t pid     = fork();
+  assert(pid >= 0 && "Could not fork child process");
+  if (pid == 0) {
+    auto slot = trace.claim(getpid());
+    if (slot != nullptr) {
+      slot->stamp(SPAWN_PHASE, spawnTsc);
+      slot->stamp(FORKED_PHASE);
+    }
+    loader.setLaunchSlot(slot);
+    ::close(sockets[1]);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    fcntl(sockets[0], F_SETFD, 0);
+    loader.runRtld(window, {app}, sockets[0]);
+    exit(-1);
+  }
+  ::close(sockets[0]);
+  Channel channel(sockets[1]);
+
+  bool ready = false;
+  int status;
+  // The app stops itself once traced: let it go on
+  if (waitpid(pid, &status, 0) == pid && WIFSTOPPED(status) && ptrace(PTRACE_CONT, pid, 0, 0) == 0 &&
+      channel.receive(message) > 0 && message.type == MessageType::LOADED) {
+    const auto& layout     = StartupContext::get().maps_lines();
+    message.type           = MessageType::LAYOUT;
+    message.pid            = getpid();
+    message.memlayout_size = min(layout.size(), size(message.memlayout));
+    message.start_addr     = window.start;
+    message.end_addr       = window.end;
+    for (int i = 0; i < message.memlayout_size; i++)
+      strncpy(message.memlayout[i], layout[i].c_str(), sizeof(message.memlayout[i]) - 1);
+    ready = channel.send(message) == 0 && channel.receive(message) > 0 && message.type == MessageType::READY;
+  }
+
+  auto slot = trace.find(pid);
+  if (ready && slot != nullptr)
+    trace.intervals(*slot, trace.ticks_per_ns(), out);
+  if (slot != nullptr)
+    trace.release(slot);
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  return ready && slot != nullptr;
+}
+
+static double percentile(const vector<double>& sorted, int p)
+{
+  return sorted[min(sorted.size() - 1, sorted.size() * p / 100)];
+}
+
+int main(int argc, char** argv)
+{
+  string dir = argv[0];
+  dir        = dir.find('/') == string::npos ? "." : dir.substr(0, dir.rfind('/'));
+  string app = argc > 1 ? argv[1] : dir + "/../app/app";
+  long count = argc > 2 ? atol(argv[2]) : 100;
+
+  // Every launch gets the same window, planned as mc does
+  AppLoader loader;
+  AddressPlanner planner(StartupContext::get());
+  WindowLayout window;
+  if (!planner.plan(AddressPlanner::Budget {}, {app}, window)) {
+    DLOG(ERROR, "Could not plan the app's window\n");
+    return 1;
+  }
+  auto trace = LaunchTrace::create();
+  if (trace == nullptr) {
+    DLOG(ERROR, "Could not map the launch trace: %s\n", strerror(errno));
+    return 1;
+  }
+  window.trace = (uintptr_t)trace;
+
+  // The loader and the app log to stdout: keep it for the results
+  int out  = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  dup2(null, STDERR_FILENO);
+
+  vector<double> samples[LAUNCH_PHASES + 1]; // the last one is the whole launch
+  long failures = 0;
+  for (long i = 0; i < count; i++) {
+    double intervals[LAUNCH_PHASES];
+    if (!launch(loader, *trace, window, app, intervals)) {
+      failures++;
+      continue;
+    }
+    double total = 0;
+    for (int phase = FORKED_PHASE; phase < LAUNCH_PHASES; phase++) {
+      samples[phase].push_back(intervals[phase] / 1000);
+      total += intervals[phase] / 1000;
+    }
+    samples[LAUNCH_PHASES].push_back(total);
+  }
+
+  dup2(out, STDOUT_FILENO);
+  printf("%s: %ld launches, %ld failed\n", app.c_str(), count, failures);
+  if (samples[LAUNCH_PHASES].empty())
+    return 1;
+  printf("  %-10s %10s %10s %10s %10s (us)\n", "phase", "p50", "p90", "p99", "max");
+  for (int phase = FORKED_PHASE; phase <= LAUNCH_PHASES; phase++) {
+    auto& sorted = samples[phase];
+    sort(sorted.begin(), sorted.end());
+    printf("  %-10s %10.1f %10.1f %10.1f %10.1f\n", phase == LAUNCH_PHASES ? "total" : launchPhaseNames[phase],
+           percentile(sorted, 50), percentile(sorted, 90), percentile(sorted, 99), sorted.back());
+  }
+  return failures == 0 ? 0 : 1;
+}
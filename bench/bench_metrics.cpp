@@ -0,0 +1,69 @@
+// Cost of a metric update on the hot path of mc, from 1 to 8 threads each
+// updating the same metric, as the shards do: a striped Counter against a
+// single shared atomic, a Gauge, a Histogram, and the slot of an app in the
+// AppMetrics page, which has one writer.
+//
+// Usage: ./bench_metrics [UPDATES]
+
+#include "app_metrics.hpp"
+#include "global.hpp"
+#include "metrics.h"
+#include <chrono>
+#include <memory>
+
+using Clock = chrono::steady_clock;
+
+// ns per update of `update(thread, i)`, run `updates` times on each of `threads` threads at once: the
+// time of all the updates, which are as many as the threads take turns on fewer CPUs
+template <class F> static double cost(int threads, long updates, F update)
+{
+  atomic<int> ready{0};
+  vector<thread> runners;
+  auto start = Clock::now();
+  for (int t = 0; t < threads; t++)
+    runners.emplace_back([&, t] {
+      ready++;
+      while (ready < threads)
+        ;
+      for (long i = 0; i < updates; i++)
+        update(t, i);
+    });
+  for (auto& runner : runners)
+    runner.join();
+  return chrono::duration<double, nano>(Clock::now() - start).count() / updates / threads;
+}
+
+int main(int argc, char** argv)
+{
+  long updates = argc > 1 ? atol(argv[1]) : 10'000'000;
+
+  MetricsRegistry registry;
+  auto& counter   = registry.counter("counter", "");
+  auto& gauge     = registry.gauge("gauge", "");
+  auto& histogram = registry.histogram("histogram", "");
+  atomic<uint64_t> shared{0};
+  auto page = AppMetrics::create();
+  if (page == nullptr) {
+    DLOG(ERROR, "Could not map the page: %s\n", strerror(errno));
+    exit(-1);
+  }
+  auto slot = page->claim(getpid());
+
+  printf("%ld updates per thread, ns per update\n", updates);
+  printf("  %7s %9s %9s %9s %9s %9s\n", "threads", "counter", "atomic", "gauge", "histogram", "app slot");
+  for (int threads : {1, 2, 4, 8}) {
+    auto counterNs   = cost(threads, updates, [&](int, long) { counter.add(); });
+    auto sharedNs    = cost(threads, updates, [&](int, long) { shared.fetch_add(1, memory_order_relaxed); });
+    auto gaugeNs     = cost(threads, updates, [&](int, long i) { gauge.set(i); });
+    auto histogramNs = cost(threads, updates, [&](int, long i) { histogram.record(i & 0xfffff); });
+    // One writer per slot: the others take slots of their own
+    auto slotNs = cost(threads, updates, [&](int t, long) {
+      AppMetrics::Slot::add(t == 0 ? slot->steps : page->slots[t].steps);
+    });
+    printf("  %7d %9.2f %9.2f %9.2f %9.2f %9.2f\n", threads, counterNs, sharedNs, gaugeNs, histogramNs, slotNs);
+  }
+  // The sums are read back as a scrape would
+  auto text = registry.render();
+  printf("%zu bytes of metrics, %lu counted\n", text.size(), (unsigned long)counter.value());
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Cost of loading the PT_LOAD segments of an ELF file the way AppLoader does
+// (mapped from the file over the reservation) against reading them into
+// private anonymous memory: time of LOADS load/unmap cycles, then the memory
+// INSTANCES live processes each holding a loaded copy cost per instance.
+// Every page of each copy is read, and every page of its writable segments
+// written, as the dynamic loader would do once running.
+//
+// Usage: ./bench_segments [ELF] [LOADS] [INSTANCES]
+
+#include "app_loader.h"
+#include "elf_image.h"
+#include "global.hpp"
+#include <chrono>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+using Clock = chrono::steady_clock;
+
+// The loader before it mapped from the file: each segment read() into anonymous memory
+static unsigned long load_copied(void* startAddr, const ElfImage& image)
+{
+  const Elf64_Ehdr* ehdr = image.ehdr();
+  const Elf64_Phdr *iter, *phdr = image.phdrs();
+  int dyn             = ehdr->e_type == ET_DYN;
+  unsigned long minva = (unsigned long)-1, maxva = 0;
+
+  for (iter = phdr; iter < &phdr[ehdr->e_phnum]; iter++) {
+    if (iter->p_type != PT_LOAD)
+      continue;
+    minva = min(minva, (unsigned long)iter->p_vaddr);
+    maxva = max(maxva, (unsigned long)(iter->p_vaddr + iter->p_memsz));
+  }
+  minva = TRUNC_PG(minva);
+  maxva = ROUND_PG(maxva);
+
+  auto base = (unsigned char*)mmap(startAddr, maxva - minva, PROT_NONE,
+                                   (dyn ? 0 : MAP_FIXED) | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == (void*)-1)
+    return LOAD_ERR;
+
+  for (iter = phdr; iter < &phdr[ehdr->e_phnum]; iter++) {
+    if (iter->p_type != PT_LOAD)
+      continue;
+    unsigned long off   = iter->p_vaddr & ALIGN;
+    unsigned long start = (dyn ? (unsigned long)base : 0) + TRUNC_PG(iter->p_vaddr);
+    unsigned long size  = ROUND_PG(off + iter->p_memsz);
+    auto p = (unsigned char*)mmap((void*)start, size, PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == (void*)-1 || pread(image.fd(), p + off, iter->p_filesz, iter->p_offset) != (ssize_t)iter->p_filesz) {
+      munmap(base, maxva - minva);
+      return LOAD_ERR;
+    }
+    mprotect(p, size, PFLAGS(iter->p_flags));
+  }
+  return (unsigned long)base;
+}
+
+using Loader = unsigned long (*)(void*, const ElfImage&);
+
+// Reads every page of the loaded copy at `base` and writes every page of its writable segments
+static void touch(unsigned long base, const ElfImage& image)
+{
+  for (auto iter = image.phdrs(); iter < &image.phdrs()[image.phnum()]; iter++) {
+    if (iter->p_type != PT_LOAD || !(iter->p_flags & PF_R))
+      continue;
+    auto start = base + TRUNC_PG(iter->p_vaddr);
+    auto end   = base + ROUND_PG(iter->p_vaddr + iter->p_memsz);
+    for (auto page = start; page < end; page += PAGE_SIZE) {
+      auto byte = (volatile char*)page;
+      char c    = *byte;
+      if (iter->p_flags & PF_W)
+        *byte = c;
+    }
+  }
+}
+
+// Pss and Private_Dirty of process `pid` in [start, end), in KB
+static pair<long, long> smaps_of(pid_t pid, unsigned long start, unsigned long end)
+{
+  long pss = 0, dirty = 0, kb;
+  bool inside = false;
+  char line[512];
+  unsigned long from, to;
+  string path = "/proc/" + to_string(pid) + "/smaps";
+  FILE* smaps = fopen(path.c_str(), "r");
+  if (smaps == nullptr) {
+    DLOG(ERROR, "Could not open %s: %s\n", path.c_str(), strerror(errno));
+    exit(-1);
+  }
+  while (fgets(line, sizeof(line), smaps) != nullptr) {
+    if (sscanf(line, "%lx-%lx ", &from, &to) == 2)
+      inside = from >= start && to <= end;
+    else if (inside && sscanf(line, "Pss: %ld kB", &kb) == 1)
+      pss += kb;
+    else if (inside && sscanf(line, "Private_Dirty: %ld kB", &kb) == 1)
+      dirty += kb;
+  }
+  fclose(smaps);
+  return {pss, dirty};
+}
+
+static double us_per_load(Loader load, const ElfImage& image, long loads)
+{
+  auto size  = image.load_size();
+  auto start = Clock::now();
+  for (long i = 0; i < loads; i++) {
+    auto base = load(nullptr, image);
+    if (base == LOAD_ERR) {
+      DLOG(ERROR, "Could not load %s\n", image.path().c_str());
+      exit(-1);
+    }
+    munmap((void*)base, size);
+  }
+  return chrono::duration<double, micro>(Clock::now() - start).count() / loads;
+}
+
+// Forks `instances` processes that each load and touch a copy, then averages their smaps once all are up
+static pair<double, double> kb_per_instance(Loader load, const ElfImage& image, int instances)
+{
+  int loaded[2], release[2];
+  if (pipe(loaded) != 0 || pipe(release) != 0) {
+    DLOG(ERROR, "Could not create the pipes: %s\n", strerror(errno));
+    exit(-1);
+  }
+
+  vector<pid_t> pids;
+  for (int i = 0; i < instances; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(loaded[0]);
+      close(release[1]);
+      pair<pid_t, unsigned long> copy = {getpid(), load(nullptr, image)};
+      if (copy.second != LOAD_ERR)
+        touch(copy.second, image);
+      write(loaded[1], &copy, sizeof(copy));
+      char c;
+      read(release[0], &c, 1);
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+  close(loaded[1]);
+  close(release[0]);
+
+  long pss = 0, dirty = 0;
+  vector<pair<pid_t, unsigned long>> copies(instances);
+  for (auto& copy : copies)
+    if (read(loaded[0], &copy, sizeof(copy)) != sizeof(copy) || copy.second == LOAD_ERR) {
+      DLOG(ERROR, "An instance could not load %s\n", image.path().c_str());
+      exit(-1);
+    }
+  for (auto [pid, base] : copies) {
+    auto [p, d] = smaps_of(pid, base, base + image.load_size());
+    pss += p;
+    dirty += d;
+  }
+
+  close(release[1]);
+  close(loaded[0]);
+  for (auto pid : pids)
+    waitpid(pid, nullptr, 0);
+  return {(double)pss / instances, (double)dirty / instances};
+}
+
+int main(int argc, char** argv)
+{
+  string path   = argc > 1 ? argv[1] : "/lib64/ld-linux-x86-64.so.2";
+  long loads    = argc > 2 ? atol(argv[2]) : 2000;
+  int instances = argc > 3 ? atoi(argv[3]) : 8;
+  auto image    = ElfImage::open(path);
+  if (image == nullptr || loads <= 0 || instances <= 0) {
+    DLOG(ERROR, "Usage: ./bench_segments [ELF] [LOADS] [INSTANCES]\n");
+    exit(-1);
+  }
+
+  printf("%s: %zu KB loaded, %ld loads, %d instances\n", path.c_str(), image->load_size() / 1024, loads, instances);
+  printf("  %-14s %12s %14s %20s\n", "loader", "us/load", "Pss KB/inst", "Private_Dirty KB/inst");
+  pair<const char*, Loader> loaders[] = {{"read()", load_copied}, {"file-mapped", AppLoader::loadSegment}};
+  for (auto [name, load] : loaders) {
+    auto us           = us_per_load(load, *image, loads);
+    auto [pss, dirty] = kb_per_instance(load, *image, instances);
+    printf("  %-14s %12.1f %14.1f %20.1f\n", name, us, pss, dirty);
+  }
+  return 0;
+}
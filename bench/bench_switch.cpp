@@ -0,0 +1,89 @@
+// Round trips between two FS values, the way the wrappers cross between the
+// halves (a SwitchContext in and out), and between mc and an app of its own
+// process (a DirectLink resume and yield, stack switches included), with
+// arch_prctl and with wrfsbase.
+//
+// Usage: ./bench_switch [ROUND_TRIPS]
+
+#include "direct_link.hpp"
+#include "global.hpp"
+#include "switch_context.h"
+#include <chrono>
+#include <sys/auxv.h>
+
+using Clock = chrono::steady_clock;
+
+static DirectLink* peer;
+
+// The other side: a TCB pointing to itself, with our stack guard so that
+// the code run on it passes its checks
+static uintptr_t* make_tcb()
+{
+  auto tcb = (uintptr_t*)mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (tcb == MAP_FAILED)
+    return nullptr;
+  tcb[0] = tcb[2] = (uintptr_t)tcb;
+  asm volatile("mov %%fs:0x28, %0" : "=r"(tcb[5]));
+  return tcb;
+}
+
+[[noreturn]] static void coroutine()
+{
+  for (;;)
+    peer->yield();
+}
+
+static void resume()
+{
+  SwitchContext context(peer->appFs);
+  direct_switch(&peer->hostSp, peer->appSp);
+}
+
+static double switch_ns(unsigned long fs, long count)
+{
+  auto start = Clock::now();
+  for (long i = 0; i < count; i++) {
+    SwitchContext context(fs);
+    asm volatile("" : : : "memory");
+  }
+  return chrono::duration<double, nano>(Clock::now() - start).count() / count;
+}
+
+static double resume_ns(long count)
+{
+  auto start = Clock::now();
+  for (long i = 0; i < count; i++)
+    resume();
+  return chrono::duration<double, nano>(Clock::now() - start).count() / count;
+}
+
+int main(int argc, char** argv)
+{
+  long count = argc > 1 ? atol(argv[1]) : 1000000;
+
+  auto tcb   = make_tcb();
+  peer       = DirectLink::create();
+  auto stack = (char*)mmap(nullptr, 16 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (tcb == nullptr || peer == nullptr || stack == MAP_FAILED) {
+    DLOG(ERROR, "Could not map the other side: %s\n", strerror(errno));
+    return 1;
+  }
+  // Entered as if called: the return address slot leaves the stack 8 bytes off 16
+  peer->enter((uintptr_t)stack + 16 * PAGE_SIZE - sizeof(uintptr_t), (uintptr_t)&coroutine);
+  peer->appFs = (uintptr_t)tcb;
+
+  auto hwcap2 = getauxval(AT_HWCAP2);
+  printf("%ld round trips (ns each)\n", count);
+  printf("  %-10s %10s %10s\n", "mode", "switch", "resume");
+  for (auto allowed : {false, true}) {
+    SwitchContext::init(hwcap2, allowed);
+    if (allowed && !SwitchContext::fsgsbase()) {
+      printf("  %-10s %10s %10s\n", "wrfsbase", "-", "-");
+      continue;
+    }
+    resume(); // the first one enters the coroutine
+    printf("  %-10s %10.1f %10.1f\n", allowed ? "wrfsbase" : "arch_prctl", switch_ns((unsigned long)tcb, count),
+           resume_ns(count));
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+// Resolves 1000 symbols of the libc we run with, the way getSymbolOffset used
+// to (one read(2) per symbol table entry, for each symbol) and through
+// SymbolResolver, one symbol at a time and in a batch.
+//
+// Usage: ./bench_symbols [/PATH/TO/ELF] [SYMBOL_COUNT]
+
+#include "elf_image.h"
+#include "global.hpp"
+#include "symbol_resolver.h"
+#include <chrono>
+#include <link.h>
+
+using Clock = chrono::steady_clock;
+
+static int find_libc(struct dl_phdr_info* info, size_t, void* data)
+{
+  if (strstr(info->dlpi_name, "libc.so") != nullptr) {
+    *(string*)data = info->dlpi_name;
+    return 1;
+  }
+  return 0;
+}
+
+// The former getSymbolOffset loop over the table, for one symbol
+static off_t read_scan(int fd, const Elf64_Shdr& symtab, const char* strtab, const char* name)
+{
+  Elf64_Sym sym;
+  for (off_t offset = symtab.sh_offset; offset < (off_t)(symtab.sh_offset + symtab.sh_size); offset += sizeof(sym)) {
+    if (pread(fd, &sym, sizeof(sym), offset) != sizeof(sym))
+      break;
+    if (sym.st_shndx != SHN_UNDEF && strcmp(strtab + sym.st_name, name) == 0)
+      return sym.st_value;
+  }
+  return -1;
+}
+
+static double elapsed_us(Clock::time_point start)
+{
+  return chrono::duration<double, micro>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+  string path;
+  if (argc > 1)
+    path = argv[1];
+  else
+    dl_iterate_phdr(find_libc, &path);
+  size_t count = argc > 2 ? atol(argv[2]) : 1000;
+
+  auto start = Clock::now();
+  auto image = ElfImage::open(path);
+  if (!image || image->symtab() == nullptr) {
+    DLOG(ERROR, "no symbols to resolve in %s\n", path.c_str());
+    return 1;
+  }
+  auto openUs = elapsed_us(start);
+
+  vector<string> names;
+  for (size_t i = 0; i < image->symbol_count() && names.size() < count; i++) {
+    const auto& sym = image->symtab()[i];
+    if (sym.st_shndx != SHN_UNDEF && sym.st_name != 0)
+      names.push_back(image->symbol_name(sym));
+  }
+
+  // The section the views point at, for the read(2) baseline
+  const Elf64_Shdr* symtab = nullptr;
+  for (auto i = 0; i < image->shnum(); i++)
+    if (image->data() + image->shdrs()[i].sh_offset == (const char*)image->symtab())
+      symtab = &image->shdrs()[i];
+
+  start = Clock::now();
+  vector<off_t> baseline;
+  for (auto& name : names)
+    baseline.push_back(read_scan(image->fd(), *symtab, image->strtab(), name.c_str()));
+  auto readUs = elapsed_us(start);
+
+  start = Clock::now();
+  auto& resolver = image->symbols();
+  auto setupUs   = elapsed_us(start);
+
+  start = Clock::now();
+  vector<off_t> single;
+  for (auto& name : names)
+    single.push_back(resolver.lookup(name));
+  auto singleUs = elapsed_us(start);
+
+  start = Clock::now();
+  auto batch  = resolver.lookup(names);
+  auto batchUs = elapsed_us(start);
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < names.size(); i++)
+    mismatches += single[i] != baseline[i] || batch[i] != baseline[i];
+
+  printf("%s: %zu symbols, %zu in the table, %s\n", path.c_str(), names.size(), image->symbol_count(),
+         resolver.has_hash_table() ? "hash table found" : "no hash table, in-memory index");
+  printf("  open + parse:            %10.1f us\n", openUs);
+  printf("  read(2) scan per symbol: %10.1f us (%8.1f ns/symbol)\n", readUs, 1000 * readUs / names.size());
+  printf("  resolver setup:          %10.1f us\n", setupUs);
+  printf("  resolver, one by one:    %10.1f us (%8.1f ns/symbol)\n", singleUs, 1000 * singleUs / names.size());
+  printf("  resolver, batch:         %10.1f us (%8.1f ns/symbol)\n", batchUs, 1000 * batchUs / names.size());
+  printf("  mismatches:              %zu\n", mismatches);
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+// Messages per second through the event loop of mc (SyncProc), from 1 to
+// 4096 app channels: each round posts a message on every channel and runs
+// the loops until the handler took them all, on SHARDS threads. Built once
+// per event engine: bench_sync_libevent and bench_sync_epoll.
+//
+// Usage: ./bench_sync_<engine> [MESSAGES] [SHARDS]
+
+#include "global.hpp"
+#include "sync_proc.hpp"
+#include <atomic>
+#include <chrono>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+using Clock = chrono::steady_clock;
+
+class Counter : public SyncProc::Handler {
+public:
+  SyncProc* syncProc = nullptr;
+  long expected      = 0;
+  atomic<long> taken{0};
+
+  bool on_message(int socket) override
+  {
+    char message[64];
+    if (syncProc->get_channel(socket).receive(message, sizeof(message), false) == (size_t)-1)
+      return false;
+    if (++taken >= expected)
+      syncProc->break_loop();
+    return true;
+  }
+  void on_sigchld() override {}
+  void on_process_exit(pid_t) override {}
+};
+
+// Messages per second over `channels` channels, `total` messages in all
+static double rate(long channels, long total, int shards)
+{
+  SyncProc syncProc(shards);
+  Counter counter;
+  counter.syncProc = &syncProc;
+  vector<int> senders;
+  list<int> receivers;
+  for (long i = 0; i < channels; i++) {
+    int sockets[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+      DLOG(ERROR, "Could not create channel #%ld: %s\n", i, strerror(errno));
+      exit(-1);
+    }
+    senders.push_back(sockets[0]);
+    receivers.push_back(sockets[1]);
+  }
+
+  char message[64] = {};
+  auto rounds      = max(1L, total / channels);
+  auto start       = Clock::now();
+  for (long round = 0; round < rounds; round++) {
+    for (auto sender : senders)
+      send(sender, message, sizeof(message), 0);
+    counter.expected += channels;
+    if (round == 0)
+      syncProc.start(counter, receivers);
+    else
+      syncProc.dispatch();
+  }
+  auto seconds = chrono::duration<double>(Clock::now() - start).count();
+  for (auto sender : senders)
+    close(sender);
+  return counter.taken / seconds;
+}
+
+int main(int argc, char** argv)
+{
+  long total = argc > 1 ? atol(argv[1]) : 1 << 20;
+  int shards = argc > 2 ? atoi(argv[2]) : 1;
+
+  // Two descriptors per channel
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  printf("%ld messages per channel count (%s engine, %d shards)\n", total, SIMGLD_ENGINE_NAME, shards);
+  printf("  %8s %14s\n", "channels", "messages/s");
+  for (long channels = 1; channels <= 4096; channels *= 4) {
+    if ((rlim_t)(2 * channels + 16) > limit.rlim_cur)
+      break;
+    printf("  %8ld %14.0f\n", channels, rate(channels, total, shards));
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+// Cost of the calls libwrapper.so interposes, linked in as if preloaded:
+// each call through the interposed symbol against the same call made
+// straight to libc, and what the accounting adds to it.
+//
+// Usage: ./bench_wrapper [CALLS]
+
+#include "global.hpp"
+#include "memory_account.hpp"
+#include <chrono>
+#include <dlfcn.h>
+
+using Clock = chrono::steady_clock;
+
+typedef void* (*mmap_t)(void*, size_t, int, int, int, off_t);
+typedef int (*munmap_t)(void*, size_t);
+typedef int (*madvise_t)(void*, size_t, int);
+
+template <typename Call> static double call_ns(long count, Call call)
+{
+  auto start = Clock::now();
+  for (long i = 0; i < count; i++)
+    call();
+  return chrono::duration<double, nano>(Clock::now() - start).count() / count;
+}
+
+int main(int argc, char** argv)
+{
+  long count = argc > 1 ? atol(argv[1]) : 1000000;
+
+  auto libc        = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+  auto libcMmap    = libc != nullptr ? (mmap_t)dlsym(libc, "mmap") : nullptr;
+  auto libcMunmap  = libc != nullptr ? (munmap_t)dlsym(libc, "munmap") : nullptr;
+  auto libcMadvise = libc != nullptr ? (madvise_t)dlsym(libc, "madvise") : nullptr;
+  if (libcMmap == nullptr || libcMunmap == nullptr || libcMadvise == nullptr || libcMmap == &mmap) {
+    DLOG(ERROR, "Could not find libc's memory calls apart from the interposed ones\n");
+    return 1;
+  }
+  auto account = MemoryAccount::open(getpid());
+  if (account == nullptr) {
+    DLOG(ERROR, "libwrapper.so keeps no account for us: is it linked in?\n");
+    return 1;
+  }
+
+  auto page = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  auto calls = account->calls[ACCOUNT_MADVISE];
+
+  printf("%ld calls (ns each)\n", count);
+  printf("  %-14s %10s %10s %10s\n", "call", "libc", "wrapped", "overhead");
+  auto direct  = call_ns(count, [&] { libcMadvise(page, PAGE_SIZE, MADV_NORMAL); });
+  auto wrapped = call_ns(count, [&] { madvise(page, PAGE_SIZE, MADV_NORMAL); });
+  printf("  %-14s %10.1f %10.1f %10.1f\n", "madvise", direct, wrapped, wrapped - direct);
+
+  // The pair adds a range to the mappings and takes it out again
+  direct = call_ns(count / 10, [&] {
+    auto addr = libcMmap(nullptr, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    libcMunmap(addr, PAGE_SIZE);
+  });
+  wrapped = call_ns(count / 10, [&] {
+    auto addr = mmap(nullptr, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    munmap(addr, PAGE_SIZE);
+  });
+  printf("  %-14s %10.1f %10.1f %10.1f\n", "mmap+munmap", direct, wrapped, wrapped - direct);
+
+  printf("%lu madvise calls accounted, %lu updates dropped\n",
+         (unsigned long)(account->calls[ACCOUNT_MADVISE] - calls), (unsigned long)account->dropped);
+  MemoryAccount::close_account(account);
+  return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef APP_METRICS_HPP
+#define APP_METRICS_HPP
+
+#include "global.hpp"
+#include <cstdint>
+
+// Counters the apps push to mc, one slot per app in a page shared between
+// them. As with the launch trace, mc maps it MAP_SHARED before forking,
+// outside of the apps' windows, and the apps find it through their layout
+// (WindowLayout::metrics). An app takes a slot by pid with a CAS and is its
+// only writer: an update is a relaxed load and store, no locked instruction.
+// mc reads the slots whenever it is scraped, and folds the slot of an app
+// that is over into `retired` before freeing it.
+struct AppMetrics {
+  static constexpr uint64_t kMagic        = 0x5347'4c44'4d54'5258ULL; // "SGLDMTRX"
+  static constexpr uint32_t kMaxSlots     = 64;
+  static constexpr uint32_t kMessageTypes = 16; // room for those of channel.hpp
+
+  struct Slot {
+    int32_t pid; // 0 when free
+    uint32_t unused;
+    uint64_t received[kMessageTypes]; // messages from mc, by type
+    uint64_t sent[kMessageTypes];     // messages to mc, by type
+    uint64_t steps;
+    uint64_t snapshotBytes; // of the snapshot taken for resets
+    uint64_t restores;
+    uint64_t restoreNs; // spent restoring the snapshot
+
+    static inline void add(uint64_t& counter, uint64_t value = 1)
+    {
+      __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+    }
+    static inline uint64_t get(const uint64_t& counter) { return __atomic_load_n(&counter, __ATOMIC_RELAXED); }
+  };
+
+  uint64_t magic;
+  uint32_t overflows; // apps that found no free slot
+  uint32_t unused;
+  Slot retired; // counters of the apps that are over; its snapshotBytes stays 0
+  Slot slots[kMaxSlots];
+
+  static inline size_t size() { return ROUND_UP(sizeof(AppMetrics)); }
+
+  // Maps a page shared with the processes forked from now on
+  static inline AppMetrics* create()
+  {
+    auto addr = mmap(nullptr, size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+      return nullptr;
+    auto metrics   = (AppMetrics*)addr;
+    metrics->magic = kMagic;
+    return metrics;
+  }
+
+  // Takes a free slot for `pid`; nullptr if there is none
+  inline Slot* claim(int32_t pid)
+  {
+    for (auto& slot : slots) {
+      int32_t expected = 0;
+      if (__atomic_compare_exchange_n(&slot.pid, &expected, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return &slot;
+    }
+    __atomic_fetch_add(&overflows, 1, __ATOMIC_RELAXED);
+    return nullptr;
+  }
+
+  inline Slot* find(int32_t pid)
+  {
+    for (auto& slot : slots)
+      if (__atomic_load_n(&slot.pid, __ATOMIC_ACQUIRE) == pid)
+        return &slot;
+    return nullptr;
+  }
+
+  // Once the app of `slot` is over: its counters go to `retired`, and the slot is cleared and freed
+  inline void retire(Slot* slot)
+  {
+    for (uint32_t type = 0; type < kMessageTypes; type++) {
+      __atomic_fetch_add(&retired.received[type], Slot::get(slot->received[type]), __ATOMIC_RELAXED);
+      __atomic_fetch_add(&retired.sent[type], Slot::get(slot->sent[type]), __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&retired.steps, Slot::get(slot->steps), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&retired.restores, Slot::get(slot->restores), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&retired.restoreNs, Slot::get(slot->restoreNs), __ATOMIC_RELAXED);
+    memset((char*)slot + sizeof(slot->pid), 0, sizeof(Slot) - sizeof(slot->pid));
+    __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+  }
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef DIRECT_LINK_HPP
+#define DIRECT_LINK_HPP
+
+#include "global.hpp"
+#include <cstdint>
+#include <cstring>
+
+// Switches to the stack `to`, saving ours in `save`: the callee-saved
+// registers are pushed on the stack left and popped from the one entered,
+// and ret goes on where the other side switched away (or enters it, see
+// DirectLink::enter). The FS register is left to the caller.
+__attribute__((naked, unused)) static void direct_switch(uintptr_t* save, uintptr_t to)
+{
+  asm volatile("push %rbp\n\t"
+               "push %rbx\n\t"
+               "push %r12\n\t"
+               "push %r13\n\t"
+               "push %r14\n\t"
+               "push %r15\n\t"
+               "mov %rsp, (%rdi)\n\t"
+               "mov %rsi, %rsp\n\t"
+               "pop %r15\n\t"
+               "pop %r14\n\t"
+               "pop %r13\n\t"
+               "pop %r12\n\t"
+               "pop %rbx\n\t"
+               "pop %rbp\n\t"
+               "ret");
+}
+
+// Transport of a Channel between mc and an app loaded in mc's own process
+// (mc --in-process) instead of a socketpair: each side posts its messages in
+// a mailbox of this block, and the app gives the control back to mc with a
+// plain stack switch when it waits for a message. mc resumes the app the
+// same way, with a SwitchContext around it for the app's FS.
+struct DirectLink {
+  static constexpr uint64_t kMagic    = 0x5347'4c44'4c49'4e4bULL; // "SGLDLINK"
+  static constexpr size_t kMaxMessage = 256 << 10;
+
+  struct Mailbox {
+    uint64_t size; // 0 when empty
+    char data[kMaxMessage];
+  };
+
+  uint64_t magic;
+  uintptr_t hostSp; // where mc waits while the app runs
+  uintptr_t appSp;  // where the app waits for mc, or its entry frame
+  uintptr_t appFs;
+  uint64_t resumes;
+  uintptr_t bootTcb[8]; // the FS the app starts with, until ld.so sets up its TLS
+  Mailbox toHost;
+  Mailbox toApp;
+
+  static inline size_t size() { return ROUND_UP(sizeof(DirectLink)); }
+
+  static inline DirectLink* create()
+  {
+    auto addr = mmap(nullptr, size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+      return nullptr;
+    auto link   = (DirectLink*)addr;
+    link->magic = kMagic;
+    return link;
+  }
+
+  // The first resume enters `entry` with the stack pointer at `stack`, as
+  // the kernel enters a program: a frame for direct_switch is built right
+  // below it. The FS points to a TCB of zeros pointing to itself.
+  inline void enter(uintptr_t stack, uintptr_t entry)
+  {
+    auto frame = (uintptr_t*)stack - 7;
+    memset(frame, 0, 6 * sizeof(uintptr_t));
+    frame[6]   = entry;
+    appSp      = (uintptr_t)frame;
+    bootTcb[0] = bootTcb[2] = (uintptr_t)bootTcb;
+    appFs                   = (uintptr_t)bootTcb;
+  }
+
+  // App side: back to mc until it resumes us; the TCB of glibc starts with
+  // a pointer to itself, which is the FS to come back with
+  inline void yield()
+  {
+    asm volatile("mov %%fs:0, %0" : "=r"(appFs));
+    direct_switch(&appSp, hostSp);
+  }
+
+  static inline bool post(Mailbox& box, const void* message, size_t size)
+  {
+    if (size > kMaxMessage)
+      return false;
+    memcpy(box.data, message, size);
+    box.size = size;
+    return true;
+  }
+
+  // Returns the size of the message taken, 0 if the box is empty
+  static inline size_t take(Mailbox& box, void* message, size_t size)
+  {
+    auto taken = box.size < size ? box.size : size;
+    memcpy(message, box.data, taken);
+    box.size = 0;
+    return taken;
+  }
+};
+
+#endif
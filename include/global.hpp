@@ -22,6 +22,7 @@ using namespace std;
 #define LD_NAME "/lib64/ld-linux-x86-64.so.2"
 
 constexpr unsigned MESSAGE_LENGTH = 512;
+constexpr unsigned MAX_CREDITS    = 64; // steps in a STEPS message
 
 #define FILENAMESIZE 1024
 #define MAX_ELF_INTERP_SZ 256
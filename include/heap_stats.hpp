@@ -0,0 +1,17 @@
+#ifndef HEAP_STATS_HPP
+#define HEAP_STATS_HPP
+
+#include <cstdint>
+
+// What the Heap of the loader (heap.hpp) did to serve the sbrk and brk calls
+// of an upper half. The loader points the mapping registry at them, so the
+// upper half can report them (see MappingRegistry::heap).
+struct HeapStats {
+  uint64_t commits       = 0; // mprotect calls making pages usable
+  uint64_t decommits     = 0; // calls giving pages back
+  uint64_t committed     = 0; // bytes currently usable
+  uint64_t peakCommitted = 0;
+  uint64_t calls         = 0; // sbrk and brk calls served
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef LAUNCH_TRACE_HPP
+#define LAUNCH_TRACE_HPP
+
+#include "global.hpp"
+#include <cstdint>
+#include <time.h>
+#include <x86intrin.h>
+
+// Points of an app launch, in the order they are reached: mc forks, the child
+// loads ld.so and builds its stack and heap, jumps into ld.so, and the app
+// waits for mc under ptrace, reports LOADED, gets its LAYOUT and is READY.
+enum LaunchPhase {
+  SPAWN_PHASE, // in mc, right before fork()
+  FORKED_PHASE,
+  LOAD_LSDO_PHASE,
+  STACK_PHASE,
+  HEAP_PHASE,
+  JUMP_PHASE,    // right before the jump into ld.so
+  TRACEME_PHASE, // the app ran PTRACE_TRACEME
+  RESUMED_PHASE, // mc let the app go on after its SIGSTOP
+  LOADED_PHASE,
+  LAYOUT_PHASE,
+  READY_PHASE,
+  LAUNCH_PHASES
+};
+
+inline constexpr const char* launchPhaseNames[] = {"spawn",   "fork",    "load_lsdo", "stack",  "heap",  "jump",
+                                                   "traceme", "sigstop", "loaded",    "layout", "ready"};
+static_assert(sizeof(launchPhaseNames) / sizeof(launchPhaseNames[0]) == LAUNCH_PHASES, "a name for each launch phase");
+
+// Timestamps of app launches, shared between mc and its apps. mc maps it
+// MAP_SHARED before forking, outside of the apps' windows, and the apps find
+// it through their layout (WindowLayout::trace). Each launch takes a slot by
+// pid with a CAS; stamps are raw TSC values, converted with the clock pair
+// taken at create().
+struct LaunchTrace {
+  static constexpr uint64_t kMagic    = 0x5347'4c44'4c4e'4348ULL; // "SGLDLNCH"
+  static constexpr uint32_t kMaxSlots = 64;
+
+  struct Slot {
+    int32_t pid;      // 0 when free
+    uint32_t reached; // bit per phase stamped
+    uint64_t stamps[LAUNCH_PHASES];
+
+    inline void stamp(LaunchPhase phase, uint64_t tsc = __rdtsc())
+    {
+      stamps[phase] = tsc;
+      reached |= 1u << phase;
+    }
+  };
+
+  uint64_t magic;
+  uint64_t tscStart;
+  uint64_t nsStart;
+  uint32_t overflows; // launches that found no free slot
+  Slot slots[kMaxSlots];
+
+  static inline size_t size() { return ROUND_UP(sizeof(LaunchTrace)); }
+
+  static inline uint64_t now_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  // Maps a trace shared with the processes forked from now on
+  static inline LaunchTrace* create()
+  {
+    auto addr = mmap(nullptr, size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+      return nullptr;
+    auto trace      = (LaunchTrace*)addr;
+    trace->magic    = kMagic;
+    trace->nsStart  = now_ns();
+    trace->tscStart = __rdtsc();
+    return trace;
+  }
+
+  // Takes a free slot for `pid`; nullptr if there is none
+  inline Slot* claim(int32_t pid)
+  {
+    for (auto& slot : slots) {
+      int32_t expected = 0;
+      if (__atomic_compare_exchange_n(&slot.pid, &expected, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        slot.reached = 0;
+        return &slot;
+      }
+    }
+    __atomic_fetch_add(&overflows, 1, __ATOMIC_RELAXED);
+    return nullptr;
+  }
+
+  inline Slot* find(int32_t pid)
+  {
+    for (auto& slot : slots)
+      if (__atomic_load_n(&slot.pid, __ATOMIC_ACQUIRE) == pid)
+        return &slot;
+    return nullptr;
+  }
+
+  inline void release(Slot* slot) { __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE); }
+
+  // TSC ticks per ns, measured over the time since create()
+  inline double ticks_per_ns() const
+  {
+    auto ns = now_ns() - nsStart;
+    return ns == 0 ? 1.0 : (double)(__rdtsc() - tscStart) / ns;
+  }
+
+  // Time spent reaching each phase from the previous one reached, in ns; 0 for the phases not reached
+  inline void intervals(const Slot& slot, double ticksPerNs, double out[LAUNCH_PHASES]) const
+  {
+    int previous = -1;
+    for (int phase = 0; phase < LAUNCH_PHASES; phase++) {
+      out[phase] = 0;
+      if (!(slot.reached & (1u << phase)))
+        continue;
+      if (previous != -1)
+        out[phase] = (slot.stamps[phase] - slot.stamps[previous]) / ticksPerNs;
+      previous = phase;
+    }
+  }
+};
+
+#endif
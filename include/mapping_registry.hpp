@@ -0,0 +1,168 @@
+#ifndef MAPPING_REGISTRY_HPP
+#define MAPPING_REGISTRY_HPP
+
+#include "global.hpp"
+#include "heap_stats.hpp"
+#include <cstdint>
+
+// Calls of the upper half routed through the interposition layer
+enum InterposedCall { MMAP_CALL, MUNMAP_CALL, MPROTECT_CALL, MREMAP_CALL, BRK_CALL, SBRK_CALL, INTERPOSED_CALLS };
+
+inline constexpr const char* interposedCallNames[] = {"mmap", "munmap", "mprotect", "mremap", "brk", "sbrk"};
+static_assert(sizeof(interposedCallNames) / sizeof(interposedCallNames[0]) == INTERPOSED_CALLS,
+              "a name for each interposed call");
+
+// Mappings of the upper half, kept up to date by the interposition layer so
+// that snapshot and checkpoint code can walk them without reading
+// /proc/self/maps. It lives in the control block of the upper half's window
+// (see WindowLayout::registry), so both halves find it from the layout.
+//
+// The ranges are sorted and never overlap. Only the upper half's own calls
+// update it and ld.so runs single threaded, so there is no locking.
+struct MappingRegistry {
+  static constexpr uint64_t kMagic     = 0x5347'4c44'4d41'5053ULL; // "SGLDMAPS"
+  static constexpr uint32_t kMaxRanges = 4096;
+
+  struct Range {
+    uintptr_t start;
+    uintptr_t end;
+    int prot;
+    int flags;
+  };
+
+  uint64_t magic;
+  uint32_t rangeCount;
+  uint32_t overflows; // ranges dropped because the table was full
+  uint64_t calls[INTERPOSED_CALLS];
+  uint64_t failures[INTERPOSED_CALLS];
+  const HeapStats* heap; // those of the loader's Heap serving sbrk and brk; nullptr if none does
+  Range ranges[kMaxRanges];
+
+  static inline size_t size() { return ROUND_UP(sizeof(MappingRegistry)); }
+
+  // Maps the registry at `addr`
+  static inline MappingRegistry* create(void* addr)
+  {
+    addr = mmap(addr, size(), PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+      return nullptr;
+    auto registry   = (MappingRegistry*)addr;
+    registry->magic = kMagic;
+    registry->add((uintptr_t)addr, (uintptr_t)addr + size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+    return registry;
+  }
+
+  inline void count(InterposedCall call, bool failed)
+  {
+    calls[call]++;
+    failures[call] += failed;
+  }
+
+  // First range ending after `addr`
+  inline uint32_t lower_bound(uintptr_t addr) const
+  {
+    uint32_t low = 0, high = rangeCount;
+    while (low < high) {
+      auto mid = (low + high) / 2;
+      if (ranges[mid].end <= addr)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    return low;
+  }
+
+  inline bool insert_at(uint32_t i, const Range& range)
+  {
+    if (rangeCount == kMaxRanges) {
+      overflows++;
+      return false;
+    }
+    memmove(&ranges[i + 1], &ranges[i], (rangeCount - i) * sizeof(Range));
+    ranges[i] = range;
+    rangeCount++;
+    return true;
+  }
+
+  // Splits the range holding `addr` in two at `addr`
+  inline void split(uintptr_t addr)
+  {
+    auto i = lower_bound(addr);
+    if (i == rangeCount || ranges[i].start >= addr)
+      return;
+    Range tail = ranges[i];
+    tail.start = addr;
+    if (insert_at(i + 1, tail))
+      ranges[i].end = addr;
+  }
+
+  inline void remove(uintptr_t start, uintptr_t end)
+  {
+    split(start);
+    split(end);
+    auto first = lower_bound(start);
+    auto last  = first;
+    while (last < rangeCount && ranges[last].end <= end)
+      last++;
+    memmove(&ranges[first], &ranges[last], (rangeCount - last) * sizeof(Range));
+    rangeCount -= last - first;
+  }
+
+  inline void add(uintptr_t start, uintptr_t end, int prot, int flags)
+  {
+    remove(start, end);
+    auto i = lower_bound(start);
+    // Grow the previous range instead when it continues it, as sbrk does
+    if (i > 0 && ranges[i - 1].end == start && ranges[i - 1].prot == prot && ranges[i - 1].flags == flags) {
+      ranges[i - 1].end = end;
+      return;
+    }
+    insert_at(i, Range{start, end, prot, flags});
+  }
+
+  inline void protect(uintptr_t start, uintptr_t end, int prot)
+  {
+    split(start);
+    split(end);
+    auto first = lower_bound(start);
+    auto last  = first;
+    for (; last < rangeCount && ranges[last].start < end; last++)
+      ranges[last].prot = prot;
+    merge(first > 0 ? first - 1 : 0, last);
+  }
+
+  // Merges the contiguous ranges of [first, last] that have the same protection and flags
+  inline void merge(uint32_t first, uint32_t last)
+  {
+    auto out = first;
+    for (auto i = first + 1; i <= last && i < rangeCount; i++) {
+      if (ranges[out].end == ranges[i].start && ranges[out].prot == ranges[i].prot &&
+          ranges[out].flags == ranges[i].flags)
+        ranges[out].end = ranges[i].end;
+      else
+        ranges[++out] = ranges[i];
+    }
+    auto next = min(last + 1, rangeCount);
+    if (out + 1 < next) {
+      memmove(&ranges[out + 1], &ranges[next], (rangeCount - next) * sizeof(Range));
+      rangeCount -= next - (out + 1);
+    }
+  }
+
+  inline const Range* find_range(uintptr_t addr) const
+  {
+    auto i = lower_bound(addr);
+    return i < rangeCount && ranges[i].start <= addr ? &ranges[i] : nullptr;
+  }
+
+  inline void remap(uintptr_t oldStart, size_t oldSize, uintptr_t newStart, size_t newSize)
+  {
+    auto range = find_range(oldStart);
+    int prot   = range != nullptr ? range->prot : PROT_READ | PROT_WRITE;
+    int flags  = range != nullptr ? range->flags : MAP_PRIVATE | MAP_ANONYMOUS;
+    remove(oldStart, oldStart + oldSize);
+    add(newStart, newStart + newSize, prot, flags);
+  }
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef MEMORY_ACCOUNT_HPP
+#define MEMORY_ACCOUNT_HPP
+
+#include "mapping_registry.hpp"
+#include <cstdint>
+#include <fcntl.h>
+#include <sched.h>
+
+// Calls accounted by the preloaded wrapper library (see wrapper.cpp)
+enum AccountedCall { ACCOUNT_MMAP, ACCOUNT_MUNMAP, ACCOUNT_MREMAP, ACCOUNT_BRK, ACCOUNT_MADVISE, ACCOUNTED_CALLS };
+
+inline constexpr const char* accountedCallNames[] = {"mmap", "munmap", "mremap", "brk", "madvise"};
+static_assert(sizeof(accountedCallNames) / sizeof(accountedCallNames[0]) == ACCOUNTED_CALLS,
+              "a name for each accounted call");
+
+// Memory calls of a process running with libwrapper.so preloaded, in a
+// shared memory object named after its pid, so that mc can read them while
+// the process runs: counters per call, and the mappings the process made.
+//
+// The counters are updated with atomics. The mappings are written under a
+// spinlock holding the writer's tid (threads of the process may race) and
+// published with a sequence number, odd while they change: readers copy them
+// and retry until the number is even and unchanged, without ever blocking
+// the writer.
+struct MemoryAccount {
+  static constexpr uint64_t kMagic = 0x5347'4c44'4143'4354ULL; // "SGLDACCT"
+
+  uint64_t magic;
+  pid_t pid;
+  uint32_t lock;
+  uint64_t started; // see start_time()
+  uint64_t seq;
+  uint64_t calls[ACCOUNTED_CALLS];
+  uint64_t failures[ACCOUNTED_CALLS];
+  uint64_t bytes[ACCOUNTED_CALLS]; // lengths passed to the calls that succeeded
+  uint64_t dropped;                // updates skipped: the thread was writing the mappings already
+  MappingRegistry registry;
+
+  static inline size_t size() { return ROUND_UP(sizeof(MemoryAccount)); }
+
+  static inline string name(pid_t pid) { return "/simgld-mem-" + to_string(pid); }
+
+  // When `pid` started, in clock ticks since boot: a pid and its start time
+  // tell a process apart from an earlier one that had the same pid
+  static inline uint64_t start_time(pid_t pid)
+  {
+    ifstream stat("/proc/" + to_string(pid) + "/stat");
+    string line;
+    getline(stat, line);
+    auto fields = line.rfind(')');
+    if (fields == string::npos)
+      return 0;
+    istringstream iss(line.substr(fields + 2));
+    string field;
+    for (auto i = 3; i < 22 && iss >> field; i++)
+      ;
+    uint64_t ticks = 0;
+    iss >> ticks;
+    return ticks;
+  }
+
+  // The account of the running process `pid`, created if it has none yet;
+  // several copies of the library in one process (mc --in-process) share
+  // it. `created` tells whether this call created it.
+  static inline MemoryAccount* attach(pid_t pid, bool& created)
+  {
+    auto path    = name(pid);
+    auto started = start_time(pid);
+    int fd       = shm_open(path.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd == -1)
+      return nullptr;
+    void* addr = MAP_FAILED;
+    if (ftruncate(fd, size()) == 0)
+      addr = mmap(nullptr, size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      shm_unlink(path.c_str());
+      return nullptr;
+    }
+    auto account = (MemoryAccount*)addr;
+    created      = __atomic_load_n(&account->magic, __ATOMIC_ACQUIRE) != kMagic || account->pid != pid ||
+              account->started != started;
+    if (created) {
+      // A stale account of a process gone with our pid, or a new one
+      memset(account, 0, sizeof(MemoryAccount));
+      account->pid            = pid;
+      account->started        = started;
+      account->registry.magic = MappingRegistry::kMagic;
+      __atomic_store_n(&account->magic, kMagic, __ATOMIC_RELEASE);
+    }
+    return account;
+  }
+
+  // The account of `pid`, read only; nullptr if the process has none
+  static inline const MemoryAccount* open(pid_t pid)
+  {
+    int fd = shm_open(name(pid).c_str(), O_RDONLY, 0);
+    if (fd == -1)
+      return nullptr;
+    auto addr = mmap(nullptr, size(), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      return nullptr;
+    auto account = (const MemoryAccount*)addr;
+    if (__atomic_load_n(&account->magic, __ATOMIC_ACQUIRE) != kMagic) {
+      munmap(addr, size());
+      return nullptr;
+    }
+    return account;
+  }
+
+  static inline void close_account(const MemoryAccount* account) { munmap((void*)account, size()); }
+
+  static inline void unlink(pid_t pid) { shm_unlink(name(pid).c_str()); }
+
+  inline void count(AccountedCall call, bool failed, size_t length)
+  {
+    __atomic_fetch_add(&calls[call], 1, __ATOMIC_RELAXED);
+    if (failed)
+      __atomic_fetch_add(&failures[call], 1, __ATOMIC_RELAXED);
+    else
+      __atomic_fetch_add(&bytes[call], length, __ATOMIC_RELAXED);
+  }
+
+  // Writer side, for thread `tid`: waits while another thread writes;
+  // returns false, without waiting, when the holder is the caller itself,
+  // from a signal handler of another copy of the library
+  inline bool begin_update(pid_t tid)
+  {
+    uint32_t holder = 0;
+    for (uint32_t spins = 1;
+         !__atomic_compare_exchange_n(&lock, &holder, (uint32_t)tid, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+         spins++) {
+      if (holder == (uint32_t)tid) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return false;
+      }
+      holder = 0;
+      if (spins % 64 == 0)
+        sched_yield(); // the holder may not be running
+      else
+        __builtin_ia32_pause();
+    }
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return true;
+  }
+
+  inline void end_update()
+  {
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
+  }
+
+  // Reader side: copies the mappings into `out`; false if they kept changing
+  inline bool snapshot(MappingRegistry& out, int attempts = 100) const
+  {
+    for (auto i = 0; i < attempts; i++) {
+      auto before = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+      if (before & 1)
+        continue;
+      memcpy(&out, &registry, sizeof(MappingRegistry));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&seq, __ATOMIC_RELAXED) == before && out.rangeCount <= MappingRegistry::kMaxRanges)
+        return true;
+    }
+    return false;
+  }
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef UPPER_HALF_ALLOCATOR_HPP
+#define UPPER_HALF_ALLOCATOR_HPP
+
+#include "global.hpp"
+#include "mapping_registry.hpp"
+#include "window_layout.hpp"
+#include <cstdint>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// Address space manager of the app's window: mmaps of the upper half that
+// leave the placement to the kernel get an address from here instead, so the
+// app stays inside its window, packed, and away from the lower half.
+//
+// First fit over a sorted free list; freed ranges are merged with their
+// neighbours. Like the registry, it lives in the control block of the window
+// (see WindowLayout::allocator) and has no locking.
+struct UpperHalfAllocator {
+  static constexpr uint32_t kMaxFree = 4096;
+
+  struct Range {
+    uintptr_t start;
+    uintptr_t end;
+  };
+
+  uintptr_t areaStart;
+  uintptr_t areaEnd;
+  uint32_t freeCount;
+  uint32_t overflows;  // freed ranges lost because the list was full
+  uint64_t allocated;  // bytes handed out and not released
+  uint64_t fallbacks;  // requests left to the kernel: no room, or the range was taken
+  Range free[kMaxFree];
+
+  static inline size_t size() { return ROUND_UP(sizeof(UpperHalfAllocator)); }
+
+  // Maps the allocator of the window `layout`; what `registry` already holds
+  // is not handed out, nor the rooms the stack, the heap and the snapshot grow in
+  static inline UpperHalfAllocator* create(const WindowLayout& layout, const MappingRegistry& registry)
+  {
+    auto addr = mmap((void*)layout.allocator, size(), PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (addr == MAP_FAILED)
+      return nullptr;
+    auto allocator       = (UpperHalfAllocator*)addr;
+    allocator->areaStart = layout.start;
+    allocator->areaEnd   = layout.end;
+    allocator->release(allocator->areaStart, allocator->areaEnd);
+    allocator->claim((uintptr_t)addr, (uintptr_t)addr + size());
+    for (uint32_t i = 0; i < registry.rangeCount; i++)
+      allocator->claim(registry.ranges[i].start, registry.ranges[i].end);
+    allocator->claim(layout.stack - layout.stackRoom, layout.stack);
+    allocator->claim(layout.heap, layout.heap + layout.heapSize);
+    allocator->claim(layout.snapshot, layout.snapshot + layout.snapshotSize);
+    allocator->allocated = 0;
+    return allocator;
+  }
+
+  // First free range ending after `addr`
+  inline uint32_t lower_bound(uintptr_t addr) const
+  {
+    uint32_t low = 0, high = freeCount;
+    while (low < high) {
+      auto mid = (low + high) / 2;
+      if (free[mid].end <= addr)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    return low;
+  }
+
+  // Returns the start of `length` free bytes taken off the list, 0 if none
+  inline uintptr_t allocate(size_t length)
+  {
+    for (uint32_t i = 0; i < freeCount; i++) {
+      if (free[i].end - free[i].start < length)
+        continue;
+      auto start = free[i].start;
+      free[i].start += length;
+      if (free[i].start == free[i].end) {
+        memmove(&free[i], &free[i + 1], (freeCount - i - 1) * sizeof(Range));
+        freeCount--;
+      }
+      allocated += length;
+      return start;
+    }
+    return 0;
+  }
+
+  // Takes [start, end) off the free list, e.g. for a MAP_FIXED mapping
+  inline void claim(uintptr_t start, uintptr_t end)
+  {
+    start = max(start, areaStart);
+    end   = min(end, areaEnd);
+    for (auto i = lower_bound(start); i < freeCount && free[i].start < end;) {
+      auto& range = free[i];
+      if (range.start < start && range.end > end) {
+        // Splits the range in two
+        if (freeCount == kMaxFree) {
+          range.end = start; // drop the tail rather than hand out the claimed part
+          overflows++;
+          return;
+        }
+        memmove(&free[i + 2], &free[i + 1], (freeCount - i - 1) * sizeof(Range));
+        free[i + 1] = Range{end, range.end};
+        range.end   = start;
+        freeCount++;
+        allocated += end - start;
+        return;
+      }
+      allocated += min(range.end, end) - max(range.start, start);
+      if (range.start < start) {
+        range.end = start;
+        i++;
+      } else if (range.end > end) {
+        range.start = end;
+        i++;
+      } else {
+        memmove(&free[i], &free[i + 1], (freeCount - i - 1) * sizeof(Range));
+        freeCount--;
+      }
+    }
+  }
+
+  // Puts [start, end) back on the free list, merged with its neighbours
+  inline void release(uintptr_t start, uintptr_t end)
+  {
+    start = max(start, areaStart);
+    end   = min(end, areaEnd);
+    if (start >= end)
+      return;
+    claim(start, end); // so that releasing twice is harmless
+    allocated -= end - start;
+
+    auto i         = lower_bound(start);
+    bool withPrev  = i > 0 && free[i - 1].end == start;
+    bool withNext  = i < freeCount && free[i].start == end;
+    if (withPrev && withNext) {
+      free[i - 1].end = free[i].end;
+      memmove(&free[i], &free[i + 1], (freeCount - i - 1) * sizeof(Range));
+      freeCount--;
+    } else if (withPrev) {
+      free[i - 1].end = end;
+    } else if (withNext) {
+      free[i].start = start;
+    } else if (freeCount == kMaxFree) {
+      overflows++;
+    } else {
+      memmove(&free[i + 1], &free[i], (freeCount - i) * sizeof(Range));
+      free[i] = Range{start, end};
+      freeCount++;
+    }
+  }
+
+  inline bool contains(uintptr_t addr) const { return areaStart <= addr && addr < areaEnd; }
+};
+
+#endif
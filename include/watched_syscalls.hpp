@@ -0,0 +1,49 @@
+#ifndef WATCHED_SYSCALLS_HPP
+#define WATCHED_SYSCALLS_HPP
+
+#include <sys/syscall.h>
+
+// The syscalls an app running with Syscall User Dispatch (mc
+// --syscall-dispatch) reports to mc: those that change its processes,
+// threads, signals or mappings. Returns their name, nullptr for the others.
+static inline const char* watched_syscall(long number)
+{
+  switch (number) {
+    case SYS_clone:
+      return "clone";
+    case SYS_clone3:
+      return "clone3";
+    case SYS_fork:
+      return "fork";
+    case SYS_vfork:
+      return "vfork";
+    case SYS_execve:
+      return "execve";
+    case SYS_execveat:
+      return "execveat";
+    case SYS_exit:
+      return "exit";
+    case SYS_exit_group:
+      return "exit_group";
+    case SYS_kill:
+      return "kill";
+    case SYS_tkill:
+      return "tkill";
+    case SYS_tgkill:
+      return "tgkill";
+    case SYS_mmap:
+      return "mmap";
+    case SYS_munmap:
+      return "munmap";
+    case SYS_mremap:
+      return "mremap";
+    case SYS_mprotect:
+      return "mprotect";
+    case SYS_brk:
+      return "brk";
+    default:
+      return nullptr;
+  }
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef WINDOW_LAYOUT_HPP
+#define WINDOW_LAYOUT_HPP
+
+#include "global.hpp"
+#include <cstdint>
+#include <sys/auxv.h>
+
+// Aux vector entry the loader adds to the stack it builds for ld.so: the
+// address of the WindowLayout of the program ld.so runs. The kernel never
+// uses this type, and getauxval() returns any entry of the vector.
+#define AT_SIMGLD_LAYOUT 0x53474c44
+
+// Where the loader put an upper half (mc under sgld, or an app under mc):
+// a window of the address space planned by AddressPlanner, from low to high
+//   layout page | ld.so | mmap room | stack room | stack | control | heap | snapshot room
+// The layout page is the first page of the window and holds this record;
+// the mmap room is what the upper half allocator hands out, the stack grows
+// down into the stack room, and the control block holds the mapping registry
+// and the allocator.
+struct WindowLayout {
+  static constexpr uint64_t kMagic = 0x5347'4c44'5749'4e44ULL; // "SGLDWIND"
+
+  uint64_t magic;
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t ldso;
+  uint64_t ldsoSize;
+  uintptr_t mmapRoom;
+  uint64_t mmapRoomSize;
+  uintptr_t stack; // the stack mapping; it grows down by up to stackRoom bytes
+  uint64_t stackSize;
+  uint64_t stackRoom;
+  uintptr_t registry;
+  uintptr_t allocator;
+  uintptr_t heap;
+  uint64_t heapSize;
+  uintptr_t snapshot;
+  uint64_t snapshotSize;
+  uintptr_t trace;   // the launch trace shared by mc and its apps, outside of the window; 0 if none
+  uintptr_t metrics; // the AppMetrics page shared by mc and its apps, outside of the window; 0 if none
+  uintptr_t link;    // the DirectLink to mc when the app runs in mc's process; 0 if it has its own
+  uint64_t dispatch; // non-zero: the app traps its syscalls with Syscall User Dispatch instead of being traced
+  uint64_t replay;   // non-zero: mc replays a recorded path (--replay), the app takes no snapshot for resets
+  uint64_t graph;    // non-zero: mc records the state graph, the app tells the state it is in (s_message_t)
+
+  inline size_t size() const { return end - start; }
+  inline bool contains(uintptr_t addr) const { return start <= addr && addr < end; }
+
+  // The layout the loader left for this process, or nullptr if it was not started by the loader
+  static inline const WindowLayout* current()
+  {
+    auto layout = (const WindowLayout*)getauxval(AT_SIMGLD_LAYOUT);
+    return layout != nullptr && layout->magic == kMagic ? layout : nullptr;
+  }
+};
+
+#endif
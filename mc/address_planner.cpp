@@ -0,0 +1,113 @@
+#include "address_planner.h"
+#include "elf_image.h"
+#include "mapping_registry.hpp"
+#include "upper_half_allocator.hpp"
+#include <algorithm>
+
+#define ALIGN_WINDOW(x) ((uintptr_t)(x) & ~(AddressPlanner::kWindowAlign - 1))
+
+AddressPlanner::AddressPlanner(const StartupContext& context)
+{
+  stackSize_ = context.stack().end - context.stack().start;
+  ceiling_   = ALIGN_WINDOW(context.stack().start - kStackGuard);
+
+  // The kernel's mmap base is right above the highest mapping it places on
+  // its own: probe it, and skip the mappings of the lower half it placed
+  // there already. The window we run in, if any, is not one of them.
+  auto own   = WindowLayout::current();
+  auto probe = mmap(nullptr, PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (probe != MAP_FAILED) {
+    floor_ = (uintptr_t)probe + PAGE_SIZE;
+    munmap(probe, PAGE_SIZE);
+  }
+  for (const auto& mapping : context.maps()) {
+    take(mapping.start, mapping.end);
+    bool special = mapping.name == "[stack]" || mapping.name == "[vvar]" || mapping.name == "[vdso]" ||
+                   mapping.name == "[vsyscall]";
+    if (!special && mapping.end <= ceiling_ && (own == nullptr || !own->contains(mapping.start)))
+      floor_ = max(floor_, mapping.end);
+  }
+  if (own != nullptr)
+    take(own->start, own->end);
+}
+
+void AddressPlanner::take(uintptr_t start, uintptr_t end)
+{
+  auto it = lower_bound(taken_.begin(), taken_.end(), start, [](const Range& range, uintptr_t addr) {
+    return range.end < addr;
+  });
+  // Merge with every range it touches
+  auto last = it;
+  while (last != taken_.end() && last->start <= end) {
+    start = min(start, last->start);
+    end   = max(end, last->end);
+    last++;
+  }
+  it = taken_.erase(it, last);
+  taken_.insert(it, Range{start, end});
+}
+
+bool AddressPlanner::plan(const Budget& budget, const vector<string>& elfs, WindowLayout& layout)
+{
+  auto ldso = ElfImage::open(LD_NAME);
+  if (!ldso)
+    return false;
+  uint64_t elfSize = 0;
+  for (const auto& path : elfs) {
+    auto image = ElfImage::open(path);
+    if (image)
+      elfSize += image->load_size();
+  }
+
+  layout              = WindowLayout {};
+  layout.magic        = WindowLayout::kMagic;
+  layout.ldsoSize     = ROUND_UP(ldso->load_size());
+  layout.mmapRoomSize = ROUND_UP(budget.mmapRoom + elfSize);
+  layout.stackRoom    = ROUND_UP(budget.stackRoom);
+  layout.stackSize    = ROUND_UP(stackSize_);
+  layout.heapSize     = ROUND_UP(budget.heapSize);
+  layout.snapshotSize = ROUND_UP(budget.snapshotSize);
+  uint64_t control    = MappingRegistry::size() + UpperHalfAllocator::size();
+  uint64_t size       = PAGE_SIZE + layout.ldsoSize + layout.mmapRoomSize + layout.stackRoom + layout.stackSize +
+                  control + kWindowAlign + layout.heapSize + layout.snapshotSize; // the heap is huge page aligned
+  size = ALIGN_WINDOW(size + kWindowAlign - 1);
+
+  // Top down, in the highest gap of [bottom, ceiling_) that fits
+  auto find = [&](uintptr_t bottom) -> uintptr_t {
+    uintptr_t top = ceiling_;
+    for (auto it = taken_.rbegin();; ++it) {
+      if (it != taken_.rend() && it->start >= top)
+        continue;
+      uintptr_t low = it == taken_.rend() ? bottom : max(bottom, it->end);
+      if (top > low && top - low >= size && ALIGN_WINDOW(top - size) >= low)
+        return ALIGN_WINDOW(top - size);
+      if (it == taken_.rend() || it->start <= bottom)
+        return 0;
+      top = it->start;
+    }
+  };
+  // Above the mmap base if possible; below it, the window may only be
+  // shared with what the lower half maps later on a hint
+  uintptr_t start = find(floor_);
+  if (start == 0)
+    start = find(kLowest);
+  if (start == 0) {
+    DLOG(ERROR, "No room for a window of %lu MB below %p\n", (unsigned long)(size >> 20), (void*)ceiling_);
+    return false;
+  }
+  if (start < floor_)
+    DLOG(INFO, "The window of %lu MB at %p is below the mmap base (%p)\n", (unsigned long)(size >> 20), (void*)start,
+         (void*)floor_);
+
+  layout.start     = start;
+  layout.end       = start + size;
+  layout.ldso      = start + PAGE_SIZE; // after the layout page
+  layout.mmapRoom  = layout.ldso + layout.ldsoSize;
+  layout.stack     = layout.mmapRoom + layout.mmapRoomSize + layout.stackRoom;
+  layout.registry  = layout.stack + layout.stackSize;
+  layout.allocator = layout.registry + MappingRegistry::size();
+  layout.heap      = ALIGN_WINDOW(layout.allocator + UpperHalfAllocator::size() + kWindowAlign - 1);
+  layout.snapshot  = layout.heap + layout.heapSize;
+  take(layout.start, layout.end);
+  return true;
+}
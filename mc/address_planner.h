@@ -0,0 +1,57 @@
+#ifndef ADDRESS_PLANNER_H
+#define ADDRESS_PLANNER_H
+
+#include "startup_context.h"
+#include "window_layout.hpp"
+
+using namespace std;
+
+// Places the windows of the upper halves (see WindowLayout) in the address
+// space of the process. Windows go top down, from a gigabyte below the
+// [stack] to the kernel's mmap base: the kernel places the mappings it is
+// free to place below that base, so nothing of the lower half will land in
+// a window later. They are packed around whatever is already mapped there,
+// and never overlap each other nor the window the process itself runs in.
+// When that range is full, windows go below the mmap base.
+//
+// Replicas forked from a zygote run in their own process and keep the
+// zygote's window.
+class AddressPlanner {
+public:
+  // What a window has room for, besides ld.so and the stack
+  struct Budget {
+    uint64_t mmapRoom     = 1ULL << 30; // mappings of the upper half, on top of its ELF files
+    uint64_t stackRoom    = 64ULL << 20;
+    uint64_t heapSize     = 256ULL << 20;
+    uint64_t snapshotSize = 256ULL << 20;
+  };
+
+  static constexpr uint64_t kStackGuard  = 1ULL << 30; // left free below the [stack]
+  static constexpr uint64_t kWindowAlign = 2ULL << 20; // windows start on huge page boundaries
+  static constexpr uint64_t kLowest      = 1ULL << 32; // no window below, where non-PIE programs live
+
+private:
+  struct Range {
+    uintptr_t start;
+    uintptr_t end;
+  };
+  vector<Range> taken_; // sorted, merged
+  uintptr_t ceiling_ = 0;
+  uintptr_t floor_   = 0;
+  size_t stackSize_  = 0;
+
+  void take(uintptr_t start, uintptr_t end);
+
+public:
+  explicit AddressPlanner(const StartupContext& context);
+
+  // Plans a window below the ones planned so far; `elfs` are the files the
+  // upper half will load beside ld.so (e.g. the app), whose size is added to
+  // its mmap room. Returns false if there is no room left.
+  bool plan(const Budget& budget, const vector<string>& elfs, WindowLayout& layout);
+
+  inline uintptr_t ceiling() const { return ceiling_; }
+  inline uintptr_t floor() const { return floor_; }
+};
+
+#endif
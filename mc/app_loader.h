@@ -1,7 +1,10 @@
 #ifndef APP_LOADER_H
 #define APP_LOADER_H
 
+#include "direct_link.hpp"
 #include "dyn_obj_info.hpp"
+#include "elf_image.h"
+#include "launch_trace.hpp"
 #include "user_space.h"
 #include <elf.h>
 #include <memory>
@@ -13,28 +16,35 @@ private:
   unique_ptr<UserSpace> userSpace_;
   unique_ptr<Stack> stack_;
   unique_ptr<Heap> heap_;
-  Elf64_Addr get_interpreter_entry(const char* ld_name);
-  unsigned long loadSegment(void* startAddr, int fd, Elf64_Ehdr* ehdr, Elf64_Phdr* phdr);
-  void* loadInterpreter(void* startAddr, const char* elf_interpreter, DynObjInfo& info);
+  bool heapHugePages_             = false;
+  LaunchTrace::Slot* launchSlot_ = nullptr;
+  void* loadInterpreter(void* startAddr, const ElfImage& image, DynObjInfo& info);
   DynObjInfo load_lsdo(void* startAddr, const char* ld_name);
+  bool mapLayout(const WindowLayout& layout) const;
+  void registerMappings(const WindowLayout& layout) const;
+  int interposeMemoryCalls(DynObjInfo& ldso) const;
 
 public:
   explicit AppLoader();
-  void runRtld(void* app_addr, vector<string> app_params, int socket_id);
-  void runRtld(void* mcAddr, void* appAddr);
+  void runRtld(const WindowLayout& layout, vector<string> app_params, int socket_id);
+  void runRtld(const WindowLayout& layout);
+  bool loadRtld(const WindowLayout& layout, vector<string> app_params, DirectLink& link);
 
-  inline void* reserveMemSpace(unsigned long relativeDistFromStack, unsigned long size) const
-  {
-    return userSpace_->reserve_mem_space(relativeDistFromStack, size);
-  }
+  // Maps the PT_LOAD segments of `image` at `startAddr` (anywhere for ET_DYN); returns the base or LOAD_ERR
+  static unsigned long loadSegment(void* startAddr, const ElfImage& image);
 
   inline void* reserveMemSpace(void* addr, size_t len) const { return userSpace_->reserve_mem_space(addr, len); }
 
   inline int releaseMemSpace(void* addr, size_t len) const { return userSpace_->release_mem_space(addr, len); }
 
-  inline void* getStackAddr() const
+  inline void setHeapHugePages(bool enabled) { heapHugePages_ = enabled; }
+
+  // Launch phases reached in runRtld are stamped in `slot`
+  inline void setLaunchSlot(LaunchTrace::Slot* slot) { launchSlot_ = slot; }
+  inline void stampLaunch(LaunchPhase phase)
   {
-    return userSpace_->get_stack_addr();
+    if (launchSlot_ != nullptr)
+      launchSlot_->stamp(phase);
   }
 };
 
@@ -1,5 +1,6 @@
 #include "cmdline_params.h"
 #include <iostream>
+#include <stdexcept>
 
 // returns the parent's parameters start index in the command line parameters
 int cmdLineParams::process_argv(char** argv)
@@ -11,6 +12,19 @@ int cmdLineParams::process_argv(char** argv)
   auto index{0};
   argv++;
   i++;
+
+  // mc options come first, in the form --name=value (or --name for a flag)
+  while (*argv != nullptr && strncmp(*argv, "--", 2) == 0 && strlen(*argv) > 2) {
+    string option(*argv + 2);
+    auto eq = option.find('=');
+    if (eq == string::npos)
+      options_[option] = "1";
+    else
+      options_[option.substr(0, eq)] = option.substr(eq + 1);
+    argv++;
+    i++;
+  }
+
   while (*argv != nullptr) {
     if (strcmp(*argv, (char*)"--") == 0) {
       separatorFound = (!separatorFound) ? true : false;
@@ -30,4 +44,17 @@ int cmdLineParams::process_argv(char** argv)
   apps_.push_back(argv1); // child
   apps_.push_back(argv2); // parent
   return ++index;
-}
\ No newline at end of file
+}
+
+long cmdLineParams::getOption(const string& name, long defaultValue) const
+{
+  auto it = options_.find(name);
+  if (it == options_.end())
+    return defaultValue;
+  try {
+    return stol(it->second);
+  } catch (const std::exception&) {
+    cerr << "invalid numeric value for --" << name << ": " << it->second << endl;
+    exit(-1);
+  }
+}
@@ -5,18 +5,28 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <map>
 
 using namespace std;
 
 class cmdLineParams {
 private:
   vector<vector<string>> apps_;
+  map<string, string> options_; // mc options given as --name=value before the first app
 
 public:
   explicit cmdLineParams() = default;
   int process_argv(char** argv);
   inline int getAppCount() const { return apps_.size(); } 
   inline vector<string> getAppParams(int index) const { return apps_[index]; } 
+
+  inline bool hasOption(const string& name) const { return options_.find(name) != options_.end(); }
+  inline string getOption(const string& name, const string& defaultValue) const
+  {
+    auto it = options_.find(name);
+    return (it != options_.end()) ? it->second : defaultValue;
+  }
+  long getOption(const string& name, long defaultValue) const;
 };
 
-#endif
\ No newline at end of file
+#endif
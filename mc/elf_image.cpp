@@ -0,0 +1,119 @@
+#include "elf_image.h"
+#include "global.hpp"
+#include "symbol_resolver.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+map<string, ElfImage::CacheEntry> ElfImage::cache_;
+
+ElfImage::~ElfImage()
+{
+  if (data_ != nullptr)
+    munmap((void*)data_, size_);
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+shared_ptr<ElfImage> ElfImage::open(const string& path)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    DLOG(ERROR, "could not stat %s: %s\n", path.c_str(), strerror(errno));
+    return nullptr;
+  }
+
+  auto it = cache_.find(path);
+  if (it != cache_.end() && it->second.dev == st.st_dev && it->second.ino == st.st_ino)
+    return it->second.image;
+
+  auto image = make_shared<ElfImage>();
+  if (!image->load(path))
+    return nullptr;
+  cache_[path] = CacheEntry{st.st_dev, st.st_ino, image};
+  return image;
+}
+
+bool ElfImage::in_file(Elf64_Off offset, uint64_t size) const
+{
+  return offset <= size_ && size <= size_ - offset;
+}
+
+bool ElfImage::load(const string& path)
+{
+  path_ = path;
+  fd_   = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    DLOG(ERROR, "could not open %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+    DLOG(ERROR, "%s is too small to be an ELF file\n", path.c_str());
+    return false;
+  }
+  size_ = st.st_size;
+  data_ = (const char*)mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    DLOG(ERROR, "could not map %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  ehdr_ = (const Elf64_Ehdr*)data_;
+  if (memcmp(ehdr_->e_ident, ELFMAG, SELFMAG) != 0 || ehdr_->e_ident[EI_CLASS] != ELFCLASS64) {
+    // FIXME:  Add support for 32-bit ELF
+    DLOG(ERROR, "%s is not a 64-bit ELF file\n", path.c_str());
+    return false;
+  }
+  if (!in_file(ehdr_->e_phoff, (uint64_t)ehdr_->e_phnum * sizeof(Elf64_Phdr))) {
+    DLOG(ERROR, "%s: program headers out of the file\n", path.c_str());
+    return false;
+  }
+  phdrs_ = (const Elf64_Phdr*)(data_ + ehdr_->e_phoff);
+
+  // Section headers are optional for loading, so a broken table only costs the symbols
+  if (ehdr_->e_shoff != 0 && in_file(ehdr_->e_shoff, (uint64_t)ehdr_->e_shnum * sizeof(Elf64_Shdr))) {
+    shdrs_ = (const Elf64_Shdr*)(data_ + ehdr_->e_shoff);
+    find_symbols(SHT_SYMTAB);
+    if (symtab_ == nullptr)
+      find_symbols(SHT_DYNSYM);
+  }
+  return true;
+}
+
+void ElfImage::find_symbols(uint32_t type)
+{
+  for (auto i = 0; i < ehdr_->e_shnum; i++) {
+    const auto& section = shdrs_[i];
+    if (section.sh_type != type || section.sh_link >= ehdr_->e_shnum)
+      continue;
+    const auto& strings = shdrs_[section.sh_link];
+    if (!in_file(section.sh_offset, section.sh_size) || !in_file(strings.sh_offset, strings.sh_size))
+      continue;
+    symtab_     = (const Elf64_Sym*)(data_ + section.sh_offset);
+    symCount_   = section.sh_size / sizeof(Elf64_Sym);
+    strtab_     = data_ + strings.sh_offset;
+    strtabSize_ = strings.sh_size;
+    return;
+  }
+}
+
+const SymbolResolver& ElfImage::symbols() const
+{
+  if (!symbols_)
+    symbols_ = make_unique<SymbolResolver>(*this);
+  return *symbols_;
+}
+
+size_t ElfImage::load_size() const
+{
+  uint64_t minva = (uint64_t)-1, maxva = 0;
+  for (auto i = 0; i < phnum(); i++) {
+    if (phdrs_[i].p_type != PT_LOAD)
+      continue;
+    minva = min(minva, (uint64_t)phdrs_[i].p_vaddr);
+    maxva = max(maxva, (uint64_t)(phdrs_[i].p_vaddr + phdrs_[i].p_memsz));
+  }
+  return maxva == 0 ? 0 : ROUND_PG(maxva) - TRUNC_PG(minva);
+}
@@ -0,0 +1,83 @@
+#ifndef ELF_IMAGE_H
+#define ELF_IMAGE_H
+
+#include <elf.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+using namespace std;
+
+class SymbolResolver;
+
+// An ELF file opened and mapped read-only once; the headers and the symbol
+// tables are views into the mapping. Images are cached per path and inode,
+// so loading the same file again (e.g. ld.so for every app) does no file I/O.
+// The fd stays open so that the loader can map the segments from it.
+class ElfImage {
+private:
+  struct CacheEntry {
+    dev_t dev;
+    ino_t ino;
+    shared_ptr<ElfImage> image;
+  };
+  static map<string, CacheEntry> cache_;
+
+  string path_;
+  int fd_                  = -1;
+  const char* data_        = nullptr;
+  size_t size_             = 0;
+  const Elf64_Ehdr* ehdr_  = nullptr;
+  const Elf64_Phdr* phdrs_ = nullptr;
+  const Elf64_Shdr* shdrs_ = nullptr;
+  const Elf64_Sym* symtab_ = nullptr;
+  size_t symCount_         = 0;
+  const char* strtab_      = nullptr;
+  size_t strtabSize_       = 0;
+  mutable unique_ptr<SymbolResolver> symbols_;
+
+  bool load(const string& path);
+  bool in_file(Elf64_Off offset, uint64_t size) const;
+  void find_symbols(uint32_t type);
+
+public:
+  explicit ElfImage() = default;
+  ~ElfImage();
+
+  // No copy
+  ElfImage(ElfImage const&) = delete;
+  ElfImage& operator=(ElfImage const&) = delete;
+
+  // Returns the cached image of `path`, loading it if the file is new or was
+  // replaced since; nullptr if it is not a valid 64-bit ELF file
+  static shared_ptr<ElfImage> open(const string& path);
+
+  inline const string& path() const { return path_; }
+  inline int fd() const { return fd_; }
+  inline const char* data() const { return data_; }
+  inline size_t size() const { return size_; }
+
+  inline const Elf64_Ehdr* ehdr() const { return ehdr_; }
+  inline const Elf64_Phdr* phdrs() const { return phdrs_; }
+  inline int phnum() const { return ehdr_->e_phnum; }
+  inline const Elf64_Shdr* shdrs() const { return shdrs_; }
+  inline int shnum() const { return shdrs_ == nullptr ? 0 : ehdr_->e_shnum; }
+
+  // Bytes of address space the PT_LOAD segments span once loaded, in whole pages
+  size_t load_size() const;
+
+  // .symtab and its string table, or .dynsym and .dynstr for stripped files
+  inline const Elf64_Sym* symtab() const { return symtab_; }
+  inline size_t symbol_count() const { return symCount_; }
+  inline const char* strtab() const { return strtab_; }
+  inline const char* symbol_name(const Elf64_Sym& sym) const
+  {
+    return sym.st_name < strtabSize_ ? strtab_ + sym.st_name : "";
+  }
+
+  // Built on first use and kept with the image
+  const SymbolResolver& symbols() const;
+};
+
+#endif
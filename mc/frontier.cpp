@@ -0,0 +1,240 @@
+#include "frontier.h"
+#include "global.hpp"
+#include <fcntl.h>
+#include <stdlib.h>
+
+SpillFrontier::SpillFrontier(FrontierOrder order, size_t memoryBudget, string spillDir)
+    : order_(order), memoryBudget_(memoryBudget), spillDir_(std::move(spillDir))
+{
+}
+
+SpillFrontier::~SpillFrontier()
+{
+  if (spillFd_ >= 0)
+    close(spillFd_);
+}
+
+void SpillFrontier::push(ExplorationState&& state)
+{
+  if (segments_.empty() || segments_.back().spilled || segments_.back().states.size() >= kSegmentStates)
+    segments_.emplace_back();
+
+  auto& segment = segments_.back();
+  auto bytes    = state.memory_size();
+  segment.bytes += bytes;
+  memoryBytes_ += bytes;
+  segment.states.push_back(std::move(state));
+
+  ++size_;
+  peakSize_        = max(peakSize_, size_);
+  peakMemoryBytes_ = max(peakMemoryBytes_, memoryBytes_);
+  enforceBudget();
+}
+
+bool SpillFrontier::pop(ExplorationState& state)
+{
+  while (!segments_.empty()) {
+    auto& segment = (order_ == FrontierOrder::LIFO) ? segments_.back() : segments_.front();
+    if (segment.spilled)
+      load(segment);
+    if (segment.head == segment.states.size()) {
+      if (order_ == FrontierOrder::LIFO)
+        segments_.pop_back();
+      else
+        segments_.pop_front();
+      continue;
+    }
+
+    auto& top = (order_ == FrontierOrder::LIFO) ? segment.states.back() : segment.states[segment.head];
+    auto bytes = top.memory_size();
+    state      = std::move(top);
+    if (order_ == FrontierOrder::LIFO)
+      segment.states.pop_back();
+    else
+      segment.head++;
+    segment.bytes -= bytes;
+    memoryBytes_ -= bytes;
+    --size_;
+
+    if (size_ == 0)
+      clear();
+    return true;
+  }
+  return false;
+}
+
+void SpillFrontier::clear()
+{
+  segments_.clear();
+  size_        = 0;
+  memoryBytes_ = 0;
+  if (spillFd_ >= 0 && spillEnd_ > 0) {
+    if (ftruncate(spillFd_, 0) != 0)
+      DLOG(ERROR, "could not truncate the frontier spill file: %s\n", strerror(errno));
+    spillEnd_ = 0;
+  }
+  holes_.clear();
+}
+
+// Room for `length` bytes in the spill file: the first hole big enough, or the end
+off_t SpillFrontier::allocate(size_t length)
+{
+  for (auto it = holes_.begin(); it != holes_.end(); ++it) {
+    if (it->second < length)
+      continue;
+    auto [offset, size] = *it;
+    holes_.erase(it);
+    if (size > length)
+      holes_.emplace(offset + length, size - length);
+    return offset;
+  }
+  auto offset = spillEnd_;
+  spillEnd_ += length;
+  return offset;
+}
+
+// Frees the extent of a segment read back, merged with the holes around it
+void SpillFrontier::release(off_t offset, size_t length)
+{
+  if (length == 0)
+    return;
+  auto next = holes_.lower_bound(offset);
+  if (next != holes_.end() && offset + (off_t)length == next->first) {
+    length += next->second;
+    next = holes_.erase(next);
+  }
+  if (next != holes_.begin()) {
+    auto previous = prev(next);
+    if (previous->first + (off_t)previous->second == offset) {
+      offset = previous->first;
+      length += previous->second;
+      holes_.erase(previous);
+    }
+  }
+  if (offset + (off_t)length < spillEnd_) {
+    holes_.emplace(offset, length);
+    return;
+  }
+  spillEnd_ = offset;
+  if (ftruncate(spillFd_, spillEnd_) != 0)
+    DLOG(ERROR, "could not truncate the frontier spill file: %s\n", strerror(errno));
+}
+
+// Spills the segments that will be popped last: the oldest ones for a stack,
+// the youngest ones (but the one being pushed to) for a queue.
+void SpillFrontier::enforceBudget()
+{
+  while (memoryBytes_ > memoryBudget_ && segments_.size() > 1) {
+    Segment* victim = nullptr;
+    if (order_ == FrontierOrder::LIFO) {
+      for (size_t i = 0; i + 1 < segments_.size() && victim == nullptr; i++)
+        if (!segments_[i].spilled)
+          victim = &segments_[i];
+    } else {
+      for (size_t i = segments_.size() - 2; i >= 1 && victim == nullptr; i--)
+        if (!segments_[i].spilled)
+          victim = &segments_[i];
+    }
+    if (victim == nullptr)
+      break;
+    spill(*victim);
+  }
+}
+
+void SpillFrontier::spill(Segment& segment)
+{
+  if (spillFd_ < 0) {
+    string path = spillDir_ + "/simgld-frontier-XXXXXX";
+    spillFd_    = mkstemp(&path[0]);
+    if (spillFd_ < 0) {
+      DLOG(ERROR, "could not create the frontier spill file in %s: %s\n", spillDir_.c_str(), strerror(errno));
+      exit(-1);
+    }
+    unlink(path.c_str());
+  }
+
+  // Layout of a spilled state: id (8 bytes), parent (4), depth (4), path length (4), path (4 per choice). A
+  // pending state is not reached yet: it has no node.
+  vector<char> buffer;
+  for (auto i = segment.head; i < segment.states.size(); i++) {
+    const auto& state = segment.states[i];
+    uint32_t length   = state.path.size();
+    auto pos          = buffer.size();
+    buffer.resize(pos + sizeof(state.id) + sizeof(state.parent) + sizeof(state.depth) + sizeof(length) +
+                  length * sizeof(int));
+    auto p = buffer.data() + pos;
+    memcpy(p, &state.id, sizeof(state.id));
+    p += sizeof(state.id);
+    memcpy(p, &state.parent, sizeof(state.parent));
+    p += sizeof(state.parent);
+    memcpy(p, &state.depth, sizeof(state.depth));
+    p += sizeof(state.depth);
+    memcpy(p, &length, sizeof(length));
+    p += sizeof(length);
+    memcpy(p, state.path.data(), length * sizeof(int));
+  }
+
+  auto offset    = allocate(buffer.size());
+  size_t written = 0;
+  while (written < buffer.size()) {
+    auto rc = pwrite(spillFd_, buffer.data() + written, buffer.size() - written, offset + written);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0) {
+      DLOG(ERROR, "could not write to the frontier spill file: %s\n", strerror(errno));
+      exit(-1);
+    }
+    written += rc;
+  }
+
+  memoryBytes_ -= segment.bytes;
+  segment.count   = segment.states.size() - segment.head;
+  segment.offset  = offset;
+  segment.length  = buffer.size();
+  segment.bytes   = 0;
+  segment.head    = 0;
+  segment.spilled = true;
+  vector<ExplorationState>().swap(segment.states);
+
+  spilledBytes_ += buffer.size();
+  spillCount_++;
+}
+
+void SpillFrontier::load(Segment& segment)
+{
+  vector<char> buffer(segment.length);
+  size_t done = 0;
+  while (done < buffer.size()) {
+    auto rc = pread(spillFd_, buffer.data() + done, buffer.size() - done, segment.offset + done);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0) {
+      DLOG(ERROR, "could not read back the frontier spill file: %s\n", strerror(errno));
+      exit(-1);
+    }
+    done += rc;
+  }
+
+  segment.states.resize(segment.count);
+  auto p = buffer.data();
+  for (auto& state : segment.states) {
+    uint32_t length;
+    memcpy(&state.id, p, sizeof(state.id));
+    p += sizeof(state.id);
+    memcpy(&state.parent, p, sizeof(state.parent));
+    p += sizeof(state.parent);
+    memcpy(&state.depth, p, sizeof(state.depth));
+    p += sizeof(state.depth);
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    state.path.resize(length);
+    memcpy(state.path.data(), p, length * sizeof(int));
+    p += length * sizeof(int);
+    segment.bytes += state.memory_size();
+  }
+
+  release(segment.offset, segment.length);
+  memoryBytes_ += segment.bytes;
+  peakMemoryBytes_ = max(peakMemoryBytes_, memoryBytes_);
+  segment.spilled  = false;
+}
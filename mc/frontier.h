@@ -0,0 +1,90 @@
+#ifndef FRONTIER_H
+#define FRONTIER_H
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+using namespace std;
+
+// A node of the exploration: the sequence of choices leading to it from the
+// initial state is enough to restore it (by resetting the app and replaying
+// the path), so that is all the frontier keeps around.
+struct ExplorationState {
+  uint64_t id     = 0;
+  uint32_t parent = 0; // the node of mc's state graph the last choice of the path is taken from
+  uint32_t node   = 0; // its own, once reached
+  uint32_t depth  = 0;
+  vector<int> path;
+
+  inline size_t memory_size() const { return sizeof(ExplorationState) + path.capacity() * sizeof(int); }
+};
+
+enum class FrontierOrder { LIFO, FIFO };
+
+// Container of pending states bounded in memory: once the in-memory states
+// exceed the budget, the segments that will be popped last are written to
+// an unlinked temporary file and read back when the pop end reaches them.
+// The room of a segment read back is reused by the next ones spilled, and
+// given back to the file system when it lies at the end of the file.
+class SpillFrontier {
+private:
+  struct Segment {
+    vector<ExplorationState> states;
+    size_t head   = 0; // first state not yet popped (FIFO order)
+    bool spilled  = false;
+    off_t offset  = 0; // position in the spill file, when spilled
+    size_t count  = 0; // number of states, when spilled
+    size_t length = 0; // serialized length, when spilled
+    size_t bytes  = 0; // memory used, when not spilled
+  };
+
+  static constexpr size_t kSegmentStates = 1024;
+
+  FrontierOrder order_;
+  size_t memoryBudget_;
+  string spillDir_;
+  deque<Segment> segments_;
+
+  int spillFd_     = -1;
+  off_t spillEnd_  = 0;
+  map<off_t, size_t> holes_; // free extents of the spill file below spillEnd_, by offset
+  size_t size_     = 0;
+  size_t peakSize_ = 0;
+  size_t memoryBytes_     = 0;
+  size_t peakMemoryBytes_ = 0;
+  size_t spilledBytes_    = 0;
+  size_t spillCount_      = 0;
+
+  off_t allocate(size_t length);
+  void release(off_t offset, size_t length);
+  void spill(Segment& segment);
+  void load(Segment& segment);
+  void enforceBudget();
+
+public:
+  explicit SpillFrontier(FrontierOrder order, size_t memoryBudget, string spillDir = "/tmp");
+  ~SpillFrontier();
+
+  // No copy
+  SpillFrontier(SpillFrontier const&) = delete;
+  SpillFrontier& operator=(SpillFrontier const&) = delete;
+
+  void push(ExplorationState&& state);
+  bool pop(ExplorationState& state);
+  void clear();
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  inline size_t peak_size() const { return peakSize_; }
+  inline size_t memory_bytes() const { return memoryBytes_; }
+  inline size_t peak_memory_bytes() const { return peakMemoryBytes_; }
+  inline size_t spilled_bytes() const { return spilledBytes_; }
+  inline size_t spill_count() const { return spillCount_; }
+  inline size_t spill_file_bytes() const { return spillEnd_; }
+};
+
+#endif
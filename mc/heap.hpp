@@ -2,32 +2,128 @@
 #define HEAP_HPP
 
 #include "global.hpp"
+#include "heap_stats.hpp"
 
+// Program break of the upper half. The heap room of its window is reserved up
+// front as PROT_NONE; sbrk and brk only move the break and commit (mprotect) the
+// pages under it, a batch at a time, so that most calls make no syscall.
+// Pages are handed back only once the break fell well below the committed end.
 class Heap {
+public:
+  using Stats = HeapStats;
+
 private:
-  uint64_t heapSize_ = 0;
+  static constexpr uint64_t kCommitBatch   = 64 * PAGE_SIZE;
+  static constexpr uint64_t kInitialCommit = 100 * PAGE_SIZE; // guard page included
   void* heapStartAddr_ = nullptr;
+  uintptr_t base_      = 0; // first byte after the guard page
+  uintptr_t break_     = 0;
+  uintptr_t committed_ = 0; // end of the usable pages
+  uintptr_t end_       = 0; // end of the reservation
+  Stats stats_;
+
+  // Makes [committed_, end) usable; batches grow with the heap
+  bool commit(uintptr_t end)
+  {
+    end = min(max(end, committed_ + max(kCommitBatch, (uint64_t)ROUND_UP((committed_ - base_) / 4))), end_);
+    if (mprotect((void*)committed_, end - committed_, PROT_READ | PROT_WRITE) != 0)
+      return false;
+    stats_.commits++;
+    stats_.committed += end - committed_;
+    stats_.peakCommitted = max(stats_.peakCommitted, stats_.committed);
+    committed_           = end;
+    return true;
+  }
+
+  // Drops the pages above the break, keeping a batch of slack
+  void decommit()
+  {
+    auto keep = ROUND_UP(break_ + kCommitBatch);
+    if (committed_ < keep + kCommitBatch)
+      return;
+    // Mapping over the pages frees them and keeps the reservation in one call
+    if (mmap((void*)keep, committed_ - keep, PROT_NONE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+             0) == MAP_FAILED)
+      return;
+    stats_.decommits++;
+    stats_.committed -= committed_ - keep;
+    committed_ = keep;
+  }
+
+  // Returns the old break, or (void*)-1 with errno set as sbrk does
+  void* move_break(intptr_t increment)
+  {
+    auto old = break_;
+    if ((increment > 0 && (uintptr_t)increment > end_ - break_) ||
+        (increment < 0 && (uintptr_t)-increment > break_ - base_)) {
+      errno = ENOMEM;
+      return (void*)-1;
+    }
+    if (break_ + increment > committed_ && !commit(ROUND_UP(break_ + increment))) {
+      errno = ENOMEM;
+      return (void*)-1;
+    }
+    break_ += increment;
+    if (increment < 0)
+      decommit();
+    return (void*)old;
+  }
 
 public:
   explicit Heap() = default;
-  void* createNewHeap(void* heapStartAddr)
+  // Reserves `reserve` bytes at `heapStartAddr` for the heap
+  void* createNewHeap(void* heapStartAddr, uint64_t reserve, bool hugePages = false)
   {
-    heapSize_ = 100 * PAGE_SIZE;
-
     // We go through the mmap wrapper function to ensure that this gets added
     // to the list of upper half regions to be checkpointed.
-    void* addr = mmapWrapper(heapStartAddr /*0*/, heapSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* addr =
+        mmapWrapper(heapStartAddr /*0*/, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
     if (addr == MAP_FAILED) {
       DLOG(ERROR, "Failed to mmap region. Error: %s\n", strerror(errno));
       return NULL;
     }
-    // Add a guard page before the start of heap; this protects
-    // the heap from getting merged with a "previous" region.
-    mprotect(addr, PAGE_SIZE, PROT_NONE);
+    if (hugePages && madvise(addr, reserve, MADV_HUGEPAGE) != 0)
+      DLOG(INFO, "Transparent huge pages are not available for the heap: %s\n", strerror(errno));
+    // The first page stays PROT_NONE: a guard page before the start of heap
+    // protects the heap from getting merged with a "previous" region.
     heapStartAddr_ = addr;
+    base_ = break_ = committed_ = (uintptr_t)addr + PAGE_SIZE;
+    end_                        = (uintptr_t)addr + reserve;
+    if (!commit(base_ + kInitialCommit - PAGE_SIZE)) {
+      DLOG(ERROR, "Failed to commit the heap. Error: %s\n", strerror(errno));
+      return NULL;
+    }
     return addr;
   }
+
+  void* sbrk(intptr_t increment)
+  {
+    stats_.calls++;
+    return move_break(increment);
+  }
+
+  // brk(0) asks where the break is: nothing moves
+  int brk(void* addr)
+  {
+    stats_.calls++;
+    if (addr == nullptr)
+      return 0;
+    return move_break((intptr_t)addr - (intptr_t)break_) == (void*)-1 ? -1 : 0;
+  }
+
+  // True if moving the break by `increment` needs no syscall
+  inline bool moves_within(intptr_t increment) const
+  {
+    if (increment >= 0)
+      return (uintptr_t)increment <= committed_ - break_;
+    return (uintptr_t)-increment <= break_ - base_ &&
+           committed_ < ROUND_UP(break_ + increment + kCommitBatch) + kCommitBatch;
+  }
+
+  inline void* current_break() const { return (void*)break_; }
+  inline uintptr_t committed_end() const { return committed_; }
+  inline const Stats& stats() const { return stats_; }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <assert.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -12,13 +14,19 @@
 
 #include "mc.h"
 #include "global.hpp"
+#include "memory_account.hpp"
 #include "trampoline_wrappers.hpp"
+#include "watched_syscalls.hpp"
+
+static_assert(MESSAGE_TYPES <= AppMetrics::kMessageTypes, "the apps count their messages by type");
+
+static const char* transitionNames[] = {"launch", "reset", "step"};
 
 MC::MC()
 {
   appLoader_     = make_unique<AppLoader>();
   cmdLineParams_ = make_unique<cmdLineParams>();
-  syncProc_      = make_unique<SyncProc>();
+  register_metrics();
 }
 
 void MC::run(char** argv)
@@ -28,36 +36,125 @@ void MC::run(char** argv)
   //   return;
   // }
 
-  write_mmapped_ranges("mc-before_runRtld()-run()", getpid());
+  StartupContext::get().write_maps("mc-before_runRtld()-run()");
   setMemoryLayout();
 
   auto param_index = cmdLineParams_->process_argv(argv);
   if (param_index == -1) {
     DLOG(ERROR, "Command line parameters are invalid\n");
-    DLOG(ERROR, "Usage: ./simg_ld /PATH/TO/APP1 [APP1_PARAMS] -- /PATH/TO/APP2 [APP2_PARAMS]\n");
+    DLOG(ERROR, "Usage: ./simg_ld [--strategy=dfs|bfs|bounded|random|heuristic] [--max-depth=N] [--depth-bound=N] "
+                "[--depth-step=N] [--restarts=N] [--seed=N] [--heuristic=deep|shallow|random] [--frontier-mem=MB] "
+                "[--spill-dir=DIR] [--graph-output=FILE] [--check-liveness] [--zygote] [--replicas=N] "
+                "[--heap-hugepages] [--heap-budget=MB] [--mmap-budget=MB] [--in-process] [--syscall-dispatch] "
+                "[--shards=N] [--credits=N] [--record=FILE] [--replay=FILE] [--metrics=PATH] [--perf] "
+                "/PATH/TO/APP1 [APP1_PARAMS] -- /PATH/TO/APP2 [APP2_PARAMS]\n");
     DLOG(ERROR, "exiting ...\n");
     exit(-1);
   }
+  strategy_ = SearchStrategy::create(*cmdLineParams_);
+  if (cmdLineParams_->hasOption("graph-output") || cmdLineParams_->hasOption("check-liveness")) {
+    graph_ = make_unique<StateGraph>();
+    edges_ = &graph_->worker_buffer();
+  }
+  if (cmdLineParams_->hasOption("record")) {
+    auto path     = cmdLineParams_->getOption("record", string());
+    messageTrace_ = MessageTrace::create(path);
+    if (!messageTrace_) {
+      DLOG(ERROR, "mc %d: could not create %s: %s\n", getpid(), path.c_str(), strerror(errno));
+      exit(-1);
+    }
+  }
+  // The app runs the path it last ran in the recorded exploration, and no more
+  if (cmdLineParams_->hasOption("replay")) {
+    auto path = cmdLineParams_->getOption("replay", string());
+    vector<MessageTrace::Record> records;
+    if (!MessageTrace::load(path, records)) {
+      DLOG(ERROR, "mc %d: %s is no message trace\n", getpid(), path.c_str());
+      exit(-1);
+    }
+    current_.path = MessageTrace::last_path(records);
+    if (current_.path.empty()) {
+      DLOG(ERROR, "mc %d: no path to replay in %s\n", getpid(), path.c_str());
+      exit(-1);
+    }
+    replaying_ = true;
+    DLOG(INFO, "mc %d: replaying a path of %zu steps out of %zu messages\n", getpid(), current_.path.size(),
+         records.size());
+  }
+  zygoteMode_ = cmdLineParams_->hasOption("zygote");
+  inProcess_  = cmdLineParams_->hasOption("in-process");
+  replicas_   = cmdLineParams_->getOption("replicas", 1L);
+  credits_    = min(max(cmdLineParams_->getOption("credits", 1L), 1L), (long)MAX_CREDITS);
+  // The dispatch is per thread: in our process, it would trap our own syscalls too
+  dispatch_ = cmdLineParams_->hasOption("syscall-dispatch") && !inProcess_;
+  // The apps in our own process run on our thread: their counters would be ours
+  perf_ = cmdLineParams_->hasOption("perf") && !inProcess_;
+  appLoader_->setHeapHugePages(cmdLineParams_->hasOption("heap-hugepages"));
+  // The apps in our own process are served by this thread only
+  syncProc_ = make_unique<SyncProc>(inProcess_ ? 1 : cmdLineParams_->getOption("shards", 1L));
+
+  // The apps' windows go around the one we run in
+  AddressPlanner planner(StartupContext::get());
+  AddressPlanner::Budget budget;
+  budget.heapSize = cmdLineParams_->getOption("heap-budget", (long)(budget.heapSize >> 20)) << 20;
+  budget.mmapRoom = cmdLineParams_->getOption("mmap-budget", (long)(budget.mmapRoom >> 20)) << 20;
+
+  // Parse ld.so once here: every forked app inherits the cached image
+  if (!ElfImage::open(LD_NAME)) {
+    DLOG(ERROR, "Could not load the runtime loader (%s). Exiting...\n", LD_NAME);
+    exit(-1);
+  }
 
-  auto upperHalfAddr = (unsigned long)appLoader_->getStackAddr() - MB5500;
-  unsigned long appAddr = atol((char*)upperHalfAddr);
-  cout << "mc.cpp->run(), appAddr: 0x" << std::hex << appAddr << endl;
+  // Launch timestamps, written by the apps' loaders and the apps themselves
+  launchTrace_ = LaunchTrace::create();
+  if (launchTrace_ == nullptr)
+    DLOG(INFO, "mc %d: no launch trace: %s\n", getpid(), strerror(errno));
+  // Counters the apps push, read when mc is scraped
+  appMetrics_ = AppMetrics::create();
+  if (appMetrics_ == nullptr)
+    DLOG(INFO, "mc %d: no metrics page for the apps: %s\n", getpid(), strerror(errno));
+
+  if (inProcess_) {
+    run_in_process(cmdLineParams_->getAppParams(0), planner, budget);
+    return;
+  }
 
   auto appCount = cmdLineParams_->getAppCount();
   // todo: delete the following line
   appCount = 1;
   for (auto i = 0; i < appCount; i++) {
+    // todo: 0 must be replaced with proper value
+    auto appParams = cmdLineParams_->getAppParams(0);
+    WindowLayout layout;
+    if (!planner.plan(budget, {appParams[0]}, layout)) {
+      DLOG(ERROR, "mc %d: no room for the window of %s. Exiting...\n", getpid(), appParams[0].c_str());
+      exit(-1);
+    }
+    layout.trace    = (uintptr_t)launchTrace_;
+    layout.metrics  = (uintptr_t)appMetrics_;
+    layout.dispatch = dispatch_;
+    layout.replay   = replaying_;
+    layout.graph    = graph_ != nullptr;
+    DLOG(INFO, "mc %d: app window %p-%p\n", getpid(), (void*)layout.start, (void*)layout.end);
+
     // Create an AF_LOCAL socketpair used for exchanging messages
     // between the model-checker process (ourselves) and the model-checked
     // process:
     int sockets[2];
     assert((socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != -1) && "Could not create socketpair");
 
-    pid_t pid = fork();
+    auto spawnTsc = __rdtsc();
+    pid_t pid     = fork();
     assert(pid >= 0 && "Could not fork child process");
 
     if (pid == 0) // child
     {
+      auto slot = launchTrace_ != nullptr ? launchTrace_->claim(getpid()) : nullptr;
+      if (slot != nullptr) {
+        slot->stamp(SPAWN_PHASE, spawnTsc);
+        slot->stamp(FORKED_PHASE);
+      }
+      appLoader_->setLaunchSlot(slot);
       ::close(sockets[1]);
 
 #ifdef __linux__
@@ -72,54 +169,79 @@ void MC::run(char** argv)
       assert((fdflags != -1 && fcntl(sockets[0], F_SETFD, fdflags & ~FD_CLOEXEC) != -1) &&
              "Could not remove CLOEXEC for socket");
 
-      // todo: 0 must be replaced with proper value
-      auto appParams = cmdLineParams_->getAppParams(0);
       // setenv("LD_PRELOAD", "/home/eazimi/projects/simgld/build/libwrapper.so", 1);
-      appLoader_->runRtld((void*)appAddr, appParams, sockets[0]);
+      appLoader_->runRtld(layout, appParams, sockets[0]);
       // while(true);
     } else // parent
     {
-      allApps.push_back(pid);
+      add_app(pid);
       ::close(sockets[0]);
-      allSockets.push_back(sockets[1]);
+      syncProc_->add_channel(sockets[1], pid);
+      windows_[sockets[1]] = layout;
+      if (zygoteMode_ && zygoteSocket_ == -1)
+        zygoteSocket_ = sockets[1];
     }
   }
 
   // due to run_child_process(), child never reaches here
-  syncProc_ = make_unique<SyncProc>();
-  syncProc_->start(
-      [](evutil_socket_t sig, short event, void* obj) {
-        auto mc = static_cast<MC*>(obj);
-        if (event == EV_READ) {
-          std::array<char, MESSAGE_LENGTH> buffer;
-          ssize_t size = mc->syncProc_->get_channel(sig).receive(buffer.data(), buffer.size(), false);
-          if (size == -1 && errno != EAGAIN) {
-            DLOG(ERROR, "%s\n", strerror(errno));
-            exit(-1);
-          }
-          mc->handle_message(sig, buffer.data());
-        } else if (event == EV_SIGNAL) {
-          if (sig == SIGCHLD) {
-            mc->handle_waitpid();
-          }
-        } else {
-          DLOG(ERROR, "Unexpected event\n");
-          exit(-1);
-        }
-      },
-      this, allSockets);
+  serve_metrics();
+  syncProc_->start(*this, {});
 }
 
-void MC::handle_message(int socket, void* buffer)
+bool MC::on_message(int socket)
+{
+  std::array<char, MESSAGE_LENGTH> buffer;
+  ssize_t size = syncProc_->get_channel(socket).receive(buffer.data(), buffer.size(), false);
+  if (size == -1 && errno != EAGAIN) {
+    DLOG(ERROR, "%s\n", strerror(errno));
+    exit(-1);
+  }
+  if (size <= 0)
+    return false; // drained, or the app closed its end
+  handle_message(socket, buffer.data());
+  return true;
+}
+
+void MC::on_process_exit(pid_t pid)
 {
-  vector<string> str_messages{"NONE", "LOADED", "READY", "CONTINUE", "FINISH", "DONE"};
+  lock_guard<mutex> lock(appsMutex_);
+  auto app = apps_.find(pid);
+  if (app != apps_.end())
+    handle_exit(app->second);
+}
 
-  auto message_type = ((s_message_t*)(buffer))->type;
-  auto str_message_type = str_messages[static_cast<int>(((s_message_t*)(buffer))->type)];
-  auto app_pid = ((s_message_t*)(buffer))->pid;
+// Runs on the shard of `socket`, beside the other shards: the exploration
+// and the launch figures each have their lock, the rest is read-only or atomic
+void MC::handle_message(int socket, void* buffer)
+{
+  auto message      = (s_message_t*)buffer;
+  auto message_type = message->type;
+  if ((unsigned)message_type >= MESSAGE_TYPES) {
+    DLOG(ERROR, "mc %d: dropped a message of unknown type %u, socket = %d\n", getpid(), (unsigned)message_type,
+         socket);
+    return;
+  }
+  // A step boundary: what the app did since the previous one
+  PerfCounters::Sample perf;
+  bool sampled = perf_ &&
+                 (message_type == MessageType::READY || message_type == MessageType::FINISH ||
+                  message_type == MessageType::STEPPED) &&
+                 sample_perf(message->pid, perf);
+  if (messageTrace_)
+    messageTrace_->record(MessageTrace::FROM_APP, socket, *message, sampled ? perf.data() : nullptr, perf.size());
+  meters_.messages[MessageTrace::FROM_APP][(int)message_type]->add();
+  // A syscall the app trapped and ran (--syscall-dispatch): nothing to answer
+  if (message_type == MessageType::SYSCALL) {
+    if ((uint64_t)message->syscall_nr < kSyscalls)
+      syscalls_[message->syscall_nr]++;
+    DLOG(NOISE, "mc %d: app %d ran syscall %ld: %ld\n", getpid(), message->pid, (long)message->syscall_nr,
+         (long)message->syscall_ret);
+    return;
+  }
+  auto app_pid = message->pid;
 
-  DLOG(INFO, "mc %d: app %d sent a %s message, socket = %d\n", getpid(), app_pid, 
-            str_message_type.c_str(), socket);
+  DLOG(INFO, "mc %d: app %d sent a %s message, socket = %d\n", getpid(), app_pid,
+       messageTypeNames[static_cast<int>(message_type)], socket);
 
   s_message_t base_message;
   base_message.pid = getpid();
@@ -135,85 +257,633 @@ void MC::handle_message(int socket, void* buffer)
     // base_message.memlayout = memlayout;
     base_message.memlayout_size = index;
     base_message.type           = MessageType::LAYOUT;
+    // The app keeps what lies in its window
+    auto window             = windows_.find(socket);
+    base_message.start_addr = window != windows_.end() ? window->second.start : 0;
+    base_message.end_addr   = window != windows_.end() ? window->second.end : 0;
+  } else if (message_type == MessageType::READY && socket == zygoteSocket_) {
+    // The zygote is loaded and parked: every app we explore is forked from it
+    report_launch(app_pid);
+    if (sampled)
+      attribute_perf(LAUNCH_TRANSITION, perf);
+    spawn_replicas();
+    return;
+  } else if (message_type == MessageType::READY && pending_spawn(socket) && !replica_ready(socket, app_pid)) {
+    base_message.type = MessageType::DONE; // only launched for the launch-rate figures
   } else if (message_type == MessageType::READY) {
-    base_message.type = MessageType::CONTINUE;    
-  } else if (message_type == MessageType::FINISH) {
+    report_launch(app_pid);
+    lock_guard<mutex> lock(explorationMutex_);
+    exploredPid_ = app_pid;
+    if (sampled)
+      attribute_perf(resetNs_ != 0 ? RESET_TRANSITION : LAUNCH_TRANSITION, perf);
+    // The app sits in its initial state, with a single enabled transition
+    replayed_ = 0;
+    if (resetNs_ != 0) {
+      meters_.resetLatency->record(MetricsRegistry::now_ns() - resetNs_);
+      resetNs_ = 0;
+    }
+    if (steps_ == 0)
+      exploreStart_ = chrono::steady_clock::now();
+    if (current_.path.empty()) {
+      auto initial = SearchStrategy::initial_state();
+      reach(initial, *message);
+      strategy_->expand(initial, 1);
+      if (!strategy_->next(current_)) {
+        finish_exploration();
+        base_message.type = MessageType::DONE;
+      }
+    }
+    if (base_message.type == MessageType::NONE)
+      grant_steps(base_message);
+  } else if (message_type == MessageType::FINISH || message_type == MessageType::STEPPED) {
+    lock_guard<mutex> lock(explorationMutex_);
+    // FINISH is a single step, after which the app has nothing left to run
+    uint32_t steps = message_type == MessageType::FINISH ? 1 : min(message->steps, MAX_CREDITS);
+    auto enabled   = message_type == MessageType::FINISH || steps == 0 ? 0 : message->choices[steps - 1];
+    steps_ += steps;
+    replies_++;
+    meters_.steps->add(steps);
+    if (sampled)
+      attribute_perf(STEP_TRANSITION, perf, steps);
+    if (steps != 0)
+      meters_.stepLatency->record((MetricsRegistry::now_ns() - grantedNs_) / steps);
+    if ((replayed_ += steps) < current_.path.size()) {
+      // Still replaying the path leading to current_
+      base_message.type = MessageType::CONTINUE;
+    } else if (replaying_) {
+      // The end of the recorded path: there is no search from there
+      finish_exploration();
+      base_message.type = MessageType::DONE;
+    } else {
+      // current_ is reached
+      reach(current_, *message);
+      strategy_->expand(current_, enabled);
+      base_message.type = next_step();
+    }
+    if (base_message.type == MessageType::CONTINUE)
+      grant_steps(base_message);
+  } else if (message_type == MessageType::DONE) {
+    // The app has no snapshot to reset to: none of the states left can be reached
+    lock_guard<mutex> lock(explorationMutex_);
+    DLOG(ERROR, "mc %d: app %d cannot be reset, the exploration stops with %zu states left\n", getpid(), app_pid,
+         strategy_->frontier_size() + 1);
+    resetNs_ = 0;
+    finish_exploration();
     base_message.type = MessageType::DONE;
   }
-  syncProc_->get_channel(socket).send(base_message);
+  send(socket, base_message);
 
   // if (!sync_proc->handle_message(buffer.data(), size))
   //   sync_proc->break_loop();
 }
 
-void MC::setMemoryLayout()
+// Puts `state`, which the app just told it reached, in the state graph:
+// under the fingerprint of the app's state when it tells one, so that a
+// state reached again is the same node, or as a state of its own
+void MC::reach(ExplorationState& state, const s_message_t& message)
 {
-  vector<string> memlayout;
-  string mapsPath = "/proc/self/maps";
-  filebuf fb;
-  string line;
-  if(fb.open(mapsPath, ios_base::in))
-  {
-    istream is(&fb);
-    while(getline(is, line))
-      memlayout.push_back(line);
-    fb.close();
-  }
-  initialMemLayout.clear();
-  initialMemLayout = memlayout;
-}
-
-void MC::handle_waitpid()
-{
-  int status;
-  pid_t pid;
-  while ((pid = waitpid(-1, &status, WNOHANG)) != 0) {
-    if (pid == -1) {
-      if (errno == ECHILD) {
-        // No more children:
-        assert((allApps.size() == 0) && "Inconsistent state");
-        break;
-      } else {
-        DLOG(ERROR, "Could not wait for pid\n");
-        exit(-1);
+  if (!graph_)
+    return;
+  state.node = graph_->intern(message.fingerprint != 0 ? message.fingerprint : state.id);
+  if (message.accepting != 0)
+    graph_->mark_accepting(state.node);
+  if (state.depth != 0)
+    edges_->add(state.parent, state.node);
+}
+
+// Picks the next state to explore and tells how to get the app there: straight
+// on when it is a successor of the current state, through a reset otherwise.
+MessageType MC::next_step()
+{
+  meters_.visitedStates->set(strategy_->explored_count());
+  meters_.frontierStates->set(strategy_->frontier_size());
+  ExplorationState next;
+  if (!strategy_->next(next)) {
+    finish_exploration();
+    return MessageType::DONE;
+  }
+
+  bool successor = next.path.size() == current_.path.size() + 1 &&
+                   equal(current_.path.begin(), current_.path.end(), next.path.begin());
+  current_ = std::move(next);
+  if (successor)
+    return MessageType::CONTINUE;
+  // The apps of our process take no snapshot (see App::handle_message): there is no going back
+  if (inProcess_) {
+    DLOG(ERROR, "mc %d: apps in mc's process cannot be reset, the exploration stops with %zu states left\n",
+         getpid(), strategy_->frontier_size() + 1);
+    finish_exploration();
+    return MessageType::DONE;
+  }
+
+  resets_++;
+  meters_.resets->add();
+  resetNs_ = MetricsRegistry::now_ns();
+  return MessageType::RESET;
+}
+
+void MC::send(int socket, const s_message_t& message, int fd)
+{
+  if (messageTrace_)
+    messageTrace_->record(MessageTrace::TO_APP, socket, message);
+  if ((unsigned)message.type < MESSAGE_TYPES)
+    meters_.messages[MessageTrace::TO_APP][(int)message.type]->add();
+  syncProc_->get_channel(socket).send(&message, sizeof(message), fd);
+}
+
+// Fills in the next step of the app on its way to current_, with its
+// transition. With credits, CONTINUE becomes STEPS: the steps left are
+// known, and the app gets as many as its credits at once, to answer in one
+// STEPPED message.
+void MC::grant_steps(s_message_t& message)
+{
+  auto steps    = min((size_t)credits_, current_.path.size() - replayed_);
+  message.type  = credits_ == 1 ? MessageType::CONTINUE : MessageType::STEPS;
+  message.steps = steps;
+  for (size_t i = 0; i < steps; i++)
+    message.choices[i] = current_.path[replayed_ + i];
+  grantedNs_ = MetricsRegistry::now_ns();
+}
+
+// Keeps the program break where it is, with a page mapped right above it:
+// every libc of the process caches its own idea of the break, and one would
+// shrink the heap of another. They all get their memory from mmap instead.
+static void pin_program_break()
+{
+  auto brk   = ROUND_UP(syscall(SYS_brk, 0));
+  auto guard = mmap((void*)brk, PAGE_SIZE, PROT_NONE, MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (guard == MAP_FAILED)
+    DLOG(ERROR, "mc %d: could not pin the program break at %p: %s\n", getpid(), (void*)brk, strerror(errno));
+}
+
+// Runs the app of `link` until it waits for a message
+static void resume(DirectLink& link)
+{
+  SwitchContext context(link.appFs);
+  link.resumes++;
+  direct_switch(&link.hostSp, link.appSp);
+}
+
+// --in-process: the apps are loaded beside us, each in its own window of
+// this process with its own stack, heap and TLS, and run as coroutines of
+// mc. A message is a function call away: no fork, socketpair or ptrace.
+// As in zygote mode, the first app is explored and the others are only
+// launched, for the launch-rate figures.
+void MC::run_in_process(const vector<string>& appParams, AddressPlanner& planner,
+                        const AddressPlanner::Budget& budget)
+{
+  pin_program_break();
+  firstSpawn_ = chrono::steady_clock::now();
+  map<int, DirectLink*> links;
+  for (long i = 0; i < replicas_; i++) {
+    WindowLayout layout;
+    auto link = DirectLink::create();
+    if (link == nullptr || !planner.plan(budget, {appParams[0]}, layout)) {
+      DLOG(ERROR, "mc %d: no room for app #%ld of %s. Exiting...\n", getpid(), i, appParams[0].c_str());
+      exit(-1);
+    }
+    layout.link        = (uintptr_t)link;
+    layout.metrics     = (uintptr_t)appMetrics_;
+    layout.replay      = replaying_;
+    layout.graph       = graph_ != nullptr;
+    auto id            = syncProc_->add_link(link);
+    pendingSpawns_[id] = chrono::steady_clock::now();
+    windows_[id]       = layout;
+    links[id]          = link;
+    if (!appLoader_->loadRtld(layout, appParams, *link)) {
+      DLOG(ERROR, "mc %d: could not load app #%ld of %s. Exiting...\n", getpid(), i, appParams[0].c_str());
+      exit(-1);
+    }
+    resume(*link);
+  }
+
+  serve_metrics();
+  // Answer what the apps left, until none has anything to run
+  std::array<char, MESSAGE_LENGTH> buffer;
+  bool busy = true;
+  while (busy) {
+    busy = false;
+    for (auto& [id, link] : links) {
+      if (syncProc_->get_channel(id).receive(buffer.data(), buffer.size(), false) != (size_t)-1)
+        handle_message(id, buffer.data());
+      if (link->toApp.size != 0) {
+        resume(*link);
+        busy = true;
       }
     }
+  }
+  uint64_t resumes = 0;
+  for (auto& [id, link] : links)
+    resumes += link->resumes;
+  DLOG(INFO, "mc %d: %zu apps in process, %lu switches to them\n", getpid(), links.size(), (unsigned long)resumes);
+}
+
+// On the shard of the zygote; the replicas go to the shards in turn
+void MC::spawn_replicas()
+{
+  {
+    lock_guard<mutex> lock(launchMutex_);
+    firstSpawn_ = chrono::steady_clock::now();
+  }
+  for (long i = 0; i < replicas_; i++) {
+    int sockets[2];
+    assert((socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != -1) && "Could not create socketpair");
+    {
+      lock_guard<mutex> lock(launchMutex_);
+      pendingSpawns_[sockets[1]] = chrono::steady_clock::now();
+    }
+    syncProc_->add_channel(sockets[1]);
+
+    s_message_t spawn_message;
+    spawn_message.pid  = getpid();
+    spawn_message.type = MessageType::SPAWN;
+    send(zygoteSocket_, spawn_message, sockets[0]);
+    ::close(sockets[0]);
+  }
+}
+
+// The replica of `socket` is launched but not READY yet
+bool MC::pending_spawn(int socket)
+{
+  lock_guard<mutex> lock(launchMutex_);
+  return pendingSpawns_.count(socket) != 0;
+}
+
+// Returns true if the replica is the one to explore
+bool MC::replica_ready(int socket, pid_t pid)
+{
+  // The replica is a child of the zygote: trace it ourselves (we are its ancestor,
+  // which is enough for Yama) to keep the crash detection of on_sigchld().
+  // With --syscall-dispatch that is all ptrace is left for, but each SIGSYS
+  // of the replica still becomes a stop on the way. The tracer is a thread:
+  // the one of shard 0, which waits for the stops.
+  if (!inProcess_)
+    syncProc_->run_on(0, [this, pid] {
+      if (ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_TRACEEXIT) != 0)
+        DLOG(ERROR, "mc %d: could not trace replica %d: %s\n", getpid(), pid, strerror(errno));
+      add_app(pid);
+    });
 
-    auto it = find(allApps.begin(), allApps.end(), pid);
-    if (it == allApps.end()) {
+  lock_guard<mutex> lock(launchMutex_);
+  auto now = chrono::steady_clock::now();
+  launchLatencies_.push_back(chrono::duration<double, milli>(now - pendingSpawns_[socket]).count());
+  pendingSpawns_.erase(socket);
+
+  if ((long)launchLatencies_.size() == replicas_) {
+    vector<double> sorted(launchLatencies_);
+    sort(sorted.begin(), sorted.end());
+    auto seconds = chrono::duration<double>(now - firstSpawn_).count();
+    DLOG(INFO, "mc %d: %zu %s launches in %.3f ms (%.0f launches/s), latency p50 %.3f ms, p99 %.3f ms\n", getpid(),
+         sorted.size(), inProcess_ ? "in-process" : "zygote", seconds * 1000, sorted.size() / seconds,
+         sorted[sorted.size() / 2],
+         sorted[min(sorted.size() - 1, sorted.size() * 99 / 100)]);
+  }
+
+  if (exploredSocket_ != -1)
+    return false;
+  exploredSocket_ = socket;
+  return true;
+}
+
+// Logs where the launch of `pid` spent its time, from fork() to READY, the
+// first time the app is READY
+void MC::report_launch(pid_t pid)
+{
+  auto slot = launchTrace_ != nullptr ? launchTrace_->find(pid) : nullptr;
+  if (slot == nullptr || !(slot->reached & (1u << READY_PHASE)))
+    return;
+  double intervals[LAUNCH_PHASES];
+  launchTrace_->intervals(*slot, launchTrace_->ticks_per_ns(), intervals);
+  stringstream ss;
+  double total = 0;
+  for (auto phase = FORKED_PHASE; phase < LAUNCH_PHASES; phase = (LaunchPhase)(phase + 1)) {
+    ss << (phase == FORKED_PHASE ? "" : ", ") << launchPhaseNames[phase] << " " << (uint64_t)(intervals[phase] / 1000);
+    total += intervals[phase];
+  }
+  launchTrace_->release(slot);
+  DLOG(INFO, "mc %d: launch of app %d in %.0f us: %s (us)\n", getpid(), pid, total / 1000, ss.str().c_str());
+}
+
+// Logs the memory calls of `pid` and the mappings it made, when it runs with
+// libwrapper.so preloaded, and drops its account
+void MC::report_memory(pid_t pid)
+{
+  auto account = pid != -1 ? MemoryAccount::open(pid) : nullptr;
+  if (account == nullptr)
+    return;
+  stringstream ss;
+  for (auto call = ACCOUNT_MMAP; call < ACCOUNTED_CALLS; call = (AccountedCall)(call + 1))
+    ss << (call == ACCOUNT_MMAP ? "" : ", ") << accountedCallNames[call] << " " << account->calls[call] << "/"
+       << account->failures[call] << "/" << (account->bytes[call] >> 10);
+  DLOG(INFO, "mc %d: memory calls of app %d: %s (calls/failures/KB)\n", getpid(), pid, ss.str().c_str());
+
+  auto mappings = make_unique<MappingRegistry>();
+  if (account->snapshot(*mappings)) {
+    uint64_t mapped = 0;
+    for (uint32_t i = 0; i < mappings->rangeCount; i++)
+      mapped += mappings->ranges[i].end - mappings->ranges[i].start;
+    DLOG(INFO, "mc %d: app %d mapped %u ranges (%lu KB) itself, %lu updates dropped\n", getpid(), pid,
+         mappings->rangeCount, (unsigned long)(mapped >> 10), (unsigned long)account->dropped);
+  }
+  MemoryAccount::close_account(account);
+  MemoryAccount::unlink(pid);
+}
+
+// Reads the perf counters of `pid`, if mc follows it with counters
+bool MC::sample_perf(pid_t pid, PerfCounters::Sample& delta)
+{
+  lock_guard<mutex> lock(appsMutex_);
+  auto app = apps_.find(pid);
+  return app != apps_.end() && app->second.perf && app->second.perf->sample(delta);
+}
+
+// Counts what the app did in the metrics, as the cost of `transition`, over `steps` steps
+void MC::attribute_perf(Transition transition, const PerfCounters::Sample& delta, uint32_t steps)
+{
+  for (int event = 0; event < PerfCounters::PERF_EVENTS; event++) {
+    meters_.perf[transition][event]->add(delta[event]);
+    if (transition == STEP_TRANSITION && steps != 0)
+      meters_.stepPerf[event]->record(delta[event] / steps);
+  }
+}
+
+// The metrics mc updates itself, and those read from elsewhere when it is scraped
+void MC::register_metrics()
+{
+  static const char* directions[] = {"from_app", "to_app"};
+  for (int direction = 0; direction < 2; direction++)
+    for (unsigned type = 0; type < MESSAGE_TYPES; type++) {
+      auto labels = string("direction=\"") + directions[direction] + "\",type=\"" + messageTypeNames[type] + "\"";
+      meters_.messages[direction][type] =
+          &metrics_.counter("simgld_messages_total", "Messages between mc and the apps.", labels);
+    }
+  meters_.steps  = &metrics_.counter("simgld_steps_total", "Steps the explored app ran.");
+  meters_.resets = &metrics_.counter("simgld_resets_total", "In-place resets of the explored app.");
+  meters_.waits  = &metrics_.counter("simgld_wait_events_total", "Stops and exits of the apps collected by waitid().");
+  meters_.stepLatency =
+      &metrics_.histogram("simgld_step_latency_seconds", "From granting steps to the reply, per step.");
+  meters_.resetLatency =
+      &metrics_.histogram("simgld_reset_latency_seconds", "From a RESET to the app READY again in its initial state.");
+  meters_.visitedStates  = &metrics_.gauge("simgld_visited_states", "States the search has reached.");
+  meters_.frontierStates = &metrics_.gauge("simgld_frontier_states", "States the search has yet to explore.");
+  meters_.apps           = &metrics_.gauge("simgld_apps", "App processes mc follows.");
+  for (int transition = 0; transition < TRANSITIONS; transition++)
+    for (int event = 0; event < PerfCounters::PERF_EVENTS; event++)
+      meters_.perf[transition][event] =
+          &metrics_.counter("simgld_perf_events_total", "Perf counters of the apps (--perf), by transition.",
+                            string("transition=\"") + transitionNames[transition] + "\",event=\"" +
+                                PerfCounters::eventNames[event] + "\"");
+  for (int event = 0; event < PerfCounters::PERF_EVENTS; event++)
+    meters_.stepPerf[event] =
+        &metrics_.histogram("simgld_step_perf_events", "Perf counters of the explored app (--perf), per step.",
+                            string("event=\"") + PerfCounters::eventNames[event] + "\"", 1);
+
+  metrics_.add_collector([this](ostream& out) { collect_app_metrics(out); });
+  metrics_.add_collector([this](ostream& out) {
+    MetricsRegistry::family(out, "simgld_trapped_syscalls_total", "Syscalls the apps trapped and reported.",
+                            "counter");
+    for (size_t number = 0; number < kSyscalls; number++) {
+      auto count = syscalls_[number].load();
+      if (count == 0)
+        continue;
+      auto name = watched_syscall(number);
+      out << "simgld_trapped_syscalls_total{syscall=\"" << (name != nullptr ? name : to_string(number)) << "\"} "
+          << count << "\n";
+    }
+  });
+  // syncProc_ is there once mc serves its metrics
+  metrics_.add_collector([this](ostream& out) {
+    auto shards = [&](const char* name, const char* help, atomic<uint64_t> SyncProc::Counters::*counter) {
+      MetricsRegistry::family(out, name, help, "counter");
+      for (int i = 0; i < syncProc_->shards(); i++)
+        out << name << "{shard=\"" << i << "\"} " << (syncProc_->counters(i).*counter).load() << "\n";
+    };
+    shards("simgld_shard_messages_total", "Messages a shard took from its channels.", &SyncProc::Counters::messages);
+    shards("simgld_shard_events_total", "Events a shard woke up for.", &SyncProc::Counters::events);
+    shards("simgld_shard_tasks_total", "Tasks submitted to a shard by the other threads.", &SyncProc::Counters::tasks);
+  });
+}
+
+// The counters of the apps, from their slots and those of the apps that are over
+void MC::collect_app_metrics(ostream& out) const
+{
+  if (appMetrics_ == nullptr)
+    return;
+  AppMetrics::Slot total;
+  memset(&total, 0, sizeof(total));
+  uint64_t live = 0;
+  auto add      = [&total](const AppMetrics::Slot& slot) {
+    for (uint32_t type = 0; type < AppMetrics::kMessageTypes; type++) {
+      total.received[type] += AppMetrics::Slot::get(slot.received[type]);
+      total.sent[type] += AppMetrics::Slot::get(slot.sent[type]);
+    }
+    total.steps += AppMetrics::Slot::get(slot.steps);
+    total.snapshotBytes += AppMetrics::Slot::get(slot.snapshotBytes);
+    total.restores += AppMetrics::Slot::get(slot.restores);
+    total.restoreNs += AppMetrics::Slot::get(slot.restoreNs);
+  };
+  add(appMetrics_->retired);
+  for (auto& slot : appMetrics_->slots)
+    if (__atomic_load_n(&slot.pid, __ATOMIC_ACQUIRE) != 0) {
+      add(slot);
+      live++;
+    }
+
+  MetricsRegistry::family(out, "simgld_app_messages_total",
+                          "Messages between mc and the apps, as the apps counted them.", "counter");
+  for (unsigned type = 0; type < MESSAGE_TYPES; type++)
+    out << "simgld_app_messages_total{direction=\"from_app\",type=\"" << messageTypeNames[type] << "\"} "
+        << total.sent[type] << "\n"
+        << "simgld_app_messages_total{direction=\"to_app\",type=\"" << messageTypeNames[type] << "\"} "
+        << total.received[type] << "\n";
+  MetricsRegistry::family(out, "simgld_app_steps_total", "Steps the apps ran.", "counter");
+  out << "simgld_app_steps_total " << total.steps << "\n";
+  MetricsRegistry::family(out, "simgld_app_snapshot_bytes", "Memory the running apps keep for their resets.", "gauge");
+  out << "simgld_app_snapshot_bytes " << total.snapshotBytes << "\n";
+  MetricsRegistry::family(out, "simgld_app_restores_total", "Snapshots the apps restored.", "counter");
+  out << "simgld_app_restores_total " << total.restores << "\n";
+  MetricsRegistry::family(out, "simgld_app_restore_seconds_total", "Time the apps spent restoring their snapshot.",
+                          "counter");
+  out << "simgld_app_restore_seconds_total " << total.restoreNs / 1e9 << "\n";
+  MetricsRegistry::family(out, "simgld_app_slots", "Apps with a slot in the metrics page.", "gauge");
+  out << "simgld_app_slots " << live << "\n";
+  MetricsRegistry::family(out, "simgld_app_slot_overflows_total", "Apps that found no free slot.", "counter");
+  out << "simgld_app_slot_overflows_total " << __atomic_load_n(&appMetrics_->overflows, __ATOMIC_RELAXED) << "\n";
+}
+
+// --metrics=PATH: once the apps are forked, a thread holding a lock of the allocator would leave it taken in them
+void MC::serve_metrics()
+{
+  if (!cmdLineParams_->hasOption("metrics"))
+    return;
+  auto path      = cmdLineParams_->getOption("metrics", string());
+  metricsServer_ = make_unique<MetricsServer>(metrics_);
+  if (!metricsServer_->start(path)) {
+    DLOG(ERROR, "mc %d: could not serve the metrics on %s: %s\n", getpid(), path.c_str(), strerror(errno));
+    exit(-1);
+  }
+  DLOG(INFO, "mc %d: metrics on %s\n", getpid(), path.c_str());
+}
+
+void MC::finish_exploration()
+{
+  if (!replaying_)
+    strategy_->report();
+  DLOG(INFO, "mc %d: %lu in-place resets of the app\n", getpid(), resets_);
+  auto seconds = chrono::duration<double>(chrono::steady_clock::now() - exploreStart_).count();
+  DLOG(INFO, "mc %d: %lu steps in %lu replies over %.3f ms (%.0f steps/s), %ld credits\n", getpid(), steps_,
+       replies_, seconds * 1000, steps_ / seconds, credits_);
+  report_memory(exploredPid_);
+  stringstream ss;
+  for (size_t number = 0; number < kSyscalls; number++) {
+    auto count = syscalls_[number].load();
+    if (count == 0)
+      continue;
+    auto name = watched_syscall(number);
+    ss << (ss.tellp() == 0 ? "" : ", ") << (name != nullptr ? name : to_string(number)) << " " << count;
+  }
+  if (ss.tellp() != 0)
+    DLOG(INFO, "mc %d: syscalls the apps trapped: %s\n", getpid(), ss.str().c_str());
+  for (int i = 0; i < syncProc_->shards(); i++) {
+    auto& counters = syncProc_->counters(i);
+    DLOG(INFO, "mc %d: shard %d: %lu messages, %lu events, %lu tasks\n", getpid(), i,
+         (unsigned long)counters.messages, (unsigned long)counters.events, (unsigned long)counters.tasks);
+  }
+  for (int transition = 0; perf_ && transition < TRANSITIONS; transition++) {
+    stringstream perf;
+    for (int event = 0; event < PerfCounters::PERF_EVENTS; event++)
+      perf << (event == 0 ? "" : ", ") << PerfCounters::eventNames[event] << " "
+           << meters_.perf[transition][event]->value();
+    DLOG(INFO, "mc %d: perf counters of the apps, %s: %s\n", getpid(), transitionNames[transition], perf.str().c_str());
+  }
+  if (!graph_)
+    return;
+
+  graph_->compact();
+  DLOG(INFO, "mc %d: state graph has %u states and %lu edges (%zu bytes)\n", getpid(), graph_->node_count(),
+       (unsigned long)graph_->edge_count(), graph_->memory_bytes());
+  if (cmdLineParams_->hasOption("check-liveness")) {
+    vector<StateGraph::StateId> cycle;
+    if (graph_->find_accepting_cycle(&cycle))
+      DLOG(ERROR, "mc %d: accepting cycle of length %zu through state %u\n", getpid(), cycle.size(), cycle[0]);
+    else
+      DLOG(INFO, "mc %d: no accepting cycle\n", getpid());
+  }
+  if (cmdLineParams_->hasOption("graph-output"))
+    graph_->save(cmdLineParams_->getOption("graph-output", string()));
+}
+
+// The layout the app releases once loaded: the one mc started with
+void MC::setMemoryLayout()
+{
+  initialMemLayout = StartupContext::get().maps_lines();
+}
+
+// Follows the process of an app: its exit through a pidfd in the event
+// loop, its ptrace stops through SIGCHLD
+void MC::add_app(pid_t pid)
+{
+  lock_guard<mutex> lock(appsMutex_);
+  auto& app = apps_[pid];
+  app       = AppProcess{pid, (int)syscall(SYS_pidfd_open, pid, 0), nullptr};
+  meters_.apps->set(apps_.size());
+  if (perf_) {
+    app.perf = PerfCounters::open(pid);
+    if (!app.perf)
+      DLOG(ERROR, "mc %d: no perf counters for app %d: %s\n", getpid(), pid, strerror(errno));
+  }
+  if (app.pidfd == -1) {
+    DLOG(INFO, "mc %d: no pidfd for app %d (%s), its exit is looked for on SIGCHLD\n", getpid(), pid,
+         strerror(errno));
+    unwatchedApps_++;
+    return;
+  }
+  syncProc_->watch_process(app.pidfd, pid);
+}
+
+// With appsMutex_ held, which is released before exit(): the shards may
+// still wait for it, and exit() does not unwind to the caller's lock_guard
+[[noreturn]] void MC::crash(pid_t pid, int signal)
+{
+  DLOG(ERROR, "CRASH IN THE PROGRAM, app %d killed by signal %d\n", pid, signal);
+  for (auto& [process, app] : apps_) {
+    kill(process, SIGKILL);
+    MemoryAccount::unlink(process);
+  }
+  apps_.clear();
+  appsMutex_.unlock();
+  exit(-1);
+}
+
+// Collects the app if it is over, with appsMutex_ held; a crash ends the exploration
+void MC::handle_exit(AppProcess& app)
+{
+  siginfo_t info{};
+  auto result = app.pidfd != -1 ? waitid(P_PIDFD, app.pidfd, &info, WEXITED | WNOHANG)
+                                : waitid(P_PID, app.pid, &info, WEXITED | WNOHANG);
+  if (result == -1 && errno != ECHILD) {
+    DLOG(ERROR, "Could not wait for app %d: %s\n", app.pid, strerror(errno));
+    exit(-1);
+  }
+  // ECHILD: a replica we stopped tracing, reaped by the kernel
+  if (result == 0 && info.si_pid == 0)
+    return;
+  meters_.waits->add();
+  if (result == 0 && (info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED))
+    crash(app.pid, info.si_status);
+
+  DLOG(INFO, "Child process is over\n");
+  if (app.pidfd != -1) {
+    syncProc_->unwatch_process(app.pidfd, app.pid);
+    ::close(app.pidfd);
+  } else {
+    unwatchedApps_--;
+  }
+  auto slot = appMetrics_ != nullptr ? appMetrics_->find(app.pid) : nullptr;
+  if (slot != nullptr)
+    appMetrics_->retire(slot);
+  // libwrapper.so drops its memory account only when the app returns or calls exit()
+  MemoryAccount::unlink(app.pid);
+  apps_.erase(app.pid);
+  meters_.apps->set(apps_.size());
+}
+
+// The traced apps stopped: a crash on its way out (PTRACE_EVENT_EXIT), or a
+// signal we do not care about, which we reinject
+void MC::on_sigchld()
+{
+  lock_guard<mutex> lock(appsMutex_);
+  for (;;) {
+    siginfo_t info{};
+    if (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) == -1 || info.si_pid == 0)
+      break;
+    auto pid    = info.si_pid;
+    auto signal = info.si_status;
+    meters_.waits->add();
+    if (apps_.find(pid) == apps_.end()) {
       DLOG(ERROR, "Child process not found\n");
-      return;
-    } else {
-      // From PTRACE_O_TRACEEXIT:
+      continue;
+    }
 #ifdef __linux__
-      if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXIT << 8))) {
-        assert((ptrace(PTRACE_GETEVENTMSG, pid, 0, &status) != -1) && "Could not get exit status");
-        if (WIFSIGNALED(status)) {
-          DLOG(ERROR, "CRASH IN THE PROGRAM, %i\n", status);
-          for (auto p : allApps)
-            kill(p, SIGKILL);
-          exit(-1);
-        }
-      }
-#endif
+    // From PTRACE_O_TRACEEXIT: the event comes in the status, above the signal
+    if (info.si_code == CLD_TRAPPED && signal == (SIGTRAP | (PTRACE_EVENT_EXIT << 8))) {
+      unsigned long status;
+      assert((ptrace(PTRACE_GETEVENTMSG, pid, 0, &status) != -1) && "Could not get exit status");
+      if (WIFSIGNALED(status))
+        crash(pid, WTERMSIG(status));
+      signal = 0;
+    }
 
-      // We don't care about signals, just reinject them:
-      if (WIFSTOPPED(status)) {
-        // DLOG(INFO, "Stopped with signal %i\n", (int)WSTOPSIG(status));
-        errno = 0;
-#ifdef __linux__
-        ptrace(PTRACE_CONT, pid, 0, WSTOPSIG(status));
+    errno = 0;
+    ptrace(PTRACE_CONT, pid, 0, signal);
+    assert((errno == 0 || info.si_code != CLD_TRAPPED) && "Could not PTRACE_CONT");
 #endif
-        assert(errno == 0 && "Could not PTRACE_CONT");
-      } else if (WIFSIGNALED(status)) {
-        DLOG(ERROR, "CRASH IN THE PROGRAM, %i\n", status);
-        for (auto process : allApps)
-          kill(process, SIGKILL);
-        exit(-1);
-      } else if (WIFEXITED(status)) {
-        DLOG(INFO, "Child process is over\n");
-        allApps.erase(it);
-      }
-    }
   }
-}
\ No newline at end of file
+
+  // Without a pidfd, SIGCHLD is all we hear of an exit
+  for (auto it = apps_.begin(); unwatchedApps_ != 0 && it != apps_.end();) {
+    auto& app = (it++)->second;
+    if (app.pidfd == -1)
+      handle_exit(app);
+  }
+}
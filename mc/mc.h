@@ -1,23 +1,114 @@
 #ifndef MC_H
 #define MC_H
 
+#include "address_planner.h"
 #include "app_loader.h"
+#include "app_metrics.hpp"
 #include "cmdline_params.h"
+#include "message_trace.h"
+#include "metrics.h"
+#include "perf_counters.h"
+#include "search_strategy.h"
+#include "state_graph.h"
 #include "sync_proc.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 
 using namespace std;
 
-class MC {
+class MC : private SyncProc::Handler {
 private:
   vector<string> initialMemLayout;
-  std::list<int> allSockets;
-  std::list<pid_t> allApps;
+  // A process of an app mc follows: forked by us, or a replica we trace
+  struct AppProcess {
+    pid_t pid;
+    int pidfd; // -1 without pidfds (Linux < 5.4): its exit is looked for on SIGCHLD
+    unique_ptr<PerfCounters> perf; // --perf
+  };
+  unordered_map<pid_t, AppProcess> apps_;
+  size_t unwatchedApps_ = 0; // those without a pidfd
+  mutex appsMutex_;          // for apps_, from the shards of their exits and shard 0 (SIGCHLD)
+  bool perf_ = false;        // the apps' perf counters are read at each step boundary
+  // What the perf counters of an app are attributed to, between two step boundaries
+  enum Transition { LAUNCH_TRANSITION, RESET_TRANSITION, STEP_TRANSITION, TRANSITIONS };
   unique_ptr<cmdLineParams> cmdLineParams_;
   unique_ptr<AppLoader> appLoader_;
   unique_ptr<SyncProc> syncProc_;
+  unique_ptr<SearchStrategy> strategy_;
+  ExplorationState current_;   // state the app is in, or heading to
+  size_t replayed_       = 0;  // steps of current_.path the app has run
+  unsigned long resets_  = 0;
+  long credits_          = 1;  // steps granted at once when mc knows them, see grant_steps()
+  unsigned long steps_   = 0;  // run by the explored app
+  unsigned long replies_ = 0;  // FINISH and STEPPED messages that told of them
+  chrono::steady_clock::time_point exploreStart_;
+  bool replaying_ = false; // --replay: current_ is the recorded path, and there is no search
+  unique_ptr<MessageTrace> messageTrace_; // --record
+  uint64_t grantedNs_ = 0; // when the explored app was last granted steps, for the step latency
+  uint64_t resetNs_   = 0; // when it was last sent a RESET; 0 once it is READY again
+  unique_ptr<StateGraph> graph_;
+  StateGraph::EdgeBuffer* edges_ = nullptr;
+  mutex explorationMutex_; // for the above, whichever shard has the explored app
+
+  // zygote mode: the first app parks once loaded and the others are forked from it
+  bool zygoteMode_    = false;
+  bool inProcess_     = false; // the apps run in our own process, see run_in_process()
+  bool dispatch_      = false; // the apps trap their syscalls themselves (Syscall User Dispatch)
+  long replicas_      = 1;
+  int zygoteSocket_   = -1;
+  int exploredSocket_ = -1;
+  pid_t exploredPid_  = -1;
+  map<int, chrono::steady_clock::time_point> pendingSpawns_;
+  chrono::steady_clock::time_point firstSpawn_;
+  vector<double> launchLatencies_; // in ms
+  mutex launchMutex_;              // for the launch figures and exploredSocket_
+  LaunchTrace* launchTrace_ = nullptr; // shared with the apps, see launch_trace.hpp
+  map<int, WindowLayout> windows_;     // of the apps mc launched, by socket, set before the loops run
+  static constexpr size_t kSyscalls = 512;
+  array<atomic<unsigned long>, kSyscalls> syscalls_{}; // SYSCALL messages of the apps, by syscall
+  // What mc counts for a scraper (--metrics=PATH); the metrics are registered once, by the constructor
+  struct Meters {
+    Counter* messages[2][MESSAGE_TYPES]; // by MessageTrace::Direction and type
+    Counter* steps;
+    Counter* resets;
+    Counter* waits; // of waitid() that collected a stop or an exit
+    Histogram* stepLatency;
+    Histogram* resetLatency;
+    Gauge* visitedStates;
+    Gauge* frontierStates;
+    Gauge* apps;
+    Counter* perf[TRANSITIONS][PerfCounters::PERF_EVENTS];
+    Histogram* stepPerf[PerfCounters::PERF_EVENTS]; // per step
+  } meters_;
+  MetricsRegistry metrics_;
+  unique_ptr<MetricsServer> metricsServer_;
+  AppMetrics* appMetrics_ = nullptr; // shared with the apps, see app_metrics.hpp
   void handle_message(int socket, void* buffer);
-  void handle_waitpid();
+  void send(int socket, const s_message_t& message, int fd = -1);
+  void add_app(pid_t pid);
+  void handle_exit(AppProcess& app);
+  bool on_message(int socket) override;
+  void on_sigchld() override;
+  void on_process_exit(pid_t pid) override;
+  [[noreturn]] void crash(pid_t pid, int signal);
   void setMemoryLayout(); 
+  void finish_exploration();
+  void reach(ExplorationState& state, const s_message_t& message);
+  MessageType next_step();
+  void grant_steps(s_message_t& message);
+  void spawn_replicas();
+  void run_in_process(const vector<string>& appParams, AddressPlanner& planner, const AddressPlanner::Budget& budget);
+  bool pending_spawn(int socket);
+  bool replica_ready(int socket, pid_t pid);
+  void report_launch(pid_t pid);
+  void report_memory(pid_t pid);
+  void register_metrics();
+  void collect_app_metrics(ostream& out) const;
+  void serve_metrics();
+  bool sample_perf(pid_t pid, PerfCounters::Sample& delta);
+  void attribute_perf(Transition transition, const PerfCounters::Sample& delta, uint32_t steps = 1);
 
 public:
   explicit MC();
@@ -0,0 +1,254 @@
+#include "message_trace.h"
+
+#include "global.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+constexpr char kTraceMagic[8]    = {'S', 'G', 'L', 'D', 'M', 'T', 'R', 'C'};
+constexpr uint32_t kTraceVersion = 2; // 1 had no counters
+constexpr uint8_t kToApp         = 0x80; // in the kind byte
+constexpr uint8_t kCounters      = 0x40;
+
+struct MessageTrace::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint64_t startNs;
+  uint64_t used; // bytes of the header and the records, stored once a record is complete
+};
+
+static inline uint64_t now_ns()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint8_t* put_varint(uint8_t* out, uint64_t value)
+{
+  while (value >= 0x80) {
+    *out++ = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  return out;
+}
+
+static inline bool get_varint(const uint8_t*& in, const uint8_t* end, uint64_t& value)
+{
+  value = 0;
+  for (unsigned shift = 0; in < end && shift < 64; shift += 7) {
+    auto byte = *in++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static inline bool is_step(MessageTrace::Direction direction, MessageType type)
+{
+  return direction == MessageTrace::TO_APP && (type == MessageType::CONTINUE || type == MessageType::STEPS);
+}
+
+unique_ptr<MessageTrace> MessageTrace::create(const string& path)
+{
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return nullptr;
+  if (ftruncate(fd, kInitialSize) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  auto map = mmap(nullptr, kInitialSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+
+  auto trace       = make_unique<MessageTrace>();
+  trace->path_     = path;
+  trace->fd_       = fd;
+  trace->map_      = (uint8_t*)map;
+  trace->capacity_ = kInitialSize;
+  auto header      = trace->header();
+  memcpy(header->magic, kTraceMagic, sizeof(header->magic));
+  header->version    = kTraceVersion;
+  header->headerSize = sizeof(Header);
+  header->startNs    = now_ns();
+  header->used       = sizeof(Header);
+  trace->lastNs_     = header->startNs;
+  return trace;
+}
+
+MessageTrace::~MessageTrace()
+{
+  if (map_ == nullptr)
+    return;
+  if (ftruncate(fd_, header()->used) != 0)
+    DLOG(ERROR, "could not trim %s: %s\n", path_.c_str(), strerror(errno));
+  munmap(map_, capacity_);
+  close(fd_);
+}
+
+// With mutex_ held
+void MessageTrace::grow(size_t needed)
+{
+  auto capacity = max(capacity_ * 2, needed);
+  void* map     = MAP_FAILED;
+  if (ftruncate(fd_, capacity) == 0)
+    map = mremap(map_, capacity_, capacity, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {
+    DLOG(ERROR, "could not grow %s to %zu bytes: %s\n", path_.c_str(), capacity, strerror(errno));
+    exit(-1);
+  }
+  map_      = (uint8_t*)map;
+  capacity_ = capacity;
+}
+
+void MessageTrace::record(Direction direction, int channel, const s_message_t& message, const uint64_t* counters,
+                          size_t count)
+{
+  // All but the kind and the time, before taking the lock
+  uint8_t body[kMaxRecord];
+  auto end = put_varint(body, (uint32_t)message.pid);
+  end      = put_varint(end, (uint32_t)channel);
+  end      = put_varint(end, payload_hash(message));
+  if (is_step(direction, message.type)) {
+    auto steps = min(message.steps, MAX_CREDITS);
+    end        = put_varint(end, steps);
+    for (uint32_t i = 0; i < steps; i++) {
+      auto choice = (uint32_t)message.choices[i];
+      if (choice < 0x80)
+        *end++ = (uint8_t)choice; // nearly all of them
+      else
+        end = put_varint(end, choice);
+    }
+  }
+  count = counters != nullptr ? min(count, kMaxCounters) : 0;
+  if (count != 0) {
+    end = put_varint(end, count);
+    for (size_t i = 0; i < count; i++)
+      end = put_varint(end, counters[i]);
+  }
+  size_t size = end - body;
+
+  lock_guard<mutex> lock(mutex_);
+  auto now  = now_ns();
+  auto used = header()->used;
+  if (used + 1 + 10 + size > capacity_)
+    grow(used + 1 + 10 + size);
+  auto out = map_ + used;
+  *out++   = (uint8_t)((int)message.type + 1) | (direction == TO_APP ? kToApp : 0) | (count != 0 ? kCounters : 0);
+  out      = put_varint(out, now - lastNs_);
+  memcpy(out, body, size);
+  lastNs_ = now;
+  __atomic_store_n(&header()->used, out + size - map_, __ATOMIC_RELEASE);
+}
+
+bool MessageTrace::load(const string& path, vector<Record>& records)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  struct stat st;
+  auto map = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)
+                 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                 : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  auto header = (const Header*)map;
+  bool valid  = memcmp(header->magic, kTraceMagic, sizeof(kTraceMagic)) == 0 && header->version <= kTraceVersion &&
+               header->used <= (uint64_t)st.st_size;
+  auto in     = (const uint8_t*)map + header->headerSize;
+  auto end    = (const uint8_t*)map + (valid ? header->used : 0);
+  uint64_t ns = 0;
+  records.clear();
+  while (valid && in < end) {
+    Record record;
+    auto kind        = *in++;
+    record.direction = kind & kToApp ? TO_APP : FROM_APP;
+    record.type      = (MessageType)((kind & ~(kToApp | kCounters)) - 1);
+    uint64_t delta, pid, channel, hash, steps = 0, choice, count = 0, counter;
+    valid = get_varint(in, end, delta) && get_varint(in, end, pid) && get_varint(in, end, channel) &&
+            get_varint(in, end, hash);
+    if (valid && is_step(record.direction, record.type))
+      valid = get_varint(in, end, steps) && steps <= MAX_CREDITS;
+    for (uint64_t i = 0; valid && i < steps; i++) {
+      valid = get_varint(in, end, choice);
+      record.choices.push_back((int32_t)choice);
+    }
+    if (valid && (kind & kCounters))
+      valid = get_varint(in, end, count) && count <= kMaxCounters;
+    for (uint64_t i = 0; valid && i < count; i++) {
+      valid = get_varint(in, end, counter);
+      record.counters.push_back(counter);
+    }
+    ns += delta;
+    record.ns      = ns;
+    record.pid     = (pid_t)pid;
+    record.channel = (int)channel;
+    record.hash    = (uint32_t)hash;
+    records.push_back(std::move(record));
+  }
+  munmap(map, st.st_size);
+  return valid;
+}
+
+vector<int> MessageTrace::last_path(const vector<Record>& records)
+{
+  auto last = find_if(records.rbegin(), records.rend(),
+                      [](const Record& record) { return is_step(record.direction, record.type); });
+  vector<int> path;
+  if (last == records.rend())
+    return path;
+  for (auto& record : records) {
+    if (record.channel != last->channel)
+      continue;
+    if (record.direction == FROM_APP && record.type == MessageType::READY)
+      path.clear(); // the app replays from its initial state
+    else if (is_step(record.direction, record.type))
+      path.insert(path.end(), record.choices.begin(), record.choices.end());
+  }
+  return path;
+}
+
+// FNV-1a over what the type of the message uses, 8 bytes at a time: the
+// choices of a STEPS message would take as many rounds as bytes otherwise
+uint32_t MessageTrace::payload_hash(const s_message_t& message)
+{
+  uint64_t hash = 14695981039346656037ull;
+  auto mix      = [&hash](const void* data, size_t size) {
+    auto bytes = (const uint8_t*)data;
+    for (; size >= 8; size -= 8, bytes += 8) {
+      uint64_t word;
+      memcpy(&word, bytes, 8);
+      hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; size > 0; size--)
+      hash = (hash ^ *bytes++) * 1099511628211ull;
+  };
+  switch (message.type) {
+    case MessageType::CONTINUE:
+    case MessageType::STEPS:
+    case MessageType::STEPPED: {
+      auto steps = min(message.steps, MAX_CREDITS);
+      mix(&steps, sizeof(steps));
+      mix(message.choices, steps * sizeof(message.choices[0]));
+    } break;
+    case MessageType::SYSCALL:
+      mix(&message.syscall_nr, sizeof(message.syscall_nr));
+      mix(&message.syscall_ret, sizeof(message.syscall_ret));
+      break;
+    case MessageType::LAYOUT:
+      mix(&message.start_addr, sizeof(message.start_addr));
+      mix(&message.end_addr, sizeof(message.end_addr));
+      break;
+    default:
+      break;
+  }
+  return (uint32_t)(hash ^ hash >> 32);
+}
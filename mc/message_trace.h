@@ -0,0 +1,76 @@
+#ifndef MESSAGE_TRACE_H
+#define MESSAGE_TRACE_H
+
+#include "channel.hpp"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The messages between mc and its apps, appended to a file mapped in memory
+// (--record=FILE), for --replay=FILE to run the app along the same path
+// again. After a header, each message is a record of
+//   kind | time | pid | channel | hash [| steps | choice...] [| count | counter...]
+// kind is a byte: the type of the message plus one, with the top bit set
+// for the messages mc sent, and the next one when counters follow. time is
+// the ns since the previous record, hash a 32-bit FNV-1a of the fields the
+// type uses (see payload_hash()), and the step messages mc sends (CONTINUE,
+// STEPS) list their choices. The counters are what the app did since its
+// previous step boundary, by PerfCounters::Event (mc --perf). The numbers
+// are LEB128 varints.
+// The header tells how far the records go, which holds when mc exits on a
+// crash of the app too.
+class MessageTrace {
+public:
+  enum Direction : uint8_t { FROM_APP, TO_APP };
+
+  struct Record {
+    Direction direction;
+    MessageType type;
+    uint64_t ns; // since the trace was created
+    pid_t pid;
+    int channel;
+    uint32_t hash;
+    vector<int32_t> choices;
+    vector<uint64_t> counters;
+  };
+
+private:
+  static constexpr size_t kMaxCounters = 16;
+  static constexpr size_t kMaxRecord   = 32 + MAX_CREDITS * 5 + 1 + kMaxCounters * 10;
+  static constexpr size_t kInitialSize = 1 << 20;
+
+  struct Header;
+  string path_;
+  int fd_          = -1;
+  uint8_t* map_    = nullptr;
+  size_t capacity_ = 0; // bytes of the file, all mapped
+  uint64_t lastNs_ = 0;
+  mutex mutex_;         // appends come from every shard
+
+  inline Header* header() const { return (Header*)map_; }
+  void grow(size_t needed);
+
+public:
+  explicit MessageTrace() = default;
+  ~MessageTrace();
+
+  // No copy
+  MessageTrace(MessageTrace const&) = delete;
+  MessageTrace& operator=(MessageTrace const&) = delete;
+
+  // nullptr (and errno) if `path` cannot be created
+  static unique_ptr<MessageTrace> create(const string& path);
+  void record(Direction direction, int channel, const s_message_t& message, const uint64_t* counters = nullptr,
+              size_t count = 0);
+
+  // False if `path` is no trace
+  static bool load(const string& path, vector<Record>& records);
+  // The choices mc sent the app it explored last, since that app was last READY
+  static vector<int> last_path(const vector<Record>& records);
+  static uint32_t payload_hash(const s_message_t& message);
+};
+
+#endif
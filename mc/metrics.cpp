@@ -0,0 +1,202 @@
+#include "metrics.h"
+
+#include "global.hpp"
+#include <iomanip>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+thread_local unsigned Counter::stripe_ = Counter::kUnassigned;
+
+void Counter::add_slow(uint64_t value)
+{
+  // The stripes are given out to the threads as they first count
+  static atomic<unsigned> next{0};
+  if (stripe_ == kUnassigned)
+    stripe_ = min(next.fetch_add(1, memory_order_relaxed), kStripes);
+  if (stripe_ < kStripes)
+    add(value);
+  else
+    cells_[kStripes].value.fetch_add(value, memory_order_relaxed);
+}
+
+uint64_t Counter::value() const
+{
+  uint64_t value = 0;
+  for (auto& cell : cells_)
+    value += cell.value.load(memory_order_relaxed);
+  return value;
+}
+
+uint64_t Histogram::highest(unsigned bucket)
+{
+  auto group = bucket >> kSubBits;
+  auto sub   = (uint64_t)(bucket & ((1u << kSubBits) - 1));
+  if (group == 0)
+    return sub;
+  auto shift = group - 1;
+  return (((1ull << kSubBits) + sub) << shift) + ((1ull << shift) - 1);
+}
+
+void Histogram::read(const vector<double>& quantiles, vector<uint64_t>& values, uint64_t& count, uint64_t& sum) const
+{
+  // A copy first: the buckets go on filling meanwhile
+  vector<uint64_t> buckets(kBuckets);
+  count = 0;
+  for (unsigned i = 0; i < kBuckets; i++)
+    count += buckets[i] = buckets_[i].load(memory_order_relaxed);
+  sum = sum_.load(memory_order_relaxed);
+
+  values.assign(quantiles.size(), 0);
+  for (size_t q = 0; q < quantiles.size() && count != 0; q++) {
+    auto rank     = max<uint64_t>(1, (uint64_t)(quantiles[q] * count + 0.5));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < kBuckets; i++)
+      if ((seen += buckets[i]) >= rank) {
+        values[q] = highest(i);
+        break;
+      }
+  }
+}
+
+Counter& MetricsRegistry::counter(const string& name, const string& help, const string& labels)
+{
+  lock_guard<mutex> lock(mutex_);
+  auto& counter = counters_.emplace_back();
+  entries_.push_back({COUNTER, name, labels, help, &counter, 1});
+  return counter;
+}
+
+Gauge& MetricsRegistry::gauge(const string& name, const string& help, const string& labels)
+{
+  lock_guard<mutex> lock(mutex_);
+  auto& gauge = gauges_.emplace_back();
+  entries_.push_back({GAUGE, name, labels, help, &gauge, 1});
+  return gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const string& name, const string& help, const string& labels, double scale)
+{
+  lock_guard<mutex> lock(mutex_);
+  auto& histogram = histograms_.emplace_back();
+  entries_.push_back({HISTOGRAM, name, labels, help, &histogram, scale});
+  return histogram;
+}
+
+void MetricsRegistry::add_collector(Collector collector)
+{
+  lock_guard<mutex> lock(mutex_);
+  collectors_.push_back(std::move(collector));
+}
+
+void MetricsRegistry::family(ostream& out, const string& name, const string& help, const char* type)
+{
+  out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+string MetricsRegistry::render() const
+{
+  static const vector<double> quantiles = {0.5, 0.9, 0.99, 0.999};
+  static const char* types[]            = {"counter", "gauge", "summary"};
+  lock_guard<mutex> lock(mutex_);
+  stringstream out;
+  out << setprecision(9);
+  const string* last = nullptr;
+  for (auto& entry : entries_) {
+    // The metrics of one name are registered one after the other, with their labels
+    if (last == nullptr || *last != entry.name)
+      family(out, entry.name, entry.help, types[entry.kind]);
+    last        = &entry.name;
+    auto labels = entry.labels.empty() ? "" : "{" + entry.labels + "}";
+    if (entry.kind == COUNTER) {
+      out << entry.name << labels << " " << ((const Counter*)entry.metric)->value() << "\n";
+    } else if (entry.kind == GAUGE) {
+      out << entry.name << labels << " " << ((const Gauge*)entry.metric)->value() << "\n";
+    } else {
+      vector<uint64_t> values;
+      uint64_t count, sum;
+      ((const Histogram*)entry.metric)->read(quantiles, values, count, sum);
+      auto separator = entry.labels.empty() ? "" : ",";
+      for (size_t q = 0; q < quantiles.size(); q++)
+        out << entry.name << "{" << entry.labels << separator << "quantile=\"" << quantiles[q] << "\"} "
+            << values[q] * entry.scale << "\n";
+      out << entry.name << "_sum" << labels << " " << sum * entry.scale << "\n";
+      out << entry.name << "_count" << labels << " " << count << "\n";
+    }
+  }
+  for (auto& collector : collectors_)
+    collector(out);
+  return out.str();
+}
+
+MetricsServer::~MetricsServer()
+{
+  if (listenFd_ == -1)
+    return;
+  // Wakes the thread up in accept()
+  shutdown(listenFd_, SHUT_RDWR);
+  thread_.join();
+  close(listenFd_);
+  unlink(path_.c_str());
+}
+
+bool MetricsServer::start(const string& path)
+{
+  sockaddr_un address{};
+  if (path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return false;
+  unlink(path.c_str()); // left by an earlier run
+  if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 16) != 0) {
+    auto savedErrno = errno;
+    close(fd);
+    errno = savedErrno;
+    return false;
+  }
+  path_     = path;
+  listenFd_ = fd;
+  // The thread takes no signal, as mc's SIGCHLD is read where it is blocked
+  // (the signalfd of the epoll engine): it starts with all of them blocked
+  sigset_t all, mask;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &mask);
+  thread_ = thread(&MetricsServer::serve, this);
+  pthread_sigmask(SIG_SETMASK, &mask, nullptr);
+  return true;
+}
+
+void MetricsServer::serve()
+{
+  for (;;) {
+    int client = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return; // shut down
+    }
+    // An HTTP client speaks first; a bare one is given a moment
+    char request[1024];
+    pollfd pending{client, POLLIN, 0};
+    ssize_t size = poll(&pending, 1, 100) == 1 ? recv(client, request, sizeof(request), 0) : 0;
+    auto body    = registry_.render();
+    string response;
+    if (size >= 4 && memcmp(request, "GET ", 4) == 0)
+      response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                 to_string(body.size()) + "\r\n\r\n";
+    response += body;
+    for (size_t sent = 0; sent < response.size();) {
+      auto count = ::send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (count <= 0)
+        break;
+      sent += count;
+    }
+    close(client);
+  }
+}
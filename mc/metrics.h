@@ -0,0 +1,161 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+using namespace std;
+
+// What mc counts while it runs, for a scraper to read (--metrics=PATH, see
+// MetricsServer). The metrics are registered up front and updated from any
+// thread without a lock. Every shard bumps the counters on every message: a
+// counter has a cache line per thread, which only that thread writes, so an
+// add is a plain load and store; the threads past kStripes share one more
+// cell, with atomic adds.
+class Counter {
+private:
+  static constexpr unsigned kStripes    = 16;
+  static constexpr unsigned kUnassigned = ~0u;
+  struct alignas(64) Cell {
+    atomic<uint64_t> value{0};
+  };
+  Cell cells_[kStripes + 1]; // the last one is shared
+  static thread_local unsigned stripe_;
+
+  void add_slow(uint64_t value);
+
+public:
+  inline void add(uint64_t value = 1)
+  {
+    auto stripe = stripe_;
+    if (stripe < kStripes) {
+      auto& cell = cells_[stripe].value;
+      cell.store(cell.load(memory_order_relaxed) + value, memory_order_relaxed);
+    } else {
+      add_slow(value);
+    }
+  }
+  uint64_t value() const;
+};
+
+class Gauge {
+private:
+  atomic<int64_t> value_{0};
+
+public:
+  inline void set(int64_t value) { value_.store(value, memory_order_relaxed); }
+  inline int64_t value() const { return value_.load(memory_order_relaxed); }
+};
+
+// HDR-style: the values, in ns, fall into buckets of 2^kSubBits per power of
+// two, i.e. within 1/16 of their value, from 1 ns up to 2^64 ns with no
+// range to configure; the quantiles are read from the buckets.
+class Histogram {
+private:
+  static constexpr unsigned kSubBits = 4;
+  static constexpr unsigned kBuckets = (64 - kSubBits + 1) << kSubBits;
+  atomic<uint64_t> buckets_[kBuckets]{};
+  atomic<uint64_t> sum_{0};
+
+  static inline unsigned bucket(uint64_t value)
+  {
+    if (value < (1u << kSubBits))
+      return value;
+    unsigned shift = 63 - __builtin_clzll(value) - kSubBits;
+    return ((shift + 1) << kSubBits) + ((value >> shift) & ((1u << kSubBits) - 1));
+  }
+  // The highest value of `bucket`
+  static uint64_t highest(unsigned bucket);
+
+public:
+  inline void record(uint64_t value)
+  {
+    buckets_[bucket(value)].fetch_add(1, memory_order_relaxed);
+    sum_.fetch_add(value, memory_order_relaxed);
+  }
+  // The values under which `quantiles` of them fall, with how many there are and their sum
+  void read(const vector<double>& quantiles, vector<uint64_t>& values, uint64_t& count, uint64_t& sum) const;
+};
+
+// The metrics of mc by name, rendered in the Prometheus text format
+class MetricsRegistry {
+public:
+  // Appends metrics the registry does not hold, read when rendered
+  using Collector = function<void(ostream&)>;
+
+private:
+  enum Kind { COUNTER, GAUGE, HISTOGRAM };
+  struct Entry {
+    Kind kind;
+    string name;
+    string labels; // as in name{labels}, or empty
+    string help;
+    void* metric;
+    double scale; // of the values of a histogram, when rendered
+  };
+  deque<Counter> counters_; // a deque never moves what it holds
+  deque<Gauge> gauges_;
+  deque<Histogram> histograms_;
+  vector<Entry> entries_;
+  vector<Collector> collectors_;
+  mutable mutex mutex_; // for the registration, against a scrape
+
+public:
+  explicit MetricsRegistry() = default;
+
+  // No copy
+  MetricsRegistry(MetricsRegistry const&) = delete;
+  MetricsRegistry& operator=(MetricsRegistry const&) = delete;
+
+  Counter& counter(const string& name, const string& help, const string& labels = "");
+  Gauge& gauge(const string& name, const string& help, const string& labels = "");
+  // Rendered as a summary of the values times `scale`: seconds, for values in ns
+  Histogram& histogram(const string& name, const string& help, const string& labels = "", double scale = 1e-9);
+  void add_collector(Collector collector);
+
+  string render() const;
+  // The # HELP and # TYPE lines of a metric, for the collectors
+  static void family(ostream& out, const string& name, const string& help, const char* type);
+
+  static inline uint64_t now_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+};
+
+// Serves the registry on a Unix socket, from a thread of its own: each
+// connection gets the metrics as they are, then is closed. A client that
+// sends an HTTP request first gets an HTTP response, e.g.
+//   curl --unix-socket PATH http://localhost/metrics
+// and one that sends nothing gets the bare text (socat - UNIX-CONNECT:PATH).
+class MetricsServer {
+private:
+  const MetricsRegistry& registry_;
+  string path_;
+  int listenFd_ = -1;
+  thread thread_;
+
+  void serve();
+
+public:
+  explicit MetricsServer(const MetricsRegistry& registry) : registry_(registry) {}
+  ~MetricsServer();
+
+  // No copy
+  MetricsServer(MetricsServer const&) = delete;
+  MetricsServer& operator=(MetricsServer const&) = delete;
+
+  // False (and errno) if `path` cannot be listened on
+  bool start(const string& path);
+};
+
+#endif
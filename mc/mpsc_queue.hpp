@@ -0,0 +1,68 @@
+#ifndef MPSC_QUEUE_HPP
+#define MPSC_QUEUE_HPP
+
+#include <atomic>
+
+using namespace std;
+
+// Lock-free queue of many producers and a single consumer, after Vyukov's
+// intrusive MPSC queue: the items derive from MpscQueue<T>::Node, push() is
+// one exchange from any thread, and pop() belongs to the consumer. pop() may
+// miss an item whose push() is halfway through; the producer wakes the
+// consumer once it is done, which tries again.
+template <typename T> class MpscQueue {
+public:
+  struct Node {
+    atomic<Node*> next{nullptr};
+  };
+
+private:
+  atomic<Node*> head_; // the last pushed
+  Node* tail_;         // the next to pop, or stub_
+  Node stub_;
+
+  inline void push_node(Node* node)
+  {
+    node->next.store(nullptr, memory_order_relaxed);
+    auto previous = head_.exchange(node, memory_order_acq_rel);
+    previous->next.store(node, memory_order_release);
+  }
+
+public:
+  MpscQueue() : head_(&stub_), tail_(&stub_) {}
+
+  // No copy
+  MpscQueue(MpscQueue const&) = delete;
+  MpscQueue& operator=(MpscQueue const&) = delete;
+
+  inline void push(T* item) { push_node(item); }
+
+  // The oldest item, or nullptr
+  T* pop()
+  {
+    auto tail = tail_;
+    auto next = tail->next.load(memory_order_acquire);
+    if (tail == &stub_) {
+      if (next == nullptr)
+        return nullptr;
+      tail_ = next;
+      tail  = next;
+      next  = next->next.load(memory_order_acquire);
+    }
+    if (next != nullptr) {
+      tail_ = next;
+      return static_cast<T*>(tail);
+    }
+    if (tail != head_.load(memory_order_acquire))
+      return nullptr; // a push() is halfway through
+    // tail is the last item: put the stub behind it to take it
+    push_node(&stub_);
+    next = tail->next.load(memory_order_acquire);
+    if (next == nullptr)
+      return nullptr;
+    tail_ = next;
+    return static_cast<T*>(tail);
+  }
+};
+
+#endif
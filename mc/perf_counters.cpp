@@ -0,0 +1,84 @@
+#include "perf_counters.h"
+
+#include "global.hpp"
+#include <atomic>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+struct EventConfig {
+  uint32_t type;
+  uint64_t config;
+};
+
+static const EventConfig eventConfigs[PerfCounters::PERF_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},   {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},   {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+// Whether the hardware events are worth trying: not after a first failure
+static atomic<bool> hardware{true};
+
+PerfCounters::~PerfCounters()
+{
+  for (auto fd : fds_)
+    close(fd);
+}
+
+unique_ptr<PerfCounters> PerfCounters::open(pid_t pid)
+{
+  auto counters  = make_unique<PerfCounters>();
+  int savedErrno = ENOENT;
+  for (int event = 0; event < PERF_EVENTS; event++) {
+    auto& config = eventConfigs[event];
+    if (config.type == PERF_TYPE_HARDWARE && !hardware)
+      continue;
+    perf_event_attr attr{};
+    attr.size           = sizeof(attr);
+    attr.type           = config.type;
+    attr.config         = config.config;
+    // The hardware events count what the app runs itself. The software ones
+    // happen in the kernel, on the app's behalf: counted there unless
+    // perf_event_paranoid forbids it (2, for an unprivileged mc)
+    attr.exclude_kernel = config.type == PERF_TYPE_HARDWARE;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int group           = counters->fds_.empty() ? -1 : counters->fds_[0];
+    int fd              = syscall(SYS_perf_event_open, &attr, pid, -1, group, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1 && (errno == EACCES || errno == EPERM) && !attr.exclude_kernel) {
+      attr.exclude_kernel = 1;
+      fd                  = syscall(SYS_perf_event_open, &attr, pid, -1, group, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd != -1) {
+      counters->fds_.push_back(fd);
+      counters->order_.push_back((Event)event);
+      continue;
+    }
+    savedErrno = errno;
+    if (config.type == PERF_TYPE_HARDWARE && hardware.exchange(false))
+      DLOG(INFO, "mc %d: no hardware counters (%s), software counters only\n", getpid(), strerror(errno));
+  }
+  if (counters->fds_.empty()) {
+    errno = savedErrno;
+    return nullptr;
+  }
+  return counters;
+}
+
+bool PerfCounters::sample(Sample& delta)
+{
+  // nr, time enabled, time running, then a value per event
+  uint64_t values[3 + PERF_EVENTS];
+  auto size = read(fds_[0], values, sizeof(values));
+  if (size < (ssize_t)(3 * sizeof(uint64_t)) || values[0] != order_.size())
+    return false;
+  // The group shared the PMU with others part of the time: scaled up to the time enabled
+  double scale = values[2] != 0 && values[2] < values[1] ? (double)values[1] / values[2] : 1.0;
+  Sample now{};
+  for (size_t i = 0; i < order_.size(); i++)
+    now[order_[i]] = (uint64_t)(values[3 + i] * scale);
+  for (int event = 0; event < PERF_EVENTS; event++)
+    delta[event] = now[event] >= last_[event] ? now[event] - last_[event] : 0;
+  last_ = now;
+  return true;
+}
@@ -0,0 +1,44 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <sys/types.h>
+#include <vector>
+
+using namespace std;
+
+// Counters the kernel keeps for an app process (perf_event_open), opened by
+// mc when it starts following the app (mc --perf) and read at each step
+// boundary: what the app did between two reads is what its transitions
+// cost. The events form one group, read at once. Without a PMU (most VMs),
+// the hardware events cannot be opened and only the software ones are;
+// mc is told once.
+class PerfCounters {
+public:
+  enum Event { INSTRUCTIONS, CYCLES, CACHE_MISSES, TASK_CLOCK, PAGE_FAULTS, CONTEXT_SWITCHES, PERF_EVENTS };
+  static constexpr const char* eventNames[PERF_EVENTS] = {"instructions", "cycles",      "cache_misses",
+                                                          "task_clock_ns", "page_faults", "context_switches"};
+  using Sample = array<uint64_t, PERF_EVENTS>; // 0 for the events not counted
+
+private:
+  vector<int> fds_;     // the leader first
+  vector<Event> order_; // of the values a read of the group returns
+  Sample last_{};
+
+public:
+  explicit PerfCounters() = default;
+  ~PerfCounters();
+
+  // No copy
+  PerfCounters(PerfCounters const&) = delete;
+  PerfCounters& operator=(PerfCounters const&) = delete;
+
+  // nullptr (and errno) if no event could be opened for `pid`
+  static unique_ptr<PerfCounters> open(pid_t pid);
+  // What the process did since the previous call, or since open(); false if the group could not be read
+  bool sample(Sample& delta);
+};
+
+#endif
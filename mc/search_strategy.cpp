@@ -0,0 +1,226 @@
+#include "search_strategy.h"
+#include "global.hpp"
+#include <algorithm>
+#include <sys/resource.h>
+
+// Orders the heap of the heuristic strategy on the score only
+static bool lowerScore(const pair<long, ExplorationState>& a, const pair<long, ExplorationState>& b)
+{
+  return a.first < b.first;
+}
+
+ExplorationState SearchStrategy::child(const ExplorationState& parent, int choice)
+{
+  ExplorationState state;
+  state.id     = nextId_++;
+  state.parent = parent.node;
+  state.depth  = parent.depth + 1;
+  state.path.reserve(parent.path.size() + 1);
+  state.path.assign(parent.path.begin(), parent.path.end());
+  state.path.push_back(choice);
+  return state;
+}
+
+void SearchStrategy::report() const
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  DLOG(INFO,
+       "mc %d: strategy %s explored %lu states, generated %lu, frontier size %zu (peak %zu), frontier peak memory "
+       "%zu bytes, spilled %zu bytes, mc peak RSS %ld KB\n",
+       getpid(), name_.c_str(), (unsigned long)explored_, (unsigned long)nextId_, frontier_size(),
+       peak_frontier_size(), peak_frontier_bytes(), spilled_frontier_bytes(), usage.ru_maxrss);
+}
+
+unique_ptr<SearchStrategy> SearchStrategy::create(const cmdLineParams& params)
+{
+  auto name     = params.getOption("strategy", string("dfs"));
+  size_t budget = params.getOption("frontier-mem", 256L) << 20; // in MB
+  auto spillDir = params.getOption("spill-dir", string("/tmp"));
+  auto maxDepth = (uint32_t)params.getOption("max-depth", 1000L);
+
+  if (name == "dfs")
+    return make_unique<DfsStrategy>(budget, spillDir);
+  if (name == "bfs")
+    return make_unique<BfsStrategy>(budget, spillDir);
+  if (name == "bounded")
+    return make_unique<BoundedDfsStrategy>((uint32_t)params.getOption("depth-bound", 10L),
+                                           (uint32_t)params.getOption("depth-step", 10L), maxDepth, budget, spillDir);
+  if (name == "random")
+    return make_unique<RandomWalkStrategy>((uint64_t)params.getOption("seed", 0L), maxDepth,
+                                           params.getOption("restarts", 10L));
+  if (name == "heuristic") {
+    auto heuristicName = params.getOption("heuristic", string("deep"));
+    HeuristicStrategy::Heuristic heuristic;
+    if (heuristicName == "deep")
+      heuristic = [](const ExplorationState& s) { return (long)s.depth; };
+    else if (heuristicName == "shallow")
+      heuristic = [](const ExplorationState& s) { return -(long)s.depth; };
+    else if (heuristicName == "random")
+      heuristic = [](const ExplorationState& s) { return (long)(hash<uint64_t>()(s.id * 0x9e3779b97f4a7c15ULL) >> 1); };
+    else {
+      DLOG(ERROR, "unknown heuristic: %s (expected deep, shallow or random)\n", heuristicName.c_str());
+      exit(-1);
+    }
+    return make_unique<HeuristicStrategy>(heuristic, budget, spillDir);
+  }
+
+  DLOG(ERROR, "unknown search strategy: %s (expected dfs, bfs, bounded, random or heuristic)\n", name.c_str());
+  exit(-1);
+}
+
+void DfsStrategy::expand(const ExplorationState& state, int nb_choices)
+{
+  explored_++;
+  // pushed in reverse so that the first choice is explored first
+  for (auto choice = nb_choices - 1; choice >= 0; choice--)
+    frontier_.push(child(state, choice));
+}
+
+bool DfsStrategy::next(ExplorationState& state)
+{
+  return frontier_.pop(state);
+}
+
+void BfsStrategy::expand(const ExplorationState& state, int nb_choices)
+{
+  explored_++;
+  for (auto choice = 0; choice < nb_choices; choice++)
+    frontier_.push(child(state, choice));
+}
+
+bool BfsStrategy::next(ExplorationState& state)
+{
+  return frontier_.pop(state);
+}
+
+void BoundedDfsStrategy::expand(const ExplorationState& state, int nb_choices)
+{
+  explored_++;
+  if (state.depth >= bound_) {
+    pruned_ = pruned_ || nb_choices > 0;
+    return;
+  }
+  for (auto choice = nb_choices - 1; choice >= 0; choice--)
+    frontier_.push(child(state, choice));
+}
+
+bool BoundedDfsStrategy::next(ExplorationState& state)
+{
+  if (frontier_.pop(state))
+    return true;
+  if (!pruned_ || bound_ >= maxBound_)
+    return false;
+
+  // Everything within the bound is explored; go one step deeper from scratch
+  bound_ = min(bound_ + step_, maxBound_);
+  pruned_ = false;
+  DLOG(INFO, "mc %d: depth bound raised to %u\n", getpid(), bound_);
+  state = initial_state();
+  return true;
+}
+
+void RandomWalkStrategy::expand(const ExplorationState& state, int nb_choices)
+{
+  explored_++;
+  hasPending_ = false;
+  if (nb_choices == 0 || state.depth >= maxDepth_)
+    return;
+  uniform_int_distribution<int> pick(0, nb_choices - 1);
+  pending_          = child(state, pick(rng_));
+  hasPending_       = true;
+  peakPending_      = 1;
+  peakPendingBytes_ = max(peakPendingBytes_, pending_.memory_size());
+}
+
+bool RandomWalkStrategy::next(ExplorationState& state)
+{
+  if (hasPending_) {
+    hasPending_ = false;
+    state       = std::move(pending_);
+    return true;
+  }
+  if (restartsLeft_-- <= 0)
+    return false;
+  state = initial_state();
+  return true;
+}
+
+void HeuristicStrategy::push(ExplorationState&& state)
+{
+  auto score = heuristic_(state);
+  heapBytes_ += state.memory_size();
+  heap_.emplace_back(score, std::move(state));
+  push_heap(heap_.begin(), heap_.end(), lowerScore);
+  peakHeapBytes_ = max(peakHeapBytes_, heapBytes_);
+  peakSize_      = max(peakSize_, frontier_size());
+  if (heapBytes_ > memoryBudget_)
+    shed();
+}
+
+// Moves the worst half of the heap to the overflow frontier
+void HeuristicStrategy::shed()
+{
+  auto middle = heap_.begin() + heap_.size() / 2;
+  nth_element(heap_.begin(), middle, heap_.end(),
+              [](const pair<long, ExplorationState>& a, const pair<long, ExplorationState>& b) {
+                return lowerScore(b, a);
+              });
+  for (auto it = middle; it != heap_.end(); ++it) {
+    heapBytes_ -= it->second.memory_size();
+    overflowBest_ = max(overflowBest_, it->first);
+    overflow_.push(std::move(it->second));
+  }
+  heap_.erase(middle, heap_.end());
+  make_heap(heap_.begin(), heap_.end(), lowerScore);
+}
+
+void HeuristicStrategy::expand(const ExplorationState& state, int nb_choices)
+{
+  explored_++;
+  for (auto choice = 0; choice < nb_choices; choice++)
+    push(child(state, choice));
+}
+
+// Keeps the best states of the heap and the overflow in the heap, up to
+// half of the budget. The overflow is in no order of score: it is read
+// through once, the best states so far kept in the heap with the worst on
+// top, and the states that fall out of it pushed back to the overflow.
+void HeuristicStrategy::refill()
+{
+  auto higherScore = [](const pair<long, ExplorationState>& a, const pair<long, ExplorationState>& b) {
+    return lowerScore(b, a);
+  };
+  make_heap(heap_.begin(), heap_.end(), higherScore);
+  overflowBest_ = LONG_MIN;
+  ExplorationState s;
+  for (auto count = overflow_.size(); count > 0 && overflow_.pop(s); count--) {
+    auto score = heuristic_(s);
+    heapBytes_ += s.memory_size();
+    heap_.emplace_back(score, std::move(s));
+    push_heap(heap_.begin(), heap_.end(), higherScore);
+    if (heapBytes_ > memoryBudget_ / 2 && heap_.size() > 1) {
+      pop_heap(heap_.begin(), heap_.end(), higherScore);
+      heapBytes_ -= heap_.back().second.memory_size();
+      overflowBest_ = max(overflowBest_, heap_.back().first);
+      overflow_.push(std::move(heap_.back().second));
+      heap_.pop_back();
+    }
+  }
+  make_heap(heap_.begin(), heap_.end(), lowerScore);
+}
+
+bool HeuristicStrategy::next(ExplorationState& state)
+{
+  // States pushed since the last shed may be worse than the ones it moved out
+  if (!overflow_.empty() && (heap_.empty() || heap_.front().first < overflowBest_))
+    refill();
+  if (heap_.empty())
+    return false;
+
+  pop_heap(heap_.begin(), heap_.end(), lowerScore);
+  state = std::move(heap_.back().second);
+  heap_.pop_back();
+  heapBytes_ -= state.memory_size();
+  return true;
+}
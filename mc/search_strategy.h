@@ -0,0 +1,181 @@
+#ifndef SEARCH_STRATEGY_H
+#define SEARCH_STRATEGY_H
+
+#include "cmdline_params.h"
+#include "frontier.h"
+#include <climits>
+#include <functional>
+#include <memory>
+#include <random>
+
+using namespace std;
+
+// Decides in which order the states of the app are explored. mc tells the
+// strategy about every reached state and its number of enabled transitions
+// (expand), then asks it for the state to explore next (next). A state that
+// is not a successor of the current one has to be restored first.
+class SearchStrategy {
+protected:
+  uint64_t nextId_   = 1; // 0 is the initial state; the states generated so far
+  uint64_t explored_ = 0; // states reached and expanded
+  string name_;
+
+  ExplorationState child(const ExplorationState& parent, int choice);
+
+public:
+  explicit SearchStrategy(string name) : name_(std::move(name)) {}
+  virtual ~SearchStrategy() = default;
+
+  virtual void expand(const ExplorationState& state, int nb_choices) = 0;
+  virtual bool next(ExplorationState& state)                         = 0;
+
+  virtual size_t frontier_size() const          = 0;
+  virtual size_t peak_frontier_size() const     = 0;
+  virtual size_t peak_frontier_bytes() const    = 0;
+  virtual size_t spilled_frontier_bytes() const = 0;
+
+  inline const string& name() const { return name_; }
+  inline uint64_t state_count() const { return nextId_; }
+  inline uint64_t explored_count() const { return explored_; }
+  static ExplorationState initial_state() { return ExplorationState{}; }
+  void report() const;
+
+  // Builds the strategy selected with --strategy=dfs|bfs|bounded|random|heuristic
+  static unique_ptr<SearchStrategy> create(const cmdLineParams& params);
+};
+
+// Depth-first: keeps only the current branch alive, at the price of a
+// restore each time a branch is exhausted.
+class DfsStrategy : public SearchStrategy {
+private:
+  SpillFrontier frontier_;
+
+public:
+  explicit DfsStrategy(size_t memoryBudget, string spillDir)
+      : SearchStrategy("dfs"), frontier_(FrontierOrder::LIFO, memoryBudget, std::move(spillDir))
+  {
+  }
+  void expand(const ExplorationState& state, int nb_choices) override;
+  bool next(ExplorationState& state) override;
+
+  size_t frontier_size() const override { return frontier_.size(); }
+  size_t peak_frontier_size() const override { return frontier_.peak_size(); }
+  size_t peak_frontier_bytes() const override { return frontier_.peak_memory_bytes(); }
+  size_t spilled_frontier_bytes() const override { return frontier_.spilled_bytes(); }
+};
+
+// Breadth-first: the whole next level is pending at once, which is where
+// the frontier spilling matters.
+class BfsStrategy : public SearchStrategy {
+private:
+  SpillFrontier frontier_;
+
+public:
+  explicit BfsStrategy(size_t memoryBudget, string spillDir)
+      : SearchStrategy("bfs"), frontier_(FrontierOrder::FIFO, memoryBudget, std::move(spillDir))
+  {
+  }
+  void expand(const ExplorationState& state, int nb_choices) override;
+  bool next(ExplorationState& state) override;
+
+  size_t frontier_size() const override { return frontier_.size(); }
+  size_t peak_frontier_size() const override { return frontier_.peak_size(); }
+  size_t peak_frontier_bytes() const override { return frontier_.peak_memory_bytes(); }
+  size_t spilled_frontier_bytes() const override { return frontier_.spilled_bytes(); }
+};
+
+// Iterative deepening: a depth-first search cut at `bound`, restarted from
+// the initial state with a deeper bound as long as something was cut.
+class BoundedDfsStrategy : public SearchStrategy {
+private:
+  SpillFrontier frontier_;
+  uint32_t bound_;
+  uint32_t step_;
+  uint32_t maxBound_;
+  bool pruned_ = false;
+
+public:
+  explicit BoundedDfsStrategy(uint32_t bound, uint32_t step, uint32_t maxBound, size_t memoryBudget, string spillDir)
+      : SearchStrategy("bounded")
+      , frontier_(FrontierOrder::LIFO, memoryBudget, std::move(spillDir))
+      , bound_(bound)
+      , step_(step)
+      , maxBound_(maxBound)
+  {
+  }
+  void expand(const ExplorationState& state, int nb_choices) override;
+  bool next(ExplorationState& state) override;
+
+  size_t frontier_size() const override { return frontier_.size(); }
+  size_t peak_frontier_size() const override { return frontier_.peak_size(); }
+  size_t peak_frontier_bytes() const override { return frontier_.peak_memory_bytes(); }
+  size_t spilled_frontier_bytes() const override { return frontier_.spilled_bytes(); }
+  inline uint32_t bound() const { return bound_; }
+};
+
+// Random walk: follows one random transition per state down to `maxDepth`
+// or a dead end, then restarts from the initial state.
+class RandomWalkStrategy : public SearchStrategy {
+private:
+  mt19937_64 rng_;
+  uint32_t maxDepth_;
+  long restartsLeft_;
+  bool hasPending_ = false;
+  ExplorationState pending_;
+  size_t peakPending_      = 0;
+  size_t peakPendingBytes_ = 0;
+
+public:
+  explicit RandomWalkStrategy(uint64_t seed, uint32_t maxDepth, long restarts)
+      : SearchStrategy("random"), rng_(seed), maxDepth_(maxDepth), restartsLeft_(restarts)
+  {
+  }
+  void expand(const ExplorationState& state, int nb_choices) override;
+  bool next(ExplorationState& state) override;
+
+  size_t frontier_size() const override { return hasPending_ ? 1 : 0; }
+  size_t peak_frontier_size() const override { return peakPending_; }
+  size_t peak_frontier_bytes() const override { return peakPendingBytes_; }
+  size_t spilled_frontier_bytes() const override { return 0; }
+};
+
+// Best-first: pending states are ordered by a user heuristic (highest score
+// first). When the heap exceeds its budget, its worst half is moved to a
+// spilling overflow frontier, whose best states refill the heap once it
+// runs dry.
+class HeuristicStrategy : public SearchStrategy {
+public:
+  using Heuristic = function<long(const ExplorationState&)>;
+
+private:
+  Heuristic heuristic_;
+  size_t memoryBudget_;
+  vector<pair<long, ExplorationState>> heap_;
+  size_t heapBytes_     = 0;
+  size_t peakHeapBytes_ = 0;
+  size_t peakSize_      = 0;
+  SpillFrontier overflow_;
+  long overflowBest_ = LONG_MIN; // the best score in the overflow, or higher
+
+  void push(ExplorationState&& state);
+  void shed();
+  void refill();
+
+public:
+  explicit HeuristicStrategy(Heuristic heuristic, size_t memoryBudget, string spillDir)
+      : SearchStrategy("heuristic")
+      , heuristic_(std::move(heuristic))
+      , memoryBudget_(memoryBudget)
+      , overflow_(FrontierOrder::FIFO, memoryBudget, std::move(spillDir))
+  {
+  }
+  void expand(const ExplorationState& state, int nb_choices) override;
+  bool next(ExplorationState& state) override;
+
+  size_t frontier_size() const override { return heap_.size() + overflow_.size(); }
+  size_t peak_frontier_size() const override { return peakSize_; }
+  size_t peak_frontier_bytes() const override { return peakHeapBytes_ + overflow_.peak_memory_bytes(); }
+  size_t spilled_frontier_bytes() const override { return overflow_.spilled_bytes(); }
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef STARTUP_CONTEXT_H
+#define STARTUP_CONTEXT_H
+
+#include "global.hpp"
+#include <chrono>
+#include <elf.h>
+
+using namespace std;
+
+// What the loader needs to know about the process it was started in, probed
+// once: the aux vector (prctl(PR_GET_AUXV), or the original stack on kernels
+// without it), a few getauxval() entries, one read of /proc/self/maps, and
+// argc, argv and envp from the initial stack pointer (__libc_stack_end).
+// Stack, heap and loader code read it instead of going back to /proc; forked
+// children inherit it.
+//
+// It also times the startup phases of the loader (see begin_phases()).
+class StartupContext {
+public:
+  struct Mapping {
+    uintptr_t start;
+    uintptr_t end;
+    int prot;
+    int flags; // MAP_PRIVATE or MAP_SHARED, with MAP_ANONYMOUS when there is no name
+    string name;
+  };
+
+private:
+  using Clock = chrono::steady_clock;
+
+  void* initialSp_ = nullptr; // address of argc on the original stack
+  int argc_        = 0;
+  char** argv_     = nullptr;
+  char** envp_     = nullptr;
+  vector<ElfW(auxv_t)> auxv_;
+  bool auxvFromKernel_    = false; // PR_GET_AUXV worked
+  unsigned long pageSize_ = 0;
+  unsigned long hwcap2_   = 0;
+  const char* execfn_     = nullptr;
+  vector<string> mapsLines_;
+  vector<Mapping> maps_;
+  Mapping stack_ {};
+  bool logMaps_     = false;
+  uint64_t probeNs_ = 0;
+  Clock::time_point phaseStart_;
+  vector<pair<const char*, uint64_t>> phases_; // name, ns
+
+  StartupContext();
+  void read_auxv();
+
+public:
+  static StartupContext& get();
+
+  // Reads /proc/self/maps in one go; `lines` gets the raw lines when given
+  static vector<Mapping> read_maps(vector<string>* lines = nullptr);
+
+  inline void* initial_sp() const { return initialSp_; }
+  inline int argc() const { return argc_; }
+  inline char** argv() const { return argv_; }
+  inline char** envp() const { return envp_; }
+  // Ends with AT_NULL
+  inline const vector<ElfW(auxv_t)>& auxv() const { return auxv_; }
+  unsigned long aux(unsigned long type) const;
+  inline unsigned long page_size() const { return pageSize_; }
+  inline unsigned long hwcap2() const { return hwcap2_; }
+  inline const char* execfn() const { return execfn_; }
+
+  // /proc/self/maps as it was when the context was probed, as lines and parsed
+  inline const vector<string>& maps_lines() const { return mapsLines_; }
+  inline const vector<Mapping>& maps() const { return maps_; }
+  inline const Mapping& stack() const { return stack_; }
+
+  // Dumps of /proc/self/maps to ./log are only written when SIMGLD_LOG_MAPS is set
+  inline bool log_maps() const { return logMaps_; }
+  inline void write_maps(const string& label) const
+  {
+    if (logMaps_)
+      write_mmapped_ranges(label, getpid());
+  }
+
+  // Startup phases: begin_phases() starts the clock, end_phase() records the
+  // time since the previous phase ended and report_phases() logs them all
+  void begin_phases();
+  void end_phase(const char* name);
+  void report_phases(const char* who) const;
+};
+
+#endif
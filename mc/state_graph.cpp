@@ -0,0 +1,286 @@
+#include "state_graph.h"
+#include "global.hpp"
+#include <algorithm>
+
+namespace {
+constexpr char kGraphMagic[8] = {'S', 'G', 'L', 'D', 'G', 'R', 'P', 'H'};
+constexpr uint32_t kGraphVersion = 1;
+
+struct GraphFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t id_size;
+  uint64_t node_count;
+  uint64_t edge_count;
+};
+
+template <class T> void write_array(FILE* file, const T* data, size_t count, const string& path)
+{
+  if (count > 0 && fwrite(data, sizeof(T), count, file) != count) {
+    DLOG(ERROR, "could not write the state graph to %s: %s\n", path.c_str(), strerror(errno));
+    exit(-1);
+  }
+}
+
+template <class T> void read_array(FILE* file, T* data, size_t count, const string& path)
+{
+  if (count > 0 && fread(data, sizeof(T), count, file) != count) {
+    DLOG(ERROR, "truncated state graph file %s\n", path.c_str());
+    exit(-1);
+  }
+}
+} // namespace
+
+StateGraph::EdgeBuffer& StateGraph::worker_buffer()
+{
+  lock_guard<mutex> lock(buffersMutex_);
+  buffers_.push_back(make_unique<EdgeBuffer>());
+  return *buffers_.back();
+}
+
+StateGraph::StateId StateGraph::intern(uint64_t key)
+{
+  auto it = ids_.find(key);
+  if (it != ids_.end())
+    return it->second;
+  if (ids_.size() >= kMaxStates) {
+    DLOG(ERROR, "the state graph is full: more than %lu states\n", (unsigned long)kMaxStates);
+    exit(-1);
+  }
+  StateId id = ids_.size();
+  ids_.emplace(key, id);
+  pendingNodes_ = max(pendingNodes_, id + 1);
+  return id;
+}
+
+void StateGraph::mark_accepting(StateId id)
+{
+  if (id / 64 >= accepting_.size())
+    accepting_.resize(id / 64 + 1, 0);
+  accepting_[id / 64] |= 1ULL << (id % 64);
+  pendingNodes_ = max(pendingNodes_, id + 1);
+}
+
+void StateGraph::compact()
+{
+  lock_guard<mutex> lock(buffersMutex_);
+
+  size_t pending = 0;
+  StateId nodes  = max(nodeCount_, pendingNodes_);
+  for (auto& buffer : buffers_) {
+    pending += buffer->size();
+    for (auto& chunk : buffer->chunks_)
+      for (auto& e : chunk)
+        nodes = max(nodes, max(e.first, e.second) + 1);
+  }
+  if (pending == 0 && nodes == nodeCount_)
+    return;
+
+  // Counting sort of the old and the buffered edges by source state
+  vector<uint64_t> offsets(nodes + 1, 0);
+  for (StateId s = 0; s < nodeCount_; s++)
+    offsets[s + 1] = offsets_[s + 1] - offsets_[s];
+  for (auto& buffer : buffers_)
+    for (auto& chunk : buffer->chunks_)
+      for (auto& e : chunk)
+        offsets[e.first + 1]++;
+  for (StateId s = 0; s < nodes; s++)
+    offsets[s + 1] += offsets[s];
+
+  vector<StateId> targets(offsets[nodes]);
+  vector<uint64_t> fill(offsets.begin(), offsets.end() - 1);
+  for (StateId s = 0; s < nodeCount_; s++)
+    for (auto i = offsets_[s]; i < offsets_[s + 1]; i++)
+      targets[fill[s]++] = targets_[i];
+  vector<uint64_t>().swap(offsets_);
+  vector<StateId>().swap(targets_);
+  for (auto& buffer : buffers_) {
+    for (auto& chunk : buffer->chunks_)
+      for (auto& e : chunk)
+        targets[fill[e.first]++] = e.second;
+    vector<vector<pair<StateId, StateId>>>().swap(buffer->chunks_);
+    buffer->size_ = 0;
+  }
+  vector<uint64_t>().swap(fill);
+
+  // Sort the successors of each state and squeeze the duplicates out in place
+  uint64_t out = 0;
+  for (StateId s = 0; s < nodes; s++) {
+    auto begin = targets.begin() + offsets[s];
+    auto end   = targets.begin() + offsets[s + 1];
+    sort(begin, end);
+    auto last  = unique(begin, end);
+    offsets[s] = out;
+    out        = std::move(begin, last, targets.begin() + out) - targets.begin();
+  }
+  offsets[nodes] = out;
+  targets.resize(out);
+  targets.shrink_to_fit();
+
+  offsets_      = std::move(offsets);
+  targets_      = std::move(targets);
+  nodeCount_    = nodes;
+  pendingNodes_ = nodes;
+}
+
+bool StateGraph::has_self_loop(StateId id) const
+{
+  return binary_search(targets_.begin() + offsets_[id], targets_.begin() + offsets_[id + 1], id);
+}
+
+bool StateGraph::find_accepting_cycle(vector<StateId>* cycle) const
+{
+  // Iterative Tarjan: index/lowlink per state, component ids assigned on pop
+  constexpr uint32_t kUnvisited = UINT32_MAX;
+  vector<uint32_t> index(nodeCount_, kUnvisited);
+  vector<uint32_t> lowlink(nodeCount_, 0);
+  vector<uint32_t> component(nodeCount_, kUnvisited);
+  vector<StateId> sccStack;
+  vector<pair<StateId, uint64_t>> callStack; // state, next successor to visit
+  uint32_t nextIndex     = 0;
+  uint32_t nextComponent = 0;
+
+  for (StateId root = 0; root < nodeCount_; root++) {
+    if (index[root] != kUnvisited)
+      continue;
+    callStack.emplace_back(root, offsets_[root]);
+    index[root] = lowlink[root] = nextIndex++;
+    sccStack.push_back(root);
+
+    while (!callStack.empty()) {
+      auto& frame = callStack.back();
+      auto v      = frame.first;
+      if (frame.second < offsets_[v + 1]) {
+        auto w = targets_[frame.second++];
+        if (index[w] == kUnvisited) {
+          index[w] = lowlink[w] = nextIndex++;
+          sccStack.push_back(w);
+          callStack.emplace_back(w, offsets_[w]);
+        } else if (component[w] == kUnvisited) {
+          lowlink[v] = min(lowlink[v], index[w]);
+        }
+        continue;
+      }
+
+      callStack.pop_back();
+      if (!callStack.empty())
+        lowlink[callStack.back().first] = min(lowlink[callStack.back().first], lowlink[v]);
+      if (lowlink[v] != index[v])
+        continue;
+
+      // v is the root of a component: pop it and look for an accepting member on a cycle
+      size_t size       = 0;
+      StateId accepting = kUnvisited;
+      StateId w;
+      do {
+        w = sccStack.back();
+        sccStack.pop_back();
+        component[w] = nextComponent;
+        size++;
+        if (accepting == kUnvisited && is_accepting(w))
+          accepting = w;
+      } while (w != v);
+
+      if (accepting != kUnvisited && (size > 1 || has_self_loop(accepting))) {
+        if (cycle != nullptr)
+          cycle_through(accepting, component, nextComponent, *cycle);
+        return true;
+      }
+      nextComponent++;
+    }
+  }
+  return false;
+}
+
+// BFS restricted to the component, from `start` back to itself
+void StateGraph::cycle_through(StateId start, const vector<uint32_t>& scc, uint32_t component,
+                               vector<StateId>& cycle) const
+{
+  constexpr StateId kNone = UINT32_MAX;
+  vector<StateId> parent(nodeCount_, kNone);
+  vector<StateId> queue{start};
+  StateId last = kNone;
+  for (size_t head = 0; head < queue.size() && last == kNone; head++) {
+    auto v = queue[head];
+    for (auto i = offsets_[v]; i < offsets_[v + 1]; i++) {
+      auto w = targets_[i];
+      if (scc[w] != component)
+        continue;
+      if (w == start) {
+        last = v;
+        break;
+      }
+      if (parent[w] == kNone) {
+        parent[w] = v;
+        queue.push_back(w);
+      }
+    }
+  }
+
+  cycle.clear();
+  for (auto v = last; v != kNone && v != start; v = parent[v])
+    cycle.push_back(v);
+  cycle.push_back(start);
+  reverse(cycle.begin(), cycle.end());
+}
+
+void StateGraph::save(const string& path) const
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    DLOG(ERROR, "could not open %s: %s\n", path.c_str(), strerror(errno));
+    exit(-1);
+  }
+  setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+  GraphFileHeader header;
+  memcpy(header.magic, kGraphMagic, sizeof(header.magic));
+  header.version    = kGraphVersion;
+  header.id_size    = sizeof(StateId);
+  header.node_count = nodeCount_;
+  header.edge_count = targets_.size();
+  write_array(file, &header, 1, path);
+
+  vector<uint64_t> accepting(accepting_);
+  accepting.resize((nodeCount_ + 63) / 64, 0);
+  write_array(file, offsets_.data(), (size_t)nodeCount_ + 1, path);
+  write_array(file, targets_.data(), targets_.size(), path);
+  write_array(file, accepting.data(), accepting.size(), path);
+  fclose(file);
+}
+
+void StateGraph::load(const string& path)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    DLOG(ERROR, "could not open %s: %s\n", path.c_str(), strerror(errno));
+    exit(-1);
+  }
+  setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+  GraphFileHeader header;
+  read_array(file, &header, 1, path);
+  if (memcmp(header.magic, kGraphMagic, sizeof(header.magic)) != 0 || header.version != kGraphVersion ||
+      header.id_size != sizeof(StateId)) {
+    DLOG(ERROR, "%s is not a state graph file\n", path.c_str());
+    exit(-1);
+  }
+
+  if (header.node_count > kMaxStates) {
+    DLOG(ERROR, "%s has more states than ids: %lu\n", path.c_str(), (unsigned long)header.node_count);
+    exit(-1);
+  }
+
+  lock_guard<mutex> lock(buffersMutex_);
+  buffers_.clear();
+  ids_.clear();
+  nodeCount_    = header.node_count;
+  pendingNodes_ = nodeCount_;
+  offsets_.resize(header.node_count + 1);
+  targets_.resize(header.edge_count);
+  accepting_.resize((header.node_count + 63) / 64);
+  read_array(file, offsets_.data(), offsets_.size(), path);
+  read_array(file, targets_.data(), targets_.size(), path);
+  read_array(file, accepting_.data(), accepting_.size(), path);
+  fclose(file);
+}
@@ -0,0 +1,94 @@
+#ifndef STATE_GRAPH_H
+#define STATE_GRAPH_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Explored transition graph kept for liveness checks. States are dense
+// integer ids, given out by intern() to the states as mc tells them apart
+// (a fingerprint of the app's state), so that a state reached twice is one
+// node; edges are appended to per-worker buffers without locking and
+// compacted on demand into CSR arrays (offsets_ indexed by source state,
+// targets_ holding the successors), i.e. 4 bytes per edge once compacted.
+class StateGraph {
+public:
+  using StateId = uint32_t;
+  static constexpr uint64_t kMaxStates = UINT32_MAX; // the last id is the searches' "none"
+
+  class EdgeBuffer {
+  private:
+    static constexpr size_t kChunkEdges = 1 << 16;
+    vector<vector<pair<StateId, StateId>>> chunks_; // chunked so that growing never copies
+    size_t size_ = 0;
+    friend class StateGraph;
+
+  public:
+    inline void add(StateId from, StateId to)
+    {
+      if (chunks_.empty() || chunks_.back().size() == kChunkEdges) {
+        chunks_.emplace_back();
+        chunks_.back().reserve(kChunkEdges);
+      }
+      chunks_.back().emplace_back(from, to);
+      size_++;
+    }
+    inline size_t size() const { return size_; }
+  };
+
+private:
+  mutex buffersMutex_;
+  vector<unique_ptr<EdgeBuffer>> buffers_;
+  vector<uint64_t> offsets_{0};
+  vector<StateId> targets_;
+  vector<uint64_t> accepting_; // bitset over the state ids
+  unordered_map<uint64_t, StateId> ids_; // by fingerprint
+  StateId nodeCount_    = 0; // states covered by the CSR arrays
+  StateId pendingNodes_ = 0; // states known before the next compaction
+
+  inline bool is_accepting(StateId id) const
+  {
+    return id / 64 < accepting_.size() && (accepting_[id / 64] >> (id % 64)) & 1;
+  }
+  bool has_self_loop(StateId id) const;
+  void cycle_through(StateId start, const vector<uint32_t>& scc, uint32_t component, vector<StateId>& cycle) const;
+
+public:
+  explicit StateGraph() = default;
+
+  // No copy
+  StateGraph(StateGraph const&) = delete;
+  StateGraph& operator=(StateGraph const&) = delete;
+
+  // Each worker appends its edges to its own buffer
+  EdgeBuffer& worker_buffer();
+  // The id of the state of fingerprint `key`, a new one for a key not seen yet
+  StateId intern(uint64_t key);
+  void mark_accepting(StateId id);
+  // Merges the worker buffers into the CSR arrays, dropping duplicate edges
+  void compact();
+
+  inline StateId node_count() const { return nodeCount_; }
+  inline uint64_t edge_count() const { return targets_.size(); }
+  inline size_t memory_bytes() const
+  {
+    return offsets_.capacity() * sizeof(uint64_t) + targets_.capacity() * sizeof(StateId) +
+           accepting_.capacity() * sizeof(uint64_t) + ids_.bucket_count() * sizeof(void*) +
+           ids_.size() * (sizeof(pair<uint64_t, StateId>) + sizeof(void*));
+  }
+
+  // SCC-based check: returns true if an accepting state lies on a cycle of the
+  // compacted graph, and fills `cycle` with one such cycle when given.
+  bool find_accepting_cycle(vector<StateId>* cycle = nullptr) const;
+
+  // Binary format: header, offsets, targets, then the accepting bitset
+  void save(const string& path) const;
+  void load(const string& path);
+};
+
+#endif
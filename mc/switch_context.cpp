@@ -3,37 +3,49 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/auxv.h>
 #include <sys/prctl.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-SwitchContext::SwitchContext(unsigned long lowerHalfFs)
+#ifndef HWCAP2_FSGSBASE
+#define HWCAP2_FSGSBASE (1 << 1)
+#endif
+
+bool SwitchContext::fsgsbase_ = false;
+
+void SwitchContext::init(unsigned long hwcap2, bool allowed)
 {
-  this->lowerHalfFs = lowerHalfFs;
-  int rc            = syscall(SYS_arch_prctl, ARCH_GET_FS, &this->upperHalfFs);
+  fsgsbase_ = allowed && (hwcap2 & HWCAP2_FSGSBASE);
+}
+
+void SwitchContext::set_fs(unsigned long fs)
+{
+  if (fsgsbase_) {
+    asm volatile("wrfsbase %0" : : "r"(fs) : "memory");
+    return;
+  }
+  int rc = syscall(SYS_arch_prctl, ARCH_SET_FS, fs);
   if (rc < 0) {
-    printf("failed to get fs: %d\n", errno);
+    printf("failed to set fs: %d\n", errno);
     exit(-1);
   }
-  this->jumped = 0;
+}
+
+SwitchContext::SwitchContext(unsigned long lowerHalfFs)
+{
+  this->lowerHalfFs = lowerHalfFs;
+  this->upperHalfFs = get_fs();
+  this->jumped      = 0;
   if (lowerHalfFs > 0 && lowerHalfFs != this->upperHalfFs) {
-    rc = syscall(SYS_arch_prctl, ARCH_SET_FS, this->lowerHalfFs);
-    if (rc < 0) {
-      printf("failed to get fs: %d\n", errno);
-      exit(-1);
-    }
+    set_fs(this->lowerHalfFs);
     this->jumped = 1;
   }
 }
 
 SwitchContext::~SwitchContext()
 {
-  if (this->jumped) {
-    int rc = syscall(SYS_arch_prctl, ARCH_SET_FS, this->upperHalfFs);
-    if (rc < 0) {
-      printf("failed to get fs: %d\n", errno);
-      exit(-1);
-    }
-  }
-}
\ No newline at end of file
+  if (this->jumped)
+    set_fs(this->upperHalfFs);
+}
@@ -3,33 +3,103 @@
 #include "global.hpp"
 #include <assert.h>
 #include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 
-void SyncProc::start(void (*handler)(int, short, void*), void *obj, list<int> sockets)
-{
-  auto* base = event_base_new();
-  base_.reset(base);
+// The libevent engine of SyncProc: an event_base per shard, SIGCHLD on the
+// one of shard 0.
 
-  for (auto s : sockets) {
-    unique_ptr<Channel> channel = make_unique<Channel>(s);
-    auto* socket_event          = event_new(base, channel->get_socket(), EV_READ | EV_PERSIST, handler, obj);
-    event_add(socket_event, nullptr);
-    ch_hash.insert({s, std::move(channel)});
+SyncProc::Shard::Shard(SyncProc* syncProc, int index) : syncProc(syncProc), index(index)
+{
+  base.reset(event_base_new());
+  wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (!base || wakeFd == -1) {
+    DLOG(ERROR, "Could not create the loop of shard %d: %s\n", index, strerror(errno));
+    exit(-1);
   }
+  wake_event.reset(event_new(
+      base.get(), wakeFd, EV_READ | EV_PERSIST,
+      [](evutil_socket_t, short, void* arg) {
+        auto shard = static_cast<Shard*>(arg);
+        shard->syncProc->run_tasks(*shard);
+        if (shard->syncProc->stop_)
+          event_base_loopbreak(shard->base.get());
+      },
+      this));
+  event_add(wake_event.get(), nullptr);
+}
+
+SyncProc::Shard::~Shard()
+{
+  // The events go before their base
+  wake_event.reset();
+  socket_event.clear();
+  process_event.clear();
+  if (index == 0)
+    syncProc->signal_event_.reset();
+  base.reset();
+  close(wakeFd);
+}
+
+void SyncProc::on_event(evutil_socket_t fd, short what, void* arg)
+{
+  auto& shard   = *static_cast<Shard*>(arg);
+  auto syncProc = shard.syncProc;
+  shard.counters.events++;
+  if (what & EV_SIGNAL)
+    syncProc->handler_->on_sigchld();
+  else
+    while (syncProc->handler_->on_message(fd))
+      shard.counters.messages++;
+  if (syncProc->stop_)
+    event_base_loopbreak(shard.base.get());
+}
 
-  auto* signal_event = event_new(base, SIGCHLD, EV_SIGNAL | EV_PERSIST, handler, obj);
+void SyncProc::watch_sigchld()
+{
+  auto& shard        = *shards_[0];
+  auto* signal_event = event_new(shard.base.get(), SIGCHLD, EV_SIGNAL | EV_PERSIST, on_event, &shard);
   event_add(signal_event, nullptr);
   signal_event_.reset(signal_event);
-  dispatch();
+  // A child may have stopped before the event was there: its SIGCHLD is gone, look for it once
+  event_active(signal_event, EV_SIGNAL, 1);
+}
+
+void SyncProc::watch_channel(Shard& shard, int socket)
+{
+  auto* socket_event = event_new(shard.base.get(), socket, EV_READ | EV_PERSIST, on_event, &shard);
+  event_add(socket_event, nullptr);
+  shard.socket_event.emplace_back(socket_event, &event_free);
 }
 
-void SyncProc::dispatch() const
+void SyncProc::watch_exit(Shard& shard, int pidfd, pid_t pid)
 {
-  event_base_dispatch(base_.get());
+  auto& watched = shard.process_event[pidfd];
+  watched.shard = &shard;
+  watched.pid   = pid;
+  watched.watch.reset(event_new(
+      shard.base.get(), pidfd, EV_READ | EV_PERSIST,
+      [](evutil_socket_t, short, void* arg) {
+        auto watched = static_cast<Shard::WatchedProcess*>(arg);
+        auto shard = watched->shard;
+        shard->counters.events++;
+        shard->syncProc->handler_->on_process_exit(watched->pid);
+        if (shard->syncProc->stop_)
+          event_base_loopbreak(shard->base.get());
+      },
+      &watched));
+  event_add(watched.watch.get(), nullptr);
 }
 
-void SyncProc::break_loop() const
+void SyncProc::unwatch_exit(Shard& shard, int pidfd)
 {
-  event_base_loopbreak(base_.get());
-}
\ No newline at end of file
+  shard.process_event.erase(pidfd);
+}
+
+void SyncProc::loop(Shard& shard)
+{
+  // break_loop() may have come before the loop
+  if (!stop_)
+    event_base_dispatch(shard.base.get());
+}
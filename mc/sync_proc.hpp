@@ -2,35 +2,162 @@
 #define SYNC_PROC_HPP
 
 #include "channel.hpp"
-#include <event2/event.h>
+#include "mpsc_queue.hpp"
+#include <assert.h>
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 #include <unordered_set>
 #include <list>
 #include <map>
+#include <unordered_map>
+#ifdef SIMGLD_EPOLL
+#include <sys/epoll.h>
+#else
+#include <event2/event.h>
+#endif
 
 using namespace std;
 
+// The event loops of mc: messages on the apps' channels, SIGCHLD and the
+// exits of the processes it watches. The engine is chosen at build time
+// (SIMGLD_EVENT_ENGINE): libevent, or edge-triggered epoll taking the
+// events in batches. Both call the same typed handlers.
+//
+// There are one or more shards, each a loop on its own thread: shard 0 runs
+// on the thread of start(), and watches SIGCHLD. An app goes to a shard by
+// its pid, or in turn when its pid is not known yet (a replica before it is
+// READY); the handlers of its channel and of its exit run on that thread.
+// Work for another shard goes through its MPSC queue (submit()).
 class SyncProc {
+public:
+  class Handler {
+  public:
+    virtual ~Handler() = default;
+    // Takes one message of the channel of `socket`; false once there are no more
+    virtual bool on_message(int socket) = 0;
+    // On shard 0, where the apps are traced from
+    virtual void on_sigchld() = 0;
+    // The process `pid`, watched by watch_process(), is over
+    virtual void on_process_exit(pid_t pid) = 0;
+  };
+
+  // What a shard did so far, read from any thread
+  struct Counters {
+    atomic<uint64_t> messages{0}; // taken by on_message()
+    atomic<uint64_t> events{0};   // channels, signals and exits the loop woke up for
+    atomic<uint64_t> tasks{0};    // submitted by the other threads
+  };
+
 private:
-  unique_ptr<event_base, decltype(&event_base_free)> base_{nullptr, &event_base_free};
-  vector<unique_ptr<event, decltype(&event_free)>> socket_event_;
+  struct Task : MpscQueue<Task>::Node {
+    function<void()> work;
+  };
+
+  struct Shard {
+    SyncProc* syncProc;
+    int index;
+    thread runner; // none for shard 0
+    unordered_map<int, unique_ptr<Channel>> channels; // written by the shard only
+    shared_mutex channelsMutex; // held to write channels, and by the other shards to read them
+    MpscQueue<Task> tasks;
+    int wakeFd = -1; // eventfd: tasks are queued, or the loops are to stop
+    Counters counters;
+#ifdef SIMGLD_EPOLL
+    int epoll = -1;
+    vector<epoll_event> events;
+#else
+    unique_ptr<event_base, decltype(&event_base_free)> base{nullptr, &event_base_free};
+    unique_ptr<event, decltype(&event_free)> wake_event{nullptr, &event_free};
+    vector<unique_ptr<event, decltype(&event_free)>> socket_event;
+    struct WatchedProcess {
+      Shard* shard;
+      pid_t pid;
+      unique_ptr<event, decltype(&event_free)> watch{nullptr, &event_free};
+    };
+    unordered_map<int, WatchedProcess> process_event; // by pidfd
+#endif
+    Shard(SyncProc* syncProc, int index);
+    ~Shard();
+  };
+
+#ifdef SIMGLD_EPOLL
+  // What an epoll event is about: the kind in the top bits of its data, then the pid, then the fd
+  enum Source : uint64_t { CHANNEL_SOURCE, SIGNAL_SOURCE, PROCESS_SOURCE, WAKE_SOURCE };
+  // 30 bits of pid: the kernel's pids stop at PID_MAX_LIMIT, 4M on 64 bits (linux/threads.h)
+  static constexpr uint64_t kPidMask = (1ULL << 30) - 1;
+  static_assert(kPidMask >= 4 * 1024 * 1024, "the pids of the kernel do not fit in an epoll tag");
+  static inline uint64_t tag(Source source, pid_t pid, int fd)
+  {
+    assert(pid >= 0 && (uint64_t)pid <= kPidMask && "pid does not fit in an epoll tag");
+    return (uint64_t)source << 62 | (uint64_t)pid << 32 | (uint32_t)fd;
+  }
+  int signalFd_ = -1;
+  static void watch(Shard& shard, int fd, uint32_t events, uint64_t data);
+#else
   unique_ptr<event, decltype(&event_free)> signal_event_{nullptr, &event_free};
+  static void on_event(evutil_socket_t fd, short what, void* arg);
+#endif
+  static thread_local Shard* current_; // the shard the thread serves
+  vector<unique_ptr<Shard>> shards_;
+  atomic<unsigned> nextShard_{0}; // for the channels of no known pid
+  atomic<bool> running_{false};   // the threads of the shards are there
+  atomic<bool> stop_{false};
+  int nextLink_     = kLinkBase;
+  Handler* handler_ = nullptr;
+  int batch_        = kDefaultBatch;
 
-  map<int, unique_ptr<Channel>> ch_hash;
+  // Engine side, on the thread of the shard (or before the loops run)
+  void watch_channel(Shard& shard, int socket);
+  void watch_exit(Shard& shard, int pidfd, pid_t pid);
+  void unwatch_exit(Shard& shard, int pidfd);
+  void watch_sigchld();
+  void loop(Shard& shard);
+
+  void serve(Shard& shard);
+  void run_tasks(Shard& shard);
+  void submit(Shard& shard, function<void()> work);
+  void run_on(Shard& shard, function<void()> work);
+  inline Shard& shard_of(pid_t pid) { return *shards_[(unsigned)pid % shards_.size()]; }
 
 public:
-  explicit SyncProc() = default;
+  static constexpr int kLinkBase     = 1 << 30; // ids of the links, above the file descriptors
+  static constexpr int kDefaultBatch = 64;      // events taken per epoll_wait()
+
+  explicit SyncProc(int shards = 1);
+  ~SyncProc();
 
   // No copy
   SyncProc(SyncProc const&) = delete;
   SyncProc& operator=(SyncProc const&) = delete;
   SyncProc& operator=(SyncProc&&) = delete;
 
-  void start(void (*handler)(int, short, void*), void *obj, list<int> sockets);
-  void dispatch() const;
-  void break_loop() const;
+  // Runs the loops until break_loop(), with `handler` for the events
+  void start(Handler& handler, list<int> sockets);
+  // Watches the channel of an app, on the shard of `pid` if it is known
+  void add_channel(int socket, pid_t pid = -1);
+  // Adds the channel of an app in our own process, which has no socket to watch; returns its id
+  int add_link(DirectLink* link);
+  // Tells the handler once the process `pid` of `pidfd` is over (the pidfd
+  // turns readable), until it is unwatched; the loop need not run yet
+  void watch_process(int pidfd, pid_t pid);
+  void unwatch_process(int pidfd, pid_t pid);
+  // Runs `work` on the thread of `shard`: right away from that thread or
+  // while no loop runs, through the queue of the shard otherwise
+  inline void run_on(int shard, function<void()> work) { run_on(*shards_[shard], std::move(work)); }
+  void dispatch();
+  // From any thread: every loop stops
+  void break_loop();
+  // Events taken at once by the epoll engine; libevent takes them all
+  inline void set_batch(int batch) { batch_ = batch > 0 ? batch : kDefaultBatch; }
 
-  inline const Channel& get_channel(int socket) { return *(ch_hash[socket].get());  }
+  inline int shards() const { return (int)shards_.size(); }
+  inline const Counters& counters(int shard) const { return shards_[shard]->counters; }
+  // From the shard of the channel, or while no loop runs
+  const Channel& get_channel(int socket);
 };
 
-#endif
\ No newline at end of file
+#endif
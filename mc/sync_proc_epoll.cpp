@@ -0,0 +1,114 @@
+#include "sync_proc.hpp"
+
+#include "global.hpp"
+#include <assert.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+// The epoll engine of SyncProc (SIMGLD_EVENT_ENGINE=epoll): each shard has
+// its epoll instance, the channels are watched edge-triggered and drained
+// on each event, SIGCHLD comes through a signalfd on shard 0, and
+// epoll_wait() takes up to batch_ events at a time into a buffer kept from
+// one call to the next.
+
+SyncProc::Shard::Shard(SyncProc* syncProc, int index) : syncProc(syncProc), index(index)
+{
+  epoll  = epoll_create1(EPOLL_CLOEXEC);
+  wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll == -1 || wakeFd == -1) {
+    DLOG(ERROR, "Could not create the loop of shard %d: %s\n", index, strerror(errno));
+    exit(-1);
+  }
+  watch(*this, wakeFd, EPOLLIN, tag(WAKE_SOURCE, 0, wakeFd));
+}
+
+SyncProc::Shard::~Shard()
+{
+  close(wakeFd);
+  close(epoll);
+  if (index == 0 && syncProc->signalFd_ != -1)
+    close(syncProc->signalFd_);
+}
+
+void SyncProc::watch(Shard& shard, int fd, uint32_t events, uint64_t data)
+{
+  epoll_event event{};
+  event.events   = events;
+  event.data.u64 = data;
+  if (epoll_ctl(shard.epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+    DLOG(ERROR, "Could not watch fd %d: %s\n", fd, strerror(errno));
+    exit(-1);
+  }
+}
+
+void SyncProc::watch_sigchld()
+{
+  // SIGCHLD is read from the signalfd only; the children we fork unblock it
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  signalFd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  assert(signalFd_ != -1 && "Could not create the signalfd");
+  watch(*shards_[0], signalFd_, EPOLLIN, tag(SIGNAL_SOURCE, 0, signalFd_));
+  // A child may have stopped before the signalfd was there: its SIGCHLD is gone, look for it once
+  handler_->on_sigchld();
+}
+
+void SyncProc::watch_channel(Shard& shard, int socket)
+{
+  watch(shard, socket, EPOLLIN | EPOLLET, tag(CHANNEL_SOURCE, 0, socket));
+}
+
+void SyncProc::watch_exit(Shard& shard, int pidfd, pid_t pid)
+{
+  watch(shard, pidfd, EPOLLIN, tag(PROCESS_SOURCE, pid, pidfd));
+}
+
+void SyncProc::unwatch_exit(Shard& shard, int pidfd)
+{
+  epoll_ctl(shard.epoll, EPOLL_CTL_DEL, pidfd, nullptr);
+}
+
+void SyncProc::loop(Shard& shard)
+{
+  auto& events = shard.events;
+  events.resize(batch_);
+  while (!stop_) {
+    int count = epoll_wait(shard.epoll, events.data(), events.size(), -1);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      DLOG(ERROR, "Could not wait for events: %s\n", strerror(errno));
+      exit(-1);
+    }
+    // The whole batch is handled even after break_loop(): an edge left behind would not come again
+    for (int i = 0; i < count; i++) {
+      auto data = events[i].data.u64;
+      auto fd   = (int)(uint32_t)data;
+      switch ((Source)(data >> 62)) {
+        case CHANNEL_SOURCE:
+          // Edge-triggered: no other event comes until the channel is empty
+          shard.counters.events++;
+          while (handler_->on_message(fd))
+            shard.counters.messages++;
+          break;
+        case SIGNAL_SOURCE: {
+          shard.counters.events++;
+          signalfd_siginfo info;
+          while (read(fd, &info, sizeof(info)) == sizeof(info))
+            ;
+          handler_->on_sigchld();
+        } break;
+        case PROCESS_SOURCE:
+          shard.counters.events++;
+          handler_->on_process_exit((pid_t)(data >> 32 & kPidMask));
+          break;
+        case WAKE_SOURCE:
+          run_tasks(shard);
+          break;
+      }
+    }
+  }
+}
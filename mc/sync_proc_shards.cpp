@@ -0,0 +1,143 @@
+#include "sync_proc.hpp"
+
+#include "global.hpp"
+#include <assert.h>
+#include <sys/eventfd.h>
+
+// The shards of SyncProc, whatever the engine: their threads, the work the
+// threads hand each other, and which shard has what.
+
+thread_local SyncProc::Shard* SyncProc::current_ = nullptr;
+
+SyncProc::SyncProc(int shards)
+{
+  for (int i = 0; i < max(shards, 1); i++)
+    shards_.push_back(make_unique<Shard>(this, i));
+}
+
+SyncProc::~SyncProc()
+{
+  for (auto& shard : shards_)
+    while (auto task = shard->tasks.pop())
+      delete task;
+}
+
+void SyncProc::start(Handler& handler, list<int> sockets)
+{
+  handler_ = &handler;
+  for (auto s : sockets)
+    add_channel(s);
+  // Before the threads are there: they inherit the signal mask of the epoll engine
+  watch_sigchld();
+  dispatch();
+}
+
+void SyncProc::dispatch()
+{
+  stop_    = false;
+  running_ = true;
+  for (size_t i = 1; i < shards_.size(); i++)
+    shards_[i]->runner = thread(&SyncProc::serve, this, ref(*shards_[i]));
+  serve(*shards_[0]);
+  for (size_t i = 1; i < shards_.size(); i++)
+    shards_[i]->runner.join();
+  running_ = false;
+}
+
+void SyncProc::serve(Shard& shard)
+{
+  current_ = &shard;
+  loop(shard);
+  current_ = nullptr;
+}
+
+void SyncProc::break_loop()
+{
+  stop_ = true;
+  // Ours sees stop_ once back from the handler
+  for (auto& shard : shards_)
+    if (shard.get() != current_)
+      eventfd_write(shard->wakeFd, 1);
+}
+
+// From another thread: the shard runs it once woken up
+void SyncProc::submit(Shard& shard, function<void()> work)
+{
+  shard.tasks.push(new Task{{}, std::move(work)});
+  eventfd_write(shard.wakeFd, 1);
+}
+
+void SyncProc::run_on(Shard& shard, function<void()> work)
+{
+  if (current_ == &shard || !running_)
+    work();
+  else
+    submit(shard, std::move(work));
+}
+
+// On the thread of the shard, once woken up
+void SyncProc::run_tasks(Shard& shard)
+{
+  eventfd_t count;
+  eventfd_read(shard.wakeFd, &count);
+  while (auto task = shard.tasks.pop()) {
+    task->work();
+    delete task;
+    shard.counters.tasks++;
+  }
+}
+
+void SyncProc::add_channel(int socket, pid_t pid)
+{
+  auto& shard = pid != -1 ? shard_of(pid) : *shards_[nextShard_++ % shards_.size()];
+  run_on(shard, [this, &shard, socket] {
+    {
+      unique_lock<shared_mutex> lock(shard.channelsMutex);
+      shard.channels.insert({socket, make_unique<Channel>(socket)});
+    }
+    watch_channel(shard, socket);
+  });
+}
+
+int SyncProc::add_link(DirectLink* link)
+{
+  auto id = nextLink_++;
+  run_on(*shards_[0], [this, id, link] {
+    unique_lock<shared_mutex> lock(shards_[0]->channelsMutex);
+    shards_[0]->channels.insert({id, make_unique<Channel>(link, true)});
+  });
+  return id;
+}
+
+void SyncProc::watch_process(int pidfd, pid_t pid)
+{
+  auto& shard = shard_of(pid);
+  run_on(shard, [this, &shard, pidfd, pid] { watch_exit(shard, pidfd, pid); });
+}
+
+void SyncProc::unwatch_process(int pidfd, pid_t pid)
+{
+  auto& shard = shard_of(pid);
+  run_on(shard, [this, &shard, pidfd] { unwatch_exit(shard, pidfd); });
+}
+
+const Channel& SyncProc::get_channel(int socket)
+{
+  // A shard reads its own channels unlocked as only it writes them
+  if (current_ != nullptr) {
+    auto& channels = current_->channels;
+    auto channel   = channels.find(socket);
+    if (channel != channels.end())
+      return *channel->second;
+  }
+  for (auto& shard : shards_) {
+    if (shard.get() == current_)
+      continue;
+    shared_lock<shared_mutex> lock(shard->channelsMutex);
+    auto channel = shard->channels.find(socket);
+    if (channel != shard->channels.end())
+      return *channel->second;
+  }
+  DLOG(ERROR, "No channel %d\n", socket);
+  exit(-1);
+}
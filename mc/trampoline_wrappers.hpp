@@ -2,24 +2,157 @@
 #define TRAMPOLINE_WRAPPERS_HPP
 
 #include "global.hpp"
+#include "heap.hpp"
+#include "mapping_registry.hpp"
 #include "switch_context.h"
+#include "upper_half_allocator.hpp"
 
 static unsigned long lhFsAddr;
+static MappingRegistry* upperHalfMappings;
+static UpperHalfAllocator* upperHalfSpace;
+static Heap* upperHalfHeap;
 
+// The wrappers run for every memory call of the upper half: no logging here,
+// only the call itself in the lower half, the counters and the registry.
+
+// Mappings placed by the kernel get their address from upperHalfSpace instead
 static void* mmapTrampoline(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-  // cout << "mmapTrampoline called ..." << endl;
-  // length    = ROUND_UP(length);
-  // void* ret = mmap(addr, length, prot, flags, fd, offset);
-  // return ret;
+  void* ret        = MAP_FAILED;
+  uintptr_t placed = 0;
+  length           = ROUND_UP(length);
+  bool fixed       = flags & (MAP_FIXED | MAP_FIXED_NOREPLACE);
+  JUMP_TO_LOWER_HALF(lhFsAddr);
+  // A range can be taken by a mapping we did not see: it stays claimed, try the next one
+  for (auto attempt = 0; attempt < 4 && addr == nullptr && !fixed && ret == MAP_FAILED; attempt++) {
+    placed = upperHalfSpace->allocate(length);
+    if (placed == 0)
+      break;
+    ret = mmap((void*)placed, length, prot, flags | MAP_FIXED_NOREPLACE, fd, offset);
+    if (ret == MAP_FAILED && errno != EEXIST) {
+      upperHalfSpace->release(placed, placed + length);
+      break;
+    }
+    if (ret != MAP_FAILED && (uintptr_t)ret != placed) // kernels before 4.17 take the flag as a hint
+      upperHalfSpace->release(placed, placed + length);
+  }
+  if (ret == MAP_FAILED) {
+    upperHalfSpace->fallbacks += addr == nullptr && !fixed;
+    ret = mmap(addr, length, prot, flags, fd, offset);
+  }
+  RETURN_TO_UPPER_HALF();
+  upperHalfMappings->count(MMAP_CALL, ret == MAP_FAILED);
+  if (ret != MAP_FAILED) {
+    upperHalfMappings->add((uintptr_t)ret, (uintptr_t)ret + length, prot, flags & ~(MAP_FIXED | MAP_FIXED_NOREPLACE));
+    if ((uintptr_t)ret != placed)
+      upperHalfSpace->claim((uintptr_t)ret, (uintptr_t)ret + length);
+  }
+  return ret;
+}
 
-  cout << "mmapTrampoline called ..." << endl;
+static int munmapTrampoline(void* addr, size_t length)
+{
+  int ret = -1;
+  JUMP_TO_LOWER_HALF(lhFsAddr);
+  ret = munmap(addr, length);
+  RETURN_TO_UPPER_HALF();
+  upperHalfMappings->count(MUNMAP_CALL, ret != 0);
+  if (ret == 0) {
+    upperHalfMappings->remove((uintptr_t)addr, (uintptr_t)addr + ROUND_UP(length));
+    upperHalfSpace->release((uintptr_t)addr, (uintptr_t)addr + ROUND_UP(length));
+  }
+  return ret;
+}
+
+static int mprotectTrampoline(void* addr, size_t length, int prot)
+{
+  int ret = -1;
+  JUMP_TO_LOWER_HALF(lhFsAddr);
+  ret = mprotect(addr, length, prot);
+  RETURN_TO_UPPER_HALF();
+  upperHalfMappings->count(MPROTECT_CALL, ret != 0);
+  if (ret == 0)
+    upperHalfMappings->protect((uintptr_t)addr, (uintptr_t)addr + ROUND_UP(length), prot);
+  return ret;
+}
+
+static void* mremapTrampoline(void* oldAddr, size_t oldLength, size_t newLength, int flags, void* newAddr)
+{
   void* ret = nullptr;
-  length    = ROUND_UP(length);
   JUMP_TO_LOWER_HALF(lhFsAddr);
-  ret = mmap(addr, length, prot, flags, fd, offset);
+  ret = mremap(oldAddr, oldLength, newLength, flags, newAddr);
   RETURN_TO_UPPER_HALF();
+  upperHalfMappings->count(MREMAP_CALL, ret == MAP_FAILED);
+  if (ret != MAP_FAILED) {
+    upperHalfMappings->remap((uintptr_t)oldAddr, ROUND_UP(oldLength), (uintptr_t)ret, ROUND_UP(newLength));
+    upperHalfSpace->release((uintptr_t)oldAddr, (uintptr_t)oldAddr + ROUND_UP(oldLength));
+    upperHalfSpace->claim((uintptr_t)ret, (uintptr_t)ret + ROUND_UP(newLength));
+  }
   return ret;
 }
 
-#endif
\ No newline at end of file
+// Updates the registry after the heap committed or dropped pages
+static void heapCommitted(uintptr_t committed)
+{
+  if (upperHalfHeap->committed_end() > committed)
+    upperHalfMappings->protect(committed, upperHalfHeap->committed_end(), PROT_READ | PROT_WRITE);
+  else if (upperHalfHeap->committed_end() < committed)
+    upperHalfMappings->protect(upperHalfHeap->committed_end(), committed, PROT_NONE);
+}
+
+// The break is the one of upperHalfHeap, not the process' one
+static void* sbrkTrampoline(intptr_t increment)
+{
+  // Within the committed pages the heap makes no syscall, so there is no need to switch halves
+  if (upperHalfHeap->moves_within(increment)) {
+    upperHalfMappings->count(SBRK_CALL, false);
+    return upperHalfHeap->sbrk(increment);
+  }
+
+  void* ret      = nullptr;
+  auto committed = upperHalfHeap->committed_end();
+  JUMP_TO_LOWER_HALF(lhFsAddr);
+  ret = upperHalfHeap->sbrk(increment);
+  RETURN_TO_UPPER_HALF();
+  upperHalfMappings->count(SBRK_CALL, ret == (void*)-1);
+  heapCommitted(committed);
+  return ret;
+}
+
+static int brkTrampoline(void* addr)
+{
+  if (addr == nullptr || upperHalfHeap->moves_within((intptr_t)addr - (intptr_t)upperHalfHeap->current_break())) {
+    upperHalfMappings->count(BRK_CALL, false);
+    return upperHalfHeap->brk(addr);
+  }
+
+  int ret        = -1;
+  auto committed = upperHalfHeap->committed_end();
+  JUMP_TO_LOWER_HALF(lhFsAddr);
+  ret = upperHalfHeap->brk(addr);
+  RETURN_TO_UPPER_HALF();
+  upperHalfMappings->count(BRK_CALL, ret != 0);
+  heapCommitted(committed);
+  return ret;
+}
+
+// What gets patched in ld.so: each call under its public name or, as ld.so
+// keeps most of them local, its internal one
+struct Interposition {
+  static constexpr size_t kNames = 2;
+  InterposedCall call;
+  const char* names[kNames];
+  void* wrapper;
+};
+
+static const Interposition interpositions[] = {
+    {MMAP_CALL, {"mmap", "__mmap"}, (void*)&mmapTrampoline},
+    {MUNMAP_CALL, {"munmap", "__munmap"}, (void*)&munmapTrampoline},
+    {MPROTECT_CALL, {"mprotect", "__mprotect"}, (void*)&mprotectTrampoline},
+    {MREMAP_CALL, {"mremap", "__mremap"}, (void*)&mremapTrampoline},
+    {BRK_CALL, {"brk", "__brk"}, (void*)&brkTrampoline},
+    {SBRK_CALL, {"sbrk", "__sbrk"}, (void*)&sbrkTrampoline},
+};
+static_assert(sizeof(interpositions) / sizeof(interpositions[0]) == INTERPOSED_CALLS, "an entry for each call");
+
+#endif
@@ -3,54 +3,6 @@
 #include <tuple>
 #include "global.hpp"
 
-void* UserSpace::reserve_mem_space(unsigned long relativeDistFromStack, unsigned long size) const
-{
-  Area area;
-  bool found = false;
-  int mapsfd = open("/proc/self/maps", O_RDONLY);
-  if (mapsfd < 0) {
-    DLOG(ERROR, "Failed to open proc maps\n");
-    return MAP_FAILED;
-  }
-  while (readMapsLine(mapsfd, &area)) {
-    if (strstr(area.name, "[stack]")) {
-      found = true;
-      break;
-    }
-  }
-  close(mapsfd);
-
-  void* startAddr = nullptr;
-  if (found)
-    startAddr = (VA)area.addr - relativeDistFromStack;
-
-  void* spaceAddr =
-      mmapWrapper(startAddr, size, PROT_READ | PROT_WRITE, /*MAP_GROWSDOWN |*/ MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (spaceAddr == MAP_FAILED) {
-    DLOG(ERROR, "Failed to mmap region: %s\n", strerror(errno));
-    return MAP_FAILED;
-  }
-
-  return startAddr;
-}
-
-void* UserSpace::get_stack_addr() const
-{
-  Area area;
-  bool found = false;
-  int mapsfd = open("/proc/self/maps", O_RDONLY);
-  if (mapsfd < 0) {
-    DLOG(ERROR, "Failed to open proc maps\n");
-    return nullptr;
-  }
-  while (readMapsLine(mapsfd, &area)) {
-    if (strstr(area.name, "[stack]"))
-      break;
-  }
-  close(mapsfd);
-  return (void*)area.addr;
-}
-
 void UserSpace::mmap_all_free_spaces()
 {
   std::vector<pair<void*, void*>> mmaps_range {}; // start and end of a range
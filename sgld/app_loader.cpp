@@ -1,4 +1,5 @@
 #include <asm/prctl.h> /* Definition of ARCH_* constants */
+#include <algorithm>
 #include <assert.h>
 #include <cstring>
 #include <fcntl.h>
@@ -7,6 +8,7 @@
 
 #include "app_loader.h"
 #include "global.hpp"
+#include "symbol_resolver.h"
 #include "trampoline.h"
 #include "trampoline_wrappers.hpp"
 
@@ -15,34 +17,14 @@ AppLoader::AppLoader()
   userSpace_ = make_unique<UserSpace>();
   stack_     = make_unique<Stack>();
   heap_      = make_unique<Heap>();
+  SwitchContext::init(StartupContext::get().hwcap2());
 }
 
-Elf64_Addr AppLoader::get_interpreter_entry(const char* ld_name)
-{
-  int rc;
-  char e_ident[EI_NIDENT];
-
-  int fd = open(ld_name, O_RDONLY);
-  assert(fd != -1);
-
-  rc = read(fd, e_ident, sizeof(e_ident));
-  assert(rc == sizeof(e_ident));
-  assert(strncmp(e_ident, ELFMAG, strlen(ELFMAG)) == 0);
-  assert(e_ident[EI_CLASS] == ELFCLASS64); // FIXME:  Add support for 32-bit ELF
-
-  // Reset fd to beginning and parse file header
-  lseek(fd, 0, SEEK_SET);
-  Elf64_Ehdr elf_hdr;
-  rc = read(fd, &elf_hdr, sizeof(elf_hdr));
-  assert(rc == sizeof(elf_hdr));
-  return elf_hdr.e_entry;
-}
-
-unsigned long AppLoader::loadSegment(void* startAddr, int fd, Elf64_Ehdr* ehdr, Elf64_Phdr* phdr)
+unsigned long AppLoader::loadSegment(void* startAddr, const ElfImage& image)
 {
   unsigned long minva, maxva;
-  Elf64_Phdr* iter;
-  ssize_t sz;
+  const Elf64_Ehdr* ehdr = image.ehdr();
+  const Elf64_Phdr *iter, *phdr = image.phdrs();
   int flags, dyn = ehdr->e_type == ET_DYN;
   unsigned char *p, *base;
 
@@ -66,135 +48,179 @@ unsigned long AppLoader::loadSegment(void* startAddr, int fd, Elf64_Ehdr* ehdr,
   flags = dyn ? 0 : MAP_FIXED;
   flags |= (MAP_PRIVATE | MAP_ANONYMOUS);
 
-  /* Check that we can hold the whole image. */
-  // base = (unsigned char*) mmap(hint, maxva - minva, PROT_NONE, flags, -1, 0);
+  /* Reserve the whole image; the segments are mapped over the reservation and
+     the gaps between them stay reserved, as ld.so does. */
   base = (unsigned char*)mmap(startAddr, maxva - minva, PROT_NONE, flags, -1, 0);
   if (base == (void*)-1)
     return -1;
-  munmap(base, maxva - minva);
-
-  // base = (unsigned char*) g_range->start;
 
-  flags = MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE;
-  // flags = MAP_FIXED | MAP_PRIVATE;
-  /* Now map each segment separately in precalculated address. */
+  /* Now map each segment separately in precalculated address, straight from the
+     file so that read-only pages are shared through the page cache. */
   for (iter = phdr; iter < &phdr[ehdr->e_phnum]; iter++) {
-    unsigned long off, start;
+    unsigned long off, start, fileEnd, zeroEnd, memEnd;
     if (iter->p_type != PT_LOAD)
       continue;
     off   = iter->p_vaddr & ALIGN;
-    start = dyn ? (unsigned long)base : 0; 
-
-    // cout << "first start: " << std::hex << start << endl;
-
-    // start = (unsigned long)g_range->start;
+    start = dyn ? (unsigned long)base : 0;
     start += TRUNC_PG(iter->p_vaddr);
-    sz = ROUND_PG(iter->p_memsz + off);
-    
-    p = (unsigned char*)mmap((void*)start, sz, PROT_WRITE, flags, -1, 0);
-    if (p == (void*)-1) {
-      munmap(base, maxva - minva);
-      return LOAD_ERR;
-    }
-    if (lseek(fd, iter->p_offset, SEEK_SET) < 0) {
-      munmap(base, maxva - minva);
-      return LOAD_ERR;
+    fileEnd = start + off + iter->p_filesz;
+    memEnd  = ROUND_PG(start + off + iter->p_memsz);
+    int prot = PFLAGS(iter->p_flags);
+
+    if (iter->p_filesz > 0) {
+      p = (unsigned char*)mmap((void*)start, ROUND_PG(off + iter->p_filesz), prot, MAP_FIXED | MAP_PRIVATE, image.fd(),
+                               iter->p_offset - off);
+      if (p == (void*)-1) {
+        munmap(base, maxva - minva);
+        return LOAD_ERR;
+      }
     }
-    if (read(fd, p + off, iter->p_filesz) != (ssize_t)iter->p_filesz) {
-      munmap(base, maxva - minva);
-      return LOAD_ERR;
+
+    if (iter->p_memsz > iter->p_filesz) {
+      /* bss: zero the tail of the last file page, map the rest anonymous */
+      zeroEnd = ROUND_PG(fileEnd);
+      if (iter->p_filesz > 0 && zeroEnd > fileEnd) {
+        if (!(prot & PROT_WRITE))
+          mprotect((void*)TRUNC_PG(fileEnd), PAGE_SIZE, prot | PROT_WRITE);
+        memset((void*)fileEnd, 0, zeroEnd - fileEnd);
+        if (!(prot & PROT_WRITE))
+          mprotect((void*)TRUNC_PG(fileEnd), PAGE_SIZE, prot);
+      }
+      if (iter->p_filesz == 0)
+        zeroEnd = start;
+      if (memEnd > zeroEnd) {
+        p = (unsigned char*)mmap((void*)zeroEnd, memEnd - zeroEnd, prot, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                                 0);
+        if (p == (void*)-1) {
+          munmap(base, maxva - minva);
+          return LOAD_ERR;
+        }
+      }
     }
-    mprotect(p, sz, PFLAGS(iter->p_flags));
   }
 
   return (unsigned long)base;
 }
 
-void* AppLoader::loadInterpreter(void* startAddr, const char* elf_interpreter, DynObjInfo& info)
+void* AppLoader::loadInterpreter(void* startAddr, const ElfImage& image, DynObjInfo& info)
 {
-  int ld_so_fd = open(elf_interpreter, O_RDONLY);
-  assert(ld_so_fd != -1);
-
-  char e_ident[EI_NIDENT];
-  int rc;
-
-  rc = read(ld_so_fd, e_ident, sizeof(e_ident));
-  assert(rc == sizeof(e_ident));
-  assert(strncmp(e_ident, ELFMAG, sizeof(ELFMAG) - 1) == 0);
-
-  // FIXME:  Add support for 32-bit ELF later
-  assert(e_ident[EI_CLASS] == ELFCLASS64);
-
-  // Reset fd to beginning and parse file header
-  lseek(ld_so_fd, 0, SEEK_SET);
-  Elf64_Ehdr elf_hdr;
-  rc = read(ld_so_fd, &elf_hdr, sizeof(elf_hdr));
-  assert(rc == sizeof(elf_hdr));
-
-  // Find ELF interpreter
-  int phoff = elf_hdr.e_phoff;
-  lseek(ld_so_fd, phoff, SEEK_SET);
+  unsigned long baseAddr = loadSegment(startAddr, image);
+  if (baseAddr == LOAD_ERR)
+    return NULL;
 
-  Elf64_Phdr* phdr;
-  Elf64_Ehdr* ehdr = &elf_hdr;
-  ssize_t sz       = ehdr->e_phnum * sizeof(Elf64_Phdr);
-  phdr             = (Elf64_Phdr*)alloca(sz);
-
-  if (read(ld_so_fd, phdr, sz) != sz)
-    DLOG(ERROR, "can't read program header");
-
-  unsigned long baseAddr = loadSegment(startAddr, ld_so_fd, ehdr, phdr);
-
-  info.set_phnum(elf_hdr.e_phnum);
-  info.set_phdr((VA)baseAddr + elf_hdr.e_phoff);
+  info.set_phnum(image.ehdr()->e_phnum);
+  info.set_phdr((VA)baseAddr + image.ehdr()->e_phoff);
   return (void*)baseAddr;
 }
 
 DynObjInfo AppLoader::load_lsdo(void* startAddr, const char* ld_name)
 {
-  Elf64_Addr cmd_entry = get_interpreter_entry(ld_name);
   DynObjInfo info;
-  auto baseAddr   = loadInterpreter(startAddr, ld_name, info);
-  auto entryPoint = (void*)((unsigned long)baseAddr + (unsigned long)cmd_entry);
+  info.set_base_addr(NULL);
+  info.set_entry_point(NULL);
+  auto image = ElfImage::open(ld_name);
+  if (!image)
+    return info;
+
+  auto baseAddr = loadInterpreter(startAddr, *image, info);
+  if (baseAddr == NULL)
+    return info;
+  auto entryPoint = (void*)((unsigned long)baseAddr + (unsigned long)image->ehdr()->e_entry);
   info.set_base_addr(baseAddr);
   info.set_entry_point(entryPoint);
+  info.set_mmap_addr(NULL);
+  info.set_sbrk_addr(NULL);
 
-  int ld_so_fd = open(ld_name, O_RDONLY);
-  unique_ptr<Trampoline> trampoline = make_unique<Trampoline>();
-  auto mmap_offset = trampoline->getSymbolOffset(ld_so_fd, ld_name, "mmap");
-  auto sbrk_offset = trampoline->getSymbolOffset(ld_so_fd, ld_name, "sbrk");
-  close(ld_so_fd);
+  return info;
+}
 
-  assert(mmap_offset && "retreived wrong value for mmap_offet in ldso");
-  assert(sbrk_offset && "retreived wrong value for sbrk_offet in ldso");
-  info.set_mmap_addr((void*)((unsigned long)baseAddr + (unsigned long)mmap_offset));
-  info.set_sbrk_addr ((void*)((unsigned long)baseAddr + (unsigned long)sbrk_offset));
+// Maps the first page of the window and copies the layout there, where the
+// AT_SIMGLD_LAYOUT entry of the new stack points
+bool AppLoader::mapLayout(const WindowLayout& layout) const
+{
+  auto page = reserveMemSpace((void*)layout.start, PAGE_SIZE);
+  if (page == MAP_FAILED) {
+    DLOG(ERROR, "Failed to map the layout page at %p: %s\n", (void*)layout.start, strerror(errno));
+    return false;
+  }
+  memcpy(page, &layout, sizeof(layout));
+  return true;
+}
 
-  return info;
+// Fills the registry with what the loader mapped in the window so far;
+// the wrappers keep it up to date from there
+void AppLoader::registerMappings(const WindowLayout& layout) const
+{
+  for (const auto& mapping : StartupContext::read_maps()) {
+    if (mapping.start >= layout.start && mapping.end <= layout.end)
+      upperHalfMappings->add(mapping.start, mapping.end, mapping.prot, mapping.flags);
+  }
+}
+
+// Patches the memory calls of ld.so to jump to the wrappers of
+// trampoline_wrappers.hpp; returns how many were patched
+int AppLoader::interposeMemoryCalls(DynObjInfo& ldso) const
+{
+  auto image = ElfImage::open(LD_NAME);
+  vector<string> names;
+  for (const auto& entry : interpositions)
+    names.insert(names.end(), begin(entry.names), end(entry.names));
+  auto offsets = image->symbols().lookup(names);
+
+  unique_ptr<Trampoline> trampoline = make_unique<Trampoline>();
+  int patched = 0;
+  for (auto i = 0; i < INTERPOSED_CALLS; i++) {
+    const auto& entry = interpositions[i];
+    // The first of its names ld.so has, else the last one's -1
+    auto found        = &offsets[Interposition::kNames * i];
+    auto offset       = *find_if(found, found + Interposition::kNames - 1, [](off_t o) { return o != -1; });
+    if (offset == -1) {
+      DLOG(INFO, "%s is not in the symbols of %s, calls to it are not interposed\n", entry.names[0], LD_NAME);
+      continue;
+    }
+    auto addr = (void*)((unsigned long)ldso.get_base_addr() + offset);
+    if (trampoline->insertTrampoline(addr, entry.wrapper) < 0) {
+      DLOG(ERROR, "Error inserting trampoline for %s. Exiting...\n", entry.names[0]);
+      exit(-1);
+    }
+    if (entry.call == MMAP_CALL)
+      ldso.set_mmap_addr(addr);
+    if (entry.call == SBRK_CALL)
+      ldso.set_sbrk_addr(addr);
+    patched++;
+  }
+  return patched;
 }
 
 // This function loads in ld.so, sets up a separate stack for it, and jumps
 // to the entry point of ld.so
-void AppLoader::runRtld(void* app_addr, vector<string> app_params, int socket_id)
+void AppLoader::runRtld(const WindowLayout& layout, vector<string> app_params, int socket_id)
 {
+  auto& context = StartupContext::get();
+  context.begin_phases();
+
+  if (!mapLayout(layout))
+    exit(-1);
   // Load RTLD (ld.so)
-  DynObjInfo ldso = load_lsdo(app_addr, (char*)LD_NAME);
+  auto ldsoAddr   = (void*)layout.ldso;
+  DynObjInfo ldso = load_lsdo(ldsoAddr, (char*)LD_NAME);
+  context.end_phase("load ld.so");
+  stampLaunch(LOAD_LSDO_PHASE);
 
-  // if (syscall(SYS_arch_prctl, ARCH_GET_FS, &lhFsAddr) < 0) {
-  //   DLOG(ERROR, "Could not retrieve lower half's fs. Error: %s. Exiting...\n", strerror(errno));
-  //   return;
-  // }
+  lhFsAddr = SwitchContext::get_fs();
 
   if (ldso.get_base_addr() == NULL || ldso.get_entry_point() == NULL) {
     DLOG(ERROR, "Error loading the runtime loader (%s). Exiting...\n", (char*)LD_NAME);
     return;
   }
-  cout << "mc, requested ldso addr: " << std::hex << app_addr << " # real ldso addr: " << 
+  cout << "mc, requested ldso addr: " << std::hex << ldsoAddr << " # real ldso addr: " << 
      std::hex << ldso.get_base_addr() << endl;
 
   // Create new stack region to be used by RTLD
-  auto stackStartAddr = (void*)((unsigned long)app_addr + GB1);
-  void* newStack = stack_->createNewStack(ldso, stackStartAddr, app_params, socket_id);
+  auto stackStartAddr = (void*)layout.stack;
+  void* newStack = stack_->createNewStack(ldso, layout, app_params, socket_id);
+  context.end_phase("stack");
+  stampLaunch(STACK_PHASE);
   cout << "mc, requested stack addr: " << std::hex << stackStartAddr << " # real stack addr: " <<
     std::hex << newStack << endl;
   if (!newStack) {
@@ -203,8 +229,10 @@ void AppLoader::runRtld(void* app_addr, vector<string> app_params, int socket_id
   }
 
   // Create new heap region to be used by RTLD
-  void* heapStartAddr = (void*)((unsigned long)app_addr + MB1500);
-  void* newHeap = heap_->createNewHeap(heapStartAddr);
+  void* heapStartAddr = (void*)layout.heap;
+  void* newHeap = heap_->createNewHeap(heapStartAddr, layout.heapSize, heapHugePages_);
+  context.end_phase("heap");
+  stampLaunch(HEAP_PHASE);
   cout << "mc, requested heap addr: " << std::hex << heapStartAddr << " # real heap addr: " <<
     std::hex << newHeap << endl;
   if (!newHeap) {
@@ -212,28 +240,38 @@ void AppLoader::runRtld(void* app_addr, vector<string> app_params, int socket_id
     exit(-1);
   }
 
-  write_mmapped_ranges("app-before_jump-runRtld()", getpid());
+  context.write_maps("app-before_jump-runRtld()");
 
-  // insert a trampoline from ldso mmap address to mmapWrapper
-  unique_ptr<Trampoline> trampoline = make_unique<Trampoline>();
-  // auto rc = trampoline->insertTrampoline(ldso.get_mmap_addr(), (void *)&mmapTrampoline);
-  // if (rc < 0) {
-  //   DLOG(ERROR, "Error inserting trampoline for mmap. Exiting...\n");
-  //   exit(-1);
-  // }
-
-  // // insert a trampoline from ldso sbrk address to sbrkWrapper
-  // rc = trampoline->insertTrampoline(ldso.sbrkAddr, (void *)&sbrkWrapper);
-  // if (rc < 0) {
-  //   DLOG(ERROR, "Error inserting trampoline for sbrk. Exiting...\n");
-  //   exit(-1);
-  // }
+  // Route the memory calls of ld.so through the wrappers, which track them in the registry
+  upperHalfMappings = MappingRegistry::create((void*)layout.registry);
+  if (upperHalfMappings == nullptr) {
+    DLOG(ERROR, "Error mapping the upper half mapping registry: %s. Exiting...\n", strerror(errno));
+    exit(-1);
+  }
+  registerMappings(layout);
+  // and place the mappings left to the kernel in the free parts of the window
+  upperHalfSpace = UpperHalfAllocator::create(layout, *upperHalfMappings);
+  if (upperHalfSpace == nullptr) {
+    DLOG(ERROR, "Error mapping the upper half allocator: %s. Exiting...\n", strerror(errno));
+    exit(-1);
+  }
+  upperHalfMappings->add((uintptr_t)upperHalfSpace, (uintptr_t)upperHalfSpace + UpperHalfAllocator::size(),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+  // and serve sbrk and brk from the RTLD heap
+  upperHalfHeap           = heap_.get();
+  upperHalfMappings->heap = &heap_->stats();
+  context.end_phase("registry");
+  interposeMemoryCalls(ldso);
+  context.end_phase("interpose");
+  context.report_phases("app");
 
   cout << "app-before_jump-runRtld()" << endl;
 
   // Pointer to the ld.so entry point
   void* ldso_entrypoint = ldso.get_entry_point();
   
+  stampLaunch(JUMP_PHASE);
+
   // Change the stack pointer to point to the new stack and jump into ld.so
   asm volatile(CLEAN_FOR_64_BIT(mov %0, %%esp;) : : "g"(newStack) : "memory");
   asm volatile("jmp *%0" : : "g"(ldso_entrypoint) : "memory");
@@ -242,18 +280,39 @@ void AppLoader::runRtld(void* app_addr, vector<string> app_params, int socket_id
   exit(-1);
 }
 
-void AppLoader::runRtld(void* mcAddr, void* appAddr)
+// Loads ld.so and builds its stack in the window `layout` of this very
+// process, for an app that runs beside mc and talks to it over `link`: the
+// first resume of the link jumps into ld.so. The memory calls of ld.so are
+// not interposed, as the wrappers serve a single upper half per process.
+bool AppLoader::loadRtld(const WindowLayout& layout, vector<string> app_params, DirectLink& link)
+{
+  if (!mapLayout(layout))
+    return false;
+  DynObjInfo ldso = load_lsdo((void*)layout.ldso, (char*)LD_NAME);
+  if (ldso.get_base_addr() == NULL || ldso.get_entry_point() == NULL) {
+    DLOG(ERROR, "Error loading the runtime loader (%s)\n", (char*)LD_NAME);
+    return false;
+  }
+  void* newStack = stack_->createNewStack(ldso, layout, app_params, -1);
+  if (!newStack) {
+    DLOG(ERROR, "Error creating new stack for RTLD\n");
+    return false;
+  }
+  link.enter((uintptr_t)newStack, (uintptr_t)ldso.get_entry_point());
+  return true;
+}
+
+void AppLoader::runRtld(const WindowLayout& layout)
 {
-  auto varSize = PAGE_SIZE;
-  auto writeAddr = reserveMemSpace(mcAddr, varSize);
-  char strAddr[32];
-  strcpy(strAddr, to_string((unsigned long)appAddr).c_str());
-  memcpy(writeAddr, (void*)strAddr, strlen(strAddr)+1); // copy '\0' too
+  auto& context = StartupContext::get();
+  context.begin_phases();
 
-  int rc         = -1;
+  if (!mapLayout(layout))
+    exit(-1);
   // Load RTLD (ld.so)
-  void* ldsoAddr      = (void*)((unsigned long)mcAddr + varSize);
+  auto ldsoAddr   = (void*)layout.ldso;
   DynObjInfo ldso = load_lsdo(ldsoAddr, (char*)LD_NAME);
+  context.end_phase("load ld.so");
 
   if (ldso.get_base_addr() == NULL || ldso.get_entry_point() == NULL) {
     DLOG(ERROR, "Error loading the runtime loader (%s). Exiting...\n", (char*)LD_NAME);
@@ -263,8 +322,9 @@ void AppLoader::runRtld(void* mcAddr, void* appAddr)
      std::hex << ldso.get_base_addr() << endl;
 
   // Create new stack region to be used by RTLD
-  auto stackStartAddr = (void*)((unsigned long)mcAddr + GB1);
-  void* newStack = stack_->createNewStack(ldso, stackStartAddr);
+  auto stackStartAddr = (void*)layout.stack;
+  void* newStack = stack_->createNewStack(ldso, layout);
+  context.end_phase("stack");
   cout << "simgld, requested stack addr: " << std::hex << stackStartAddr << " # real stack addr: " <<
     std::hex << newStack << endl;
   if (!newStack) {
@@ -273,8 +333,9 @@ void AppLoader::runRtld(void* mcAddr, void* appAddr)
   }
 
   // Create new heap region to be used by RTLD
-  void* heapStartAddr = (void*)((unsigned long)mcAddr + MB1500);
-  void* newHeap = heap_->createNewHeap(heapStartAddr);
+  void* heapStartAddr = (void*)layout.heap;
+  void* newHeap = heap_->createNewHeap(heapStartAddr, layout.heapSize);
+  context.end_phase("heap");
   cout << "simgld, requested heap addr: " << std::hex << heapStartAddr << " # real heap addr: " <<
     std::hex << newHeap << endl;
   if (!newHeap) {
@@ -282,7 +343,8 @@ void AppLoader::runRtld(void* mcAddr, void* appAddr)
     exit(-1);
   }
 
-  write_mmapped_ranges("simgld-before_jump-runRtld()", getpid());
+  context.write_maps("simgld-before_jump-runRtld()");
+  context.report_phases("simgld");
 
   // Pointer to the ld.so entry point
   void* ldso_entrypoint = ldso.get_entry_point();
@@ -1,3 +1,4 @@
+#include "address_planner.h"
 #include "app_loader.h"
 
 using namespace std;
@@ -35,27 +36,17 @@ int main(int argc, char** argv, char** env)
   // while(*argv++ != nullptr)
   //   cout << *argv << endl;
 
-  unique_ptr<AppLoader> appLoader = make_unique<AppLoader>();
-  auto mcAddr              = appLoader->reserveMemSpace(MB5500, GB2);
-  auto appAddr                   = appLoader->reserveMemSpace(GB3, GB2);
-  if (appAddr == MAP_FAILED || mcAddr == MAP_FAILED) {
-    DLOG(ERROR, "main.cpp->main(), MAP_FAILED\n");
-    return -1;
-  }
-  cout << "main.cpp->main(), mcAddr: " << std::hex << mcAddr << endl;
-  cout << "main.cpp->main(), appAddr: " << std::hex << appAddr << endl;  
-  int ret = appLoader->releaseMemSpace(appAddr, GB2);
-  if (ret < 0) {
-    DLOG(ERROR, "main.cpp->main()-appAddr release, %s\n", strerror(errno));
+  // mc runs in a window of its own; it plans the ones of its apps itself
+  AddressPlanner planner(StartupContext::get());
+  WindowLayout mcLayout;
+  if (!planner.plan(AddressPlanner::Budget {}, {}, mcLayout)) {
+    DLOG(ERROR, "main.cpp->main(), no room for the window of mc\n");
     return -1;
   }
-  ret = appLoader->releaseMemSpace(mcAddr, GB2);
-  if (ret < 0) {
-    DLOG(ERROR, "main.cpp->main()-lowerHaldAddr release, %s\n", strerror(errno));
-    return -1;
-  }
-  write_mmapped_ranges("simgld-after_releaseMemSpace_main()", getpid());
+  cout << "main.cpp->main(), mc window: " << std::hex << (void*)mcLayout.start << "-" << (void*)mcLayout.end << endl;
+  StartupContext::get().write_maps("simgld-after_plan_main()");
 
-  appLoader->runRtld(mcAddr, appAddr);
+  unique_ptr<AppLoader> appLoader = make_unique<AppLoader>();
+  appLoader->runRtld(mcLayout);
   return 0;
 }
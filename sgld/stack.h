@@ -3,28 +3,22 @@
 
 #include "global.hpp"
 #include "dyn_obj_info.hpp"
+#include "startup_context.h"
+#include "window_layout.hpp"
 
 using namespace std;
 
 class Stack {
 private:
-  void getProcStatField(enum Procstat_t type, char* out, size_t len);
-  void getStackRegion(Area* stack);
-  void* getArgcAddr(const void* stackEnd) const;
-  void* getArgvAddr(const void* stackEnd) const;
-  void* getEnvAddr(char** argv, int argc) const;
-  ElfW(auxv_t) * getAuxvAddr(const char** env) const;
   void patchAuxv(ElfW(auxv_t) * av, unsigned long phnum, unsigned long phdr, unsigned long entry) const;
-  void* deepCopyStack(void* newStack, const void* origStack, size_t len, const void* newStackEnd,
-                           const void* origStackEnd, const DynObjInfo& info, vector<string> app_params,
-                           int socket_id) const;
-  void* deepCopyStack(void* newStack, const void* origStack, size_t len, const void* newStackEnd,
-                           const void* origStackEnd, const DynObjInfo& info) const;
+  void* buildStack(void* stackBottom, void* stackTop, const StartupContext& context, const vector<const char*>& argv,
+                   const DynObjInfo& info, const WindowLayout& layout) const;
+  void* createNewStack(const DynObjInfo& info, const WindowLayout& layout, const vector<const char*>& argv);
 
 public:
   explicit Stack();
-  void* createNewStack(const DynObjInfo& info, void* stackStartAddr, vector<string> app_params, int socket_id);
-  void* createNewStack(const DynObjInfo& info, void* stackStartAddr);
+  void* createNewStack(const DynObjInfo& info, const WindowLayout& layout, vector<string> app_params, int socket_id);
+  void* createNewStack(const DynObjInfo& info, const WindowLayout& layout);
 };
 
 #endif
\ No newline at end of file
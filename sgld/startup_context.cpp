@@ -0,0 +1,147 @@
+#include "startup_context.h"
+#include <fcntl.h>
+#include <sys/auxv.h>
+#include <sys/prctl.h>
+
+#ifndef PR_GET_AUXV
+#define PR_GET_AUXV 0x41555856 // Linux 6.4
+#endif
+
+extern "C" void* __libc_stack_end;
+
+StartupContext& StartupContext::get()
+{
+  static StartupContext context;
+  return context;
+}
+
+StartupContext::StartupContext()
+{
+  auto start = Clock::now();
+
+  // The stack the kernel (or the loader that started us) set up: argc, argv, NULL, envp, NULL, auxv.
+  // __libc_stack_end is the address of argc, or a word below it in static binaries
+  auto sp = (char**)__libc_stack_end;
+  for (auto i = 0; i < 4 && sp[1] != program_invocation_name; i++)
+    sp++;
+  if (sp[1] != program_invocation_name) {
+    DLOG(ERROR, "Could not find argc on the initial stack (__libc_stack_end = %p)\n", __libc_stack_end);
+    exit(-1);
+  }
+  initialSp_ = sp;
+  argc_      = *(int*)initialSp_;
+  argv_      = (char**)initialSp_ + 1;
+  envp_      = argv_ + argc_ + 1;
+  read_auxv();
+  pageSize_ = getauxval(AT_PAGESZ);
+  hwcap2_   = getauxval(AT_HWCAP2);
+  execfn_   = (const char*)getauxval(AT_EXECFN);
+  maps_ = read_maps(&mapsLines_);
+  for (const auto& mapping : maps_)
+    if (mapping.name == "[stack]")
+      stack_ = mapping;
+  logMaps_ = getenv("SIMGLD_LOG_MAPS") != nullptr;
+
+  probeNs_    = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+  phaseStart_ = Clock::now();
+}
+
+void StartupContext::read_auxv()
+{
+  auxv_.resize(64);
+  for (;;) {
+    auto bytes = prctl(PR_GET_AUXV, auxv_.data(), auxv_.size() * sizeof(ElfW(auxv_t)), 0, 0);
+    if (bytes <= 0)
+      break;
+    auto count = bytes / sizeof(ElfW(auxv_t));
+    if (count <= auxv_.size()) {
+      auxv_.resize(count);
+      auxvFromKernel_ = true;
+      return;
+    }
+    auxv_.resize(count);
+  }
+
+  // Before Linux 6.4: the aux vector follows the environment on the original stack
+  auto entry = (ElfW(auxv_t)*)envp_;
+  while (*(char**)entry != nullptr)
+    entry = (ElfW(auxv_t)*)((char**)entry + 1);
+  entry = (ElfW(auxv_t)*)((char**)entry + 1);
+  auxv_.clear();
+  do
+    auxv_.push_back(*entry);
+  while ((entry++)->a_type != AT_NULL);
+}
+
+unsigned long StartupContext::aux(unsigned long type) const
+{
+  for (const auto& entry : auxv_)
+    if (entry.a_type == type)
+      return entry.a_un.a_val;
+  return 0;
+}
+
+vector<StartupContext::Mapping> StartupContext::read_maps(vector<string>* lines)
+{
+  vector<Mapping> maps;
+  int mapsfd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (mapsfd < 0) {
+    DLOG(ERROR, "Failed to open proc maps: %s\n", strerror(errno));
+    return maps;
+  }
+  string text;
+  char buffer[16384];
+  ssize_t bytes;
+  while ((bytes = read(mapsfd, buffer, sizeof buffer)) > 0)
+    text.append(buffer, bytes);
+  close(mapsfd);
+
+  for (size_t begin = 0, end; begin < text.size(); begin = end + 1) {
+    end = text.find('\n', begin);
+    if (end == string::npos)
+      end = text.size();
+    text[end] = '\0';
+    const char* line = &text[begin];
+    if (lines != nullptr)
+      lines->emplace_back(line, end - begin);
+
+    Mapping mapping {};
+    char perms[5] = {0};
+    int nameAt    = 0;
+    if (sscanf(line, "%lx-%lx %4s %*x %*x:%*x %*u %n", &mapping.start, &mapping.end, perms, &nameAt) < 3)
+      continue;
+    mapping.prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) |
+                   (perms[2] == 'x' ? PROT_EXEC : 0);
+    if (nameAt > 0)
+      mapping.name = line + nameAt;
+    mapping.flags = (perms[3] == 's' ? MAP_SHARED : MAP_PRIVATE) | (mapping.name.empty() ? MAP_ANONYMOUS : 0);
+    maps.push_back(move(mapping));
+  }
+  return maps;
+}
+
+void StartupContext::begin_phases()
+{
+  phases_.clear();
+  phaseStart_ = Clock::now();
+}
+
+void StartupContext::end_phase(const char* name)
+{
+  auto now = Clock::now();
+  phases_.emplace_back(name, chrono::duration_cast<chrono::nanoseconds>(now - phaseStart_).count());
+  phaseStart_ = now;
+}
+
+void StartupContext::report_phases(const char* who) const
+{
+  stringstream ss;
+  uint64_t total = probeNs_;
+  ss << "probe " << probeNs_ / 1000 << " us";
+  for (const auto& phase : phases_) {
+    ss << ", " << phase.first << " " << phase.second / 1000 << " us";
+    total += phase.second;
+  }
+  DLOG(INFO, "%s %d: startup phases (auxv from %s, %zu mappings): %s; total %lu us\n", who, getpid(),
+       auxvFromKernel_ ? "prctl" : "the stack", maps_.size(), ss.str().c_str(), (unsigned long)(total / 1000));
+}
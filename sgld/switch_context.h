@@ -15,8 +15,15 @@
 //   }
 // The idea is to leverage the C++ language semantics to help us automatically
 // restore the context when the object goes out of scope.
+//
+// The FS of the caller is read from its TCB, whose first word points to
+// itself (glibc keeps it there for every thread), so the switch does not
+// ask the kernel for it. The FS is written with wrfsbase when the kernel
+// lets user space use it (HWCAP2_FSGSBASE, see init()), and with
+// arch_prctl(ARCH_SET_FS) otherwise.
 class SwitchContext {
 private:
+  static bool fsgsbase_;
   unsigned long upperHalfFs;
   unsigned long lowerHalfFs;
   int jumped;
@@ -24,6 +31,19 @@ private:
 public:
   explicit SwitchContext(unsigned long);
   ~SwitchContext();
+
+  // Picks wrfsbase if `hwcap2` (AT_HWCAP2) has HWCAP2_FSGSBASE; until then, and
+  // if `allowed` is false, the switches make syscalls
+  static void init(unsigned long hwcap2, bool allowed = true);
+  static inline bool fsgsbase() { return fsgsbase_; }
+
+  static inline unsigned long get_fs()
+  {
+    unsigned long fs;
+    asm volatile("mov %%fs:0, %0" : "=r"(fs));
+    return fs;
+  }
+  static void set_fs(unsigned long fs);
 };
 
 // Helper macro to be used whenever making a jump from the upper half to
@@ -0,0 +1,193 @@
+#include "symbol_resolver.h"
+#include "elf_image.h"
+#include "global.hpp"
+
+namespace {
+uint32_t gnu_hash(const char* name)
+{
+  uint32_t h = 5381;
+  for (auto c = (const unsigned char*)name; *c != '\0'; c++)
+    h = h * 33 + *c;
+  return h;
+}
+
+uint32_t sysv_hash(const char* name)
+{
+  uint32_t h = 0, g;
+  for (auto c = (const unsigned char*)name; *c != '\0'; c++) {
+    h = (h << 4) + *c;
+    g = h & 0xf0000000;
+    if (g != 0)
+      h ^= g >> 24;
+    h &= ~g;
+  }
+  return h;
+}
+} // namespace
+
+SymbolResolver::SymbolResolver(const ElfImage& image) : image_(image)
+{
+  find_hash_tables();
+}
+
+// Both tables index the dynamic symbols their section links to
+void SymbolResolver::find_hash_tables()
+{
+  auto shdrs = image_.shdrs();
+  auto data  = image_.data();
+  auto fits  = [&](const Elf64_Shdr& s, uint64_t size) {
+    return s.sh_offset <= image_.size() && size <= s.sh_size && s.sh_size <= image_.size() - s.sh_offset;
+  };
+
+  for (auto i = 0; i < image_.shnum(); i++) {
+    const auto& section = shdrs[i];
+    if ((section.sh_type != SHT_GNU_HASH && section.sh_type != SHT_HASH) || section.sh_link >= (uint32_t)image_.shnum())
+      continue;
+    const auto& symbols = shdrs[section.sh_link];
+    if (symbols.sh_link >= (uint32_t)image_.shnum())
+      continue;
+    const auto& strings = shdrs[symbols.sh_link];
+    if (!fits(symbols, 0) || !fits(strings, 0))
+      continue;
+    auto words = (const uint32_t*)(data + section.sh_offset);
+
+    if (section.sh_type == SHT_GNU_HASH) {
+      if (!fits(section, 4 * sizeof(uint32_t)))
+        continue;
+      auto header = 4 * sizeof(uint32_t) + (uint64_t)words[2] * sizeof(uint64_t) + (uint64_t)words[0] * sizeof(uint32_t);
+      if (words[2] == 0 || !fits(section, header))
+        continue;
+      gnuBucketCount_ = words[0];
+      gnuSymOffset_   = words[1];
+      gnuBloomSize_   = words[2];
+      gnuBloomShift_  = words[3];
+      gnuBloom_       = (const uint64_t*)(words + 4);
+      gnuBuckets_     = (const uint32_t*)(gnuBloom_ + gnuBloomSize_);
+      gnuChain_       = gnuBuckets_ + gnuBucketCount_;
+    } else {
+      if (!fits(section, 2 * sizeof(uint32_t)) ||
+          !fits(section, (2 + (uint64_t)words[0] + words[1]) * sizeof(uint32_t)))
+        continue;
+      sysvBucketCount_ = words[0];
+      sysvChainCount_  = words[1];
+      sysvBuckets_     = words + 2;
+      sysvChain_       = sysvBuckets_ + sysvBucketCount_;
+    }
+    dynsym_      = (const Elf64_Sym*)(data + symbols.sh_offset);
+    dynsymCount_ = symbols.sh_size / sizeof(Elf64_Sym);
+    dynstr_      = data + strings.sh_offset;
+    dynstrSize_  = strings.sh_size;
+  }
+}
+
+bool SymbolResolver::dynamic_matches(const Elf64_Sym& sym, const char* name) const
+{
+  return sym.st_shndx != SHN_UNDEF && sym.st_name < dynstrSize_ && strcmp(dynstr_ + sym.st_name, name) == 0;
+}
+
+const Elf64_Sym* SymbolResolver::lookup_gnu_hash(const char* name) const
+{
+  auto h1   = gnu_hash(name);
+  auto word = gnuBloom_[(h1 / 64) % gnuBloomSize_];
+  auto mask = (1ULL << (h1 % 64)) | (1ULL << ((h1 >> gnuBloomShift_) % 64));
+  if ((word & mask) != mask || gnuBucketCount_ == 0)
+    return nullptr;
+
+  auto index = gnuBuckets_[h1 % gnuBucketCount_];
+  if (index < gnuSymOffset_)
+    return nullptr;
+  // The chain of a bucket ends at the first hash with its low bit set
+  for (; index < dynsymCount_; index++) {
+    auto h2 = gnuChain_[index - gnuSymOffset_];
+    if ((h1 | 1) == (h2 | 1) && dynamic_matches(dynsym_[index], name))
+      return &dynsym_[index];
+    if (h2 & 1)
+      break;
+  }
+  return nullptr;
+}
+
+const Elf64_Sym* SymbolResolver::lookup_sysv_hash(const char* name) const
+{
+  if (sysvBucketCount_ == 0)
+    return nullptr;
+  // Bounded by the chain count so that a corrupted chain cannot loop
+  auto steps = sysvChainCount_;
+  for (auto index = sysvBuckets_[sysv_hash(name) % sysvBucketCount_];
+       index != STN_UNDEF && index < sysvChainCount_ && index < dynsymCount_ && steps-- > 0; index = sysvChain_[index])
+    if (dynamic_matches(dynsym_[index], name))
+      return &dynsym_[index];
+  return nullptr;
+}
+
+const Elf64_Sym* SymbolResolver::lookup_dynamic(const char* name) const
+{
+  if (gnuBuckets_ != nullptr)
+    return lookup_gnu_hash(name);
+  if (sysvBuckets_ != nullptr)
+    return lookup_sysv_hash(name);
+  return nullptr;
+}
+
+void SymbolResolver::build_index() const
+{
+  index_.reserve(image_.symbol_count());
+  for (size_t i = 0; i < image_.symbol_count(); i++) {
+    const auto& sym = image_.symtab()[i];
+    if (sym.st_shndx != SHN_UNDEF && sym.st_name != 0)
+      index_.emplace(image_.symbol_name(sym), sym.st_value);
+  }
+  indexed_ = true;
+}
+
+off_t SymbolResolver::lookup(const string& name) const
+{
+  if (auto sym = lookup_dynamic(name.c_str()))
+    return sym->st_value;
+  // A miss in the hash table is final when the table indexes the whole symbol table
+  if (image_.symtab() == nullptr || (has_hash_table() && image_.symtab() == dynsym_))
+    return -1;
+
+  if (!indexed_)
+    build_index();
+  auto it = index_.find(name);
+  return it == index_.end() ? -1 : (off_t)it->second;
+}
+
+vector<off_t> SymbolResolver::lookup(const vector<string>& names) const
+{
+  vector<off_t> offsets(names.size(), -1);
+  unordered_map<string_view, vector<size_t>> missing;
+  for (size_t i = 0; i < names.size(); i++) {
+    if (auto sym = lookup_dynamic(names[i].c_str()))
+      offsets[i] = sym->st_value;
+    else
+      missing[names[i]].push_back(i);
+  }
+  if (missing.empty() || image_.symtab() == nullptr || (has_hash_table() && image_.symtab() == dynsym_))
+    return offsets;
+
+  if (indexed_) {
+    for (auto& entry : missing) {
+      auto it = index_.find(entry.first);
+      if (it != index_.end())
+        for (auto i : entry.second)
+          offsets[i] = it->second;
+    }
+    return offsets;
+  }
+
+  // Without an index, one scan of the symbol table serves all the remaining names
+  for (size_t s = 0; s < image_.symbol_count() && !missing.empty(); s++) {
+    const auto& sym = image_.symtab()[s];
+    if (sym.st_shndx == SHN_UNDEF || sym.st_name == 0)
+      continue;
+    auto it = missing.find(image_.symbol_name(sym));
+    if (it == missing.end())
+      continue;
+    for (auto i : it->second)
+      offsets[i] = sym.st_value;
+    missing.erase(it);
+  }
+  return offsets;
+}
@@ -0,0 +1,67 @@
+#ifndef SYMBOL_RESOLVER_H
+#define SYMBOL_RESOLVER_H
+
+#include <elf.h>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+class ElfImage;
+
+// Symbol lookup over an ElfImage. Dynamic symbols are found through the
+// file's own .gnu.hash (or SysV .hash) table; anything else (or every symbol,
+// when the file has no hash table) goes through an index over the symbol
+// table built on first use. Offsets are relative to the load base, -1 when
+// the symbol is not defined.
+class SymbolResolver {
+private:
+  const ElfImage& image_;
+
+  // .gnu.hash
+  const uint32_t* gnuBuckets_ = nullptr;
+  const uint32_t* gnuChain_   = nullptr;
+  const uint64_t* gnuBloom_   = nullptr;
+  uint32_t gnuBucketCount_    = 0;
+  uint32_t gnuSymOffset_      = 0;
+  uint32_t gnuBloomSize_      = 0;
+  uint32_t gnuBloomShift_     = 0;
+  // .hash
+  const uint32_t* sysvBuckets_ = nullptr;
+  const uint32_t* sysvChain_   = nullptr;
+  uint32_t sysvBucketCount_    = 0;
+  uint32_t sysvChainCount_     = 0;
+  // the symbols and strings both hash tables index
+  const Elf64_Sym* dynsym_ = nullptr;
+  const char* dynstr_      = nullptr;
+  size_t dynsymCount_      = 0;
+  size_t dynstrSize_       = 0;
+
+  mutable unordered_map<string_view, Elf64_Addr> index_;
+  mutable bool indexed_ = false;
+
+  void find_hash_tables();
+  const Elf64_Sym* lookup_gnu_hash(const char* name) const;
+  const Elf64_Sym* lookup_sysv_hash(const char* name) const;
+  const Elf64_Sym* lookup_dynamic(const char* name) const;
+  bool dynamic_matches(const Elf64_Sym& sym, const char* name) const;
+  void build_index() const;
+
+public:
+  explicit SymbolResolver(const ElfImage& image);
+
+  // No copy
+  SymbolResolver(SymbolResolver const&) = delete;
+  SymbolResolver& operator=(SymbolResolver const&) = delete;
+
+  off_t lookup(const string& name) const;
+  // Resolves all of `names` with at most one pass over the symbol table
+  vector<off_t> lookup(const vector<string>& names) const;
+
+  inline bool has_hash_table() const { return gnuBuckets_ != nullptr || sysvBuckets_ != nullptr; }
+};
+
+#endif
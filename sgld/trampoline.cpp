@@ -1,67 +1,23 @@
 #include "trampoline.h"
 #include "global.hpp"
-#include <assert.h>
+#include "symbol_resolver.h"
 #include <elf.h>
-#include <fcntl.h>
-#include <unistd.h>
 
-off_t Trampoline::getSymbolOffset(int fd, string ldname, string symbol)
+off_t Trampoline::getSymbolOffset(const ElfImage& image, const string& symbol)
 {
-  int i;
-  ssize_t rc;
-  Elf64_Shdr sect_hdr;
-  Elf64_Shdr symtab;
-  Elf64_Sym symtab_entry;
-  // FIXME: This needs to be dynamic
-  char strtab[100000];
-
-  int symtab_found = 0;
-
-  // Reset fd to beginning and parse file header
-  lseek(fd, 0, SEEK_SET);
-  Elf64_Ehdr elf_hdr;
-  rc = read(fd, &elf_hdr, sizeof(elf_hdr));
-  assert(rc == sizeof(elf_hdr));
-
-  // Get start of symbol table and string table
-  Elf64_Off shoff = elf_hdr.e_shoff;
-  lseek(fd, shoff, SEEK_SET);
-  for (i = 0; i < elf_hdr.e_shnum; i++) {
-    rc = read(fd, &sect_hdr, sizeof sect_hdr);
-    assert(rc == sizeof(sect_hdr));
-    if (sect_hdr.sh_type == SHT_SYMTAB) {
-      symtab       = sect_hdr;
-      symtab_found = 1;
-    }
-    if (sect_hdr.sh_type == SHT_STRTAB) {
-      int fd2 = open(ldname.c_str(), O_RDONLY);
-      lseek(fd2, sect_hdr.sh_offset, SEEK_SET);
-      if (sect_hdr.sh_size > sizeof(strtab)) {
-        DLOG(ERROR, "sect_hdr.sh_size =  %zu, sizeof(strtab) = %zu\n", sect_hdr.sh_size, sizeof(strtab));
-        assert(0);
-      }
-      assert(sect_hdr.sh_size = read(fd2, strtab, sect_hdr.sh_size));
-      close(fd2);
-    }
-  }
-
-  if (!symtab_found) {
-    DLOG(ERROR, "Failed to find symbol table in %s\n", ldname);
-    return -1;
-  }
+  auto offset = image.symbols().lookup(symbol);
+  if (offset == -1)
+    DLOG(ERROR, "Failed to find symbol (%s) in %s\n", symbol.c_str(), image.path().c_str());
+  return offset;
+}
 
-  // Move to beginning of symbol table
-  lseek(fd, symtab.sh_offset, SEEK_SET);
-  for (; lseek(fd, 0, SEEK_CUR) - symtab.sh_offset < symtab.sh_size;) {
-    rc = read(fd, &symtab_entry, sizeof symtab_entry);
-    assert(rc == sizeof(symtab_entry));
-    if (strcmp(strtab + symtab_entry.st_name, symbol.c_str()) == 0) {
-      // found address as offset from base address
-      return symtab_entry.st_value;
-    }
-  }
-  DLOG(ERROR, "Failed to find symbol (%s) in %s\n", symbol, ldname);
-  return -1;
+vector<off_t> Trampoline::getSymbolOffsets(const ElfImage& image, const vector<string>& symbols)
+{
+  auto offsets = image.symbols().lookup(symbols);
+  for (size_t i = 0; i < symbols.size(); i++)
+    if (offsets[i] == -1)
+      DLOG(ERROR, "Failed to find symbol (%s) in %s\n", symbols[i].c_str(), image.path().c_str());
+  return offsets;
 }
 
 // Returns 0 on success, -1 on failure
@@ -1,14 +1,17 @@
 #ifndef TRAMPOLINE_HPP
 #define TRAMPOLINE_HPP
 
+#include "elf_image.h"
 #include <string>
+#include <vector>
 
 using namespace std;
 
 class Trampoline {
 public:
   explicit Trampoline() = default;
-  off_t getSymbolOffset(int fd, string ldname, string symbol);
+  off_t getSymbolOffset(const ElfImage& image, const string& symbol);
+  vector<off_t> getSymbolOffsets(const ElfImage& image, const vector<string>& symbols);
   int insertTrampoline(void*, void*);
 };
 
@@ -1,28 +1,206 @@
 #ifndef WRAPPER_CPP
 #define WRAPPER_CPP
 
+// Preloaded in a program (LD_PRELOAD=libwrapper.so), accounts for its memory
+// calls: mmap, munmap, mremap, brk and madvise go on to libc through a table
+// resolved once, when the library is loaded, and are counted in the
+// MemoryAccount of the process, where mc reads them (see memory_account.hpp).
+//
+// Only the calls made through the dynamic symbols are seen: libc's own
+// (malloc's sbrk and mmap among them) use its internal aliases.
+
+#include "memory_account.hpp"
 #include <dlfcn.h>
-#include <iostream>
-#include <sys/mman.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
 
 using namespace std;
 
 typedef void* (*real_mmap_t)(void*, size_t, int, int, int, off_t);
+typedef int (*real_munmap_t)(void*, size_t);
+typedef void* (*real_mremap_t)(void*, size_t, size_t, int, ...);
+typedef int (*real_brk_t)(void*);
+typedef int (*real_madvise_t)(void*, size_t, int);
+
+// Until the table is resolved (dlsym itself may map memory), the calls go
+// straight to the kernel
+static void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+  return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+static int sys_munmap(void* addr, size_t length) { return syscall(SYS_munmap, addr, length); }
+
+static void* sys_mremap(void* oldAddr, size_t oldSize, size_t newSize, int flags, ...)
+{
+  va_list args;
+  va_start(args, flags);
+  void* newAddr = (flags & MREMAP_FIXED) ? va_arg(args, void*) : nullptr;
+  va_end(args);
+  return (void*)syscall(SYS_mremap, oldAddr, oldSize, newSize, flags, newAddr);
+}
+
+static int sys_brk(void* addr)
+{
+  auto reached = syscall(SYS_brk, addr);
+  if (reached < (long)addr) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_madvise(void* addr, size_t length, int advice) { return syscall(SYS_madvise, addr, length, advice); }
+
+static struct {
+  real_mmap_t mmap       = sys_mmap;
+  real_munmap_t munmap   = sys_munmap;
+  real_mremap_t mremap   = sys_mremap;
+  real_brk_t brk         = sys_brk;
+  real_madvise_t madvise = sys_madvise;
+} real;
+
+static MemoryAccount* account = nullptr;
+static bool ownsAccount       = false;
+static uintptr_t heapStart    = 0; // the program break as we found it
+static uintptr_t heapEnd      = 0; // and as brk() last set it
+
+// Set while this thread writes the mappings, so that a call from a signal
+// handler landing in the middle does not wait for itself
+static thread_local bool updating = false;
+static thread_local pid_t tid     = 0; // of this thread, once known; reset in the child of a fork
+
+template <typename Update> static inline void update_mappings(Update update)
+{
+  if (account == nullptr || updating)
+    return;
+  if (tid == 0)
+    tid = syscall(SYS_gettid);
+  if (!account->begin_update(tid))
+    return;
+  updating = true;
+  update(account->registry);
+  account->end_update();
+  updating = false;
+}
+
+template <typename T> static inline void resolve(T& function, const char* name)
+{
+  auto symbol = dlsym(RTLD_NEXT, name);
+  if (symbol != nullptr)
+    function = (T)symbol;
+}
+
+// The child of a fork gets its own account, starting from the mappings it inherited
+static void account_child()
+{
+  tid = 0;
+  if (account == nullptr)
+    return;
+  auto parent = account;
+  bool created;
+  account = nullptr;
+  account = MemoryAccount::attach(getpid(), created);
+  if (account != nullptr)
+    parent->snapshot(account->registry);
+  ownsAccount = account != nullptr && created;
+  real.munmap(parent, MemoryAccount::size());
+}
+
+__attribute__((constructor)) static void wrapper_init()
+{
+  resolve(real.mmap, "mmap");
+  resolve(real.munmap, "munmap");
+  resolve(real.mremap, "mremap");
+  resolve(real.brk, "brk");
+  resolve(real.madvise, "madvise");
+
+  heapStart = heapEnd = syscall(SYS_brk, 0);
+  account             = MemoryAccount::attach(getpid(), ownsAccount);
+  if (account == nullptr)
+    fprintf(stderr, "libwrapper: no memory account for %d: %s\n", getpid(), strerror(errno));
+  pthread_atfork(nullptr, nullptr, account_child);
+}
+
+__attribute__((destructor)) static void wrapper_fini()
+{
+  if (account != nullptr && ownsAccount && account->pid == getpid())
+    MemoryAccount::unlink(account->pid);
+}
+
+extern "C" {
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+  auto result = real.mmap(addr, length, prot, flags, fd, offset);
+  if (account == nullptr)
+    return result;
+  account->count(ACCOUNT_MMAP, result == MAP_FAILED, length);
+  if (result != MAP_FAILED)
+    update_mappings([&](MappingRegistry& registry) {
+      registry.add((uintptr_t)result, (uintptr_t)result + ROUND_UP(length), prot, flags);
+    });
+  return result;
+}
 
-void* real_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+int munmap(void* addr, size_t length)
 {
-  return ((real_mmap_t)dlsym(RTLD_NEXT, "mmap"))(addr, length, prot, flags, fd, offset);
+  auto result = real.munmap(addr, length);
+  if (account == nullptr)
+    return result;
+  account->count(ACCOUNT_MUNMAP, result != 0, length);
+  if (result == 0)
+    update_mappings(
+        [&](MappingRegistry& registry) { registry.remove((uintptr_t)addr, (uintptr_t)addr + ROUND_UP(length)); });
+  return result;
 }
 
-// void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
-// {
-//   puts("libwrapper, mmap()"); 
-//   return real_mmap(addr, length, prot, flags, fd, offset);
+void* mremap(void* oldAddr, size_t oldSize, size_t newSize, int flags, ...)
+{
+  va_list args;
+  va_start(args, flags);
+  void* newAddr = (flags & MREMAP_FIXED) ? va_arg(args, void*) : nullptr;
+  va_end(args);
+
+  auto result = real.mremap(oldAddr, oldSize, newSize, flags, newAddr);
+  if (account == nullptr)
+    return result;
+  account->count(ACCOUNT_MREMAP, result == MAP_FAILED, newSize);
+  if (result != MAP_FAILED)
+    update_mappings([&](MappingRegistry& registry) {
+      registry.remap((uintptr_t)oldAddr, ROUND_UP(oldSize), (uintptr_t)result, ROUND_UP(newSize));
+    });
+  return result;
+}
 
-//   // cout << "libwrapper, mmap()" << endl;
-//   // cout << "requested addr: " << std::hex << addr << endl;
-//   // void *maddr = (void*)((unsigned long)addr + (1000 * 0x1000LL));
-//   // return real_mmap(maddr, length, prot, flags, fd, offset);
-// }
+int brk(void* addr)
+{
+  auto result = real.brk(addr);
+  if (account == nullptr)
+    return result;
+  auto end = (uintptr_t)addr;
+  account->count(ACCOUNT_BRK, result != 0, result == 0 ? (end > heapEnd ? end - heapEnd : heapEnd - end) : 0);
+  if (result == 0 && end >= heapStart) {
+    auto previous = heapEnd;
+    heapEnd       = end;
+    update_mappings([&](MappingRegistry& registry) {
+      registry.remove(heapStart, ROUND_UP(max(previous, end)));
+      if (end > heapStart)
+        registry.add(heapStart, ROUND_UP(end), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+    });
+  }
+  return result;
+}
+
+// The advice leaves the mappings as they are, only the counters move
+int madvise(void* addr, size_t length, int advice)
+{
+  auto result = real.madvise(addr, length, advice);
+  if (account != nullptr)
+    account->count(ACCOUNT_MADVISE, result != 0, length);
+  return result;
+}
+}
 
-#endif
\ No newline at end of file
+#endif